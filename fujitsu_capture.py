@@ -0,0 +1,163 @@
+#!/usr/bin/env python3
+"""Fetch, decode and replay Fujitsu bus captures taken with /api/ac/capture.
+
+  fujitsu_capture.py fetch <host> [-o capture.fjcp]
+  fujitsu_capture.py dump <capture.fjcp>
+  fujitsu_capture.py stats <capture.fjcp>
+  fujitsu_capture.py replay <capture.fjcp> <serial port> [--speed 1.0] [--all]
+
+replay writes the captured indoor unit frames out of a usb serial adapter at 500 baud 8E1,
+spaced as they were recorded. wire the adapter tx to the rx pin of a bench board running the
+controller firmware and the frames go through the same uart, assembler and waitForFrame path
+as on the real bus, no indoor unit needed. needs pyserial for replay.
+"""
+
+import argparse
+import struct
+import sys
+import time
+import urllib.request
+
+MAGIC = b"FJCP"
+HEADER = struct.Struct("<4sHHII")
+ENTRY = struct.Struct("<IHBB8s")
+RX, TX = 0, 1
+
+# (byte, mask) per field, same table as src/AC/FujitsuFrameCodec.h
+FIELDS = [
+    ("src", 0, 0xFF), ("dst", 1, 0x7F), ("unknown", 1, 0x80), ("login", 1, 0x20),
+    ("type", 2, 0x30), ("write", 2, 0x08), ("on", 3, 0x01), ("mode", 3, 0x0E),
+    ("fan", 3, 0x70), ("error", 3, 0x80), ("eco", 4, 0x80), ("temp", 4, 0x7F),
+    ("magic", 5, 0xF0), ("swing", 5, 0x04), ("step", 5, 0x02), ("cp", 6, 0x01),
+    ("ctemp", 6, 0x7E),
+]
+
+
+def load(path):
+    with open(path, "rb") as f:
+        data = f.read()
+    magic, version, entry_size, capacity, first = HEADER.unpack_from(data)
+    if magic != MAGIC:
+        sys.exit("%s is not a capture file" % path)
+    if version != 1 or entry_size != ENTRY.size:
+        sys.exit("unsupported capture version %d (entry size %d)" % (version, entry_size))
+    entries = []
+    for off in range(HEADER.size, len(data) - entry_size + 1, entry_size):
+        entries.append(ENTRY.unpack_from(data, off))
+    return first, entries
+
+
+def decode(wire):
+    raw = bytes(b ^ 0xFF for b in wire)
+    fields = {}
+    for name, index, mask in FIELDS:
+        shift = (mask & -mask).bit_length() - 1
+        fields[name] = (raw[index] & mask) >> shift
+    return fields
+
+
+def gaps(first, entries):
+    """yields (entry, missing entries before it), sequence numbers wrap at 16 bits"""
+    expected = first & 0xFFFF
+    for entry in entries:
+        missing = (entry[1] - expected) & 0xFFFF
+        yield entry, missing
+        expected = (entry[1] + 1) & 0xFFFF
+
+
+def cmd_fetch(args):
+    url = "http://%s/api/ac/capture" % args.host
+    with urllib.request.urlopen(url, timeout=30) as response:
+        data = response.read()
+    with open(args.output, "wb") as f:
+        f.write(data)
+    print("%d entries written to %s" % ((len(data) - HEADER.size) // ENTRY.size, args.output))
+
+
+def cmd_dump(args):
+    first, entries = load(args.file)
+    last = None
+    for (ts, seq, direction, _, wire), missing in gaps(first, entries):
+        if missing:
+            print("... %d entries lost" % missing)
+        dt = 0 if last is None else (ts - last) & 0xFFFFFFFF
+        last = ts
+        f = decode(wire)
+        print("%5d %10d %+8.1fms %s %s  %s" % (
+            seq, ts, dt / 1000.0, "-->" if direction == TX else "<--", wire.hex(" "),
+            " ".join("%s:%d" % (name, f[name]) for name, _, _ in FIELDS)))
+
+
+def cmd_stats(args):
+    first, entries = load(args.file)
+    lost = sum(missing for _, missing in gaps(first, entries))
+    rx = [e for e in entries if e[2] == RX]
+    tx = [e for e in entries if e[2] == TX]
+    print("entries: %d (rx %d, tx %d), lost: %d" % (len(entries), len(rx), len(tx), lost))
+    if len(entries) > 1:
+        span = (entries[-1][0] - entries[0][0]) & 0xFFFFFFFF
+        print("span: %.1fs" % (span / 1e6))
+
+    # reply latency, from the last byte of each frame addressed to us to our reply going out
+    latencies = []
+    pending = None
+    for ts, _, direction, _, wire in entries:
+        if direction == TX:
+            if pending is not None:
+                latencies.append(((ts - pending) & 0xFFFFFFFF) / 1000.0)
+            pending = None
+        else:
+            f = decode(wire)
+            if tx and f["dst"] == decode(tx[0][4])["src"]:
+                pending = ts
+    if latencies:
+        latencies.sort()
+        pick = lambda q: latencies[min(len(latencies) - 1, int(q * len(latencies)))]
+        print("reply latency ms: min %.1f p50 %.1f p99 %.1f max %.1f (n=%d)" % (
+            latencies[0], pick(0.5), pick(0.99), latencies[-1], len(latencies)))
+
+
+def cmd_replay(args):
+    import serial
+
+    first, entries = load(args.file)
+    # by default only what the other devices on the bus said, the board under test answers
+    # for itself
+    frames = [e for e in entries if args.all or e[2] == RX]
+    port = serial.Serial(args.port, 500, bytesize=8, parity=serial.PARITY_EVEN, stopbits=1)
+    start = time.monotonic()
+    base = frames[0][0] if frames else 0
+    for ts, seq, _, _, wire in frames:
+        due = start + ((ts - base) & 0xFFFFFFFF) / 1e6 / args.speed
+        # timestamps are taken at the last byte, start sending one frame time earlier
+        delay = due - 0.176 - time.monotonic()
+        if delay > 0:
+            time.sleep(delay)
+        port.write(wire)
+        print("%5d %s" % (seq, wire.hex(" ")))
+    port.flush()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    sub = parser.add_subparsers(dest="command", required=True)
+    p = sub.add_parser("fetch")
+    p.add_argument("host")
+    p.add_argument("-o", "--output", default="capture.fjcp")
+    p.set_defaults(func=cmd_fetch)
+    for name, func in (("dump", cmd_dump), ("stats", cmd_stats)):
+        p = sub.add_parser(name)
+        p.add_argument("file")
+        p.set_defaults(func=func)
+    p = sub.add_parser("replay")
+    p.add_argument("file")
+    p.add_argument("port")
+    p.add_argument("--speed", type=float, default=1.0)
+    p.add_argument("--all", action="store_true", help="also replay the frames we sent")
+    p.set_defaults(func=cmd_replay)
+    args = parser.parse_args()
+    args.func(args)
+
+
+if __name__ == "__main__":
+    main()
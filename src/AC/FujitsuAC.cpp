@@ -1,290 +1,480 @@
 #include "FujitsuAC.h"
 
-ControlFrame FujitsuAC::decodeFrame() {
-    ControlFrame ff;
-
-    ff.messageSource       =  readBuf[0];
-    ff.messageDest         =  readBuf[1] & 0b01111111;
-    ff.messageType         = (readBuf[2] & 0b00110000) >> 4;
-
-    ff.acError             = (readBuf[kErrorIndex] & kErrorMask) >> kErrorOffset;
-    ff.temperature         = (readBuf[kTemperatureIndex] & kTemperatureMask) >> kTemperatureOffset;
-    ff.acMode              = (readBuf[kModeIndex] & kModeMask) >> kModeOffset;
-    ff.fanMode             = (readBuf[kFanIndex] & kFanMask) >> kFanOffset;
-    ff.economyMode         = (readBuf[kEconomyIndex] & kEconomyMask) >> kEconomyOffset;
-    ff.swingMode           = (readBuf[kSwingIndex] & kSwingMask) >> kSwingOffset;
-    ff.swingStep           = (readBuf[kSwingStepIndex] & kSwingStepMask) >> kSwingStepOffset;
-    ff.controllerPresent   = (readBuf[kControllerPresentIndex] & kControllerPresentMask) >> kControllerPresentOffset;
-    ff.updateMagic         = (readBuf[kUpdateMagicIndex] & kUpdateMagicMask) >> kUpdateMagicOffset;
-    ff.onOff               = (readBuf[kEnabledIndex] & kEnabledMask) >> kEnabledOffset;
-    ff.controllerTemp      = (readBuf[kControllerTempIndex] & kControllerTempMask) >> kControllerTempOffset; // there is one leading bit here that is unknown - probably a sign bit for negative temps?
-
-    ff.writeBit =   (readBuf[2] & 0b00001000) != 0;
-    ff.loginBit =   (readBuf[1] & 0b00100000) != 0;
-    ff.unknownBit = (readBuf[1] & 0b10000000)  > 0;
+// frame field behind each bit of the update and change masks
+static const FrameFieldId kUpdateFieldIds[8] = {
+    kFieldControllerTemp, // kControllerTempUpdateMask, reported as changed but never written
+    kFieldSwingStep,   // kSwingStepUpdateMask
+    kFieldSwing,       // kSwingModeUpdateMask
+    kFieldEconomy,     // kEconomyModeUpdateMask
+    kFieldFan,         // kFanModeUpdateMask
+    kFieldMode,        // kModeUpdateMask
+    kFieldTemperature, // kTempUpdateMask
+    kFieldEnabled,     // kOnOffUpdateMask
+};
+
+// what we take from the unit's status frames, through the glitch filter
+static constexpr uint64_t kReportedFieldsMask64 = kSettingsFieldsMask64
+                                                | fieldMask64(kFieldError)
+                                                | fieldMask64(kFieldControllerTemp);
+
+void FujitsuAC::connect(uart_port_t port, bool secondary){
+    return this->connect(port, secondary, -1, -1);
+}
 
-    return ff;
+void FujitsuAC::connect(uart_port_t port, bool secondary, int rxPin=-1, int txPin=-1){
+    uartPort = FujitsuUartPort(port, rxPin, txPin);
+    return this->connect(&uartPort, secondary);
 }
 
-void FujitsuAC::encodeFrame(ControlFrame ff){
+void FujitsuAC::connect(FujitsuBusPort *port, bool secondary){
+    bus = port;
+    uartQueue = bus->begin();
 
-    memset(writeBuf, 0, 8);
+    // when detecting, this is only where we start, nothing is sent until the role is known
+    setRole(secondary);
+    unansweredPrimaryPolls = 0;
 
-    writeBuf[0] = ff.messageSource;
+    lastFrameReceived = 0;
+    lastBusActivity = millis();
+    rateWindowStartMillis = millis();
 
-    writeBuf[1] &= 0b10000000;
-    writeBuf[1] |= ff.messageDest & 0b01111111;
+    // report something sane until the first status frame arrives
+    currentState.set<kFieldTemperature>(16);
+    currentState.set<kFieldControllerTemp>(16);
+    publishState();
 
-    writeBuf[2] &= 0b11001111;
-    writeBuf[2] |= ff.messageType << 4;
+    if(writeResults == nullptr) {
+        writeResults = xQueueCreate(kWriteResultQueueSize, sizeof(WriteResult));
+    }
 
-    if(ff.writeBit){
-        writeBuf[2] |= 0b00001000;
-    } else {
-        writeBuf[2] &= 0b11110111;
+    if(replyDueQueue == nullptr) {
+        replyDueQueue = xQueueCreate(1, sizeof(byte));
     }
 
-    writeBuf[1] &= 0b01111111;
-    if(ff.unknownBit) {
-        writeBuf[1] |= 0b10000000;
+    if(replyTimer == nullptr) {
+        esp_timer_create_args_t timerArgs = {};
+        timerArgs.callback = &FujitsuAC::onReplyTimer;
+        timerArgs.arg = this;
+        timerArgs.name = "fujitsu_reply";
+        esp_timer_create(&timerArgs, &replyTimer);
     }
+}
 
-    if(ff.loginBit){
-        writeBuf[1] |= 0b00100000;
+void FujitsuAC::setRole(bool secondary) {
+    if(secondary) {
+        controllerIsPrimary = false;
+        controllerAddress = static_cast<byte>(ACAddress::SECONDARY);
     } else {
-        writeBuf[1] &= 0b11011111;
+        controllerIsPrimary = true;
+        controllerAddress = static_cast<byte>(ACAddress::PRIMARY);
     }
+}
 
-    writeBuf[kModeIndex] =              (writeBuf[kModeIndex]              & ~kModeMask)              | (ff.acMode << kModeOffset);
-    writeBuf[kModeIndex] =              (writeBuf[kEnabledIndex]           & ~kEnabledMask)           | (ff.onOff << kEnabledOffset);
-    writeBuf[kFanIndex] =               (writeBuf[kFanIndex]               & ~kFanMask)               | (ff.fanMode << kFanOffset);
-    writeBuf[kErrorIndex] =             (writeBuf[kErrorIndex]             & ~kErrorMask)             | (ff.acError << kErrorOffset);
-    writeBuf[kEconomyIndex] =           (writeBuf[kEconomyIndex]           & ~kEconomyMask)           | (ff.economyMode << kEconomyOffset);
-    writeBuf[kTemperatureIndex] =       (writeBuf[kTemperatureIndex]       & ~kTemperatureMask)       | (ff.temperature << kTemperatureOffset);
-    writeBuf[kSwingIndex] =             (writeBuf[kSwingIndex]             & ~kSwingMask)             | (ff.swingMode << kSwingOffset);
-    writeBuf[kSwingStepIndex] =         (writeBuf[kSwingStepIndex]         & ~kSwingStepMask)         | (ff.swingStep << kSwingStepOffset);
-    writeBuf[kControllerPresentIndex] = (writeBuf[kControllerPresentIndex] & ~kControllerPresentMask) | (ff.controllerPresent << kControllerPresentOffset);
-    writeBuf[kUpdateMagicIndex] =       (writeBuf[kUpdateMagicIndex]       & ~kUpdateMagicMask)       | (ff.updateMagic << kUpdateMagicOffset);
-    writeBuf[kControllerTempIndex] =    (writeBuf[kControllerTempIndex]    & ~kControllerTempMask)    | (ff.controllerTemp << kControllerTempOffset);
+void FujitsuAC::detectRole(const FujitsuFrame &ff) {
+    byte source = ff.get<kFieldSource>();
+
+    if(source == static_cast<byte>(ACAddress::PRIMARY)) {
+        // a wall controller already holds the primary role
+        setRole(true);
+        detectingRole = false;
+    } else if(source == static_cast<byte>(ACAddress::UNIT) && ff.get<kFieldDest>() == static_cast<byte>(ACAddress::PRIMARY)) {
+        if(++unansweredPrimaryPolls >= kRoleDetectPolls) {
+            // nobody answers the unit as primary, we can write on every slot
+            setRole(false);
+            detectingRole = false;
+        }
+    }
+    // the outcome shows in isPrimary() and the metrics, the network task logs it
+}
 
+void FujitsuAC::handleUartEvent(uart_event_t &event) {
+    unsigned long now = micros();
+
+    switch(event.type) {
+        case UART_DATA: {
+            // a timeout event fires a few symbols after the last byte, a fifo full event right on it
+            unsigned long lastByteMicros = event.timeout_flag ? now - kUartRxTimeoutSymbols * kByteTimeMicros : now;
+            byte buf[kUartRxBufferSize / 4];
+            int len;
+            while((len = bus->read(buf, sizeof(buf))) > 0) {
+                for(int i=0;i<len;i++) {
+                    assembler.push(buf[i], lastByteMicros);
+                }
+            }
+            break;
+        }
+        case UART_PARITY_ERR:
+            parityErrors++;
+            dropRxData();
+            break;
+        case UART_FRAME_ERR:
+            framingErrors++;
+            dropRxData();
+            break;
+        case UART_BREAK:
+            breaks++;
+            assembler.reset();
+            break;
+        case UART_FIFO_OVF:
+        case UART_BUFFER_FULL:
+            // no queue reset, the queue is a member of the bus task's set and the set would
+            // keep counting the events thrown away. the ones still queued find nothing to read
+            rxOverflows++;
+            dropRxData();
+            break;
+        default:
+            break;
+    }
 }
 
-void FujitsuAC::connect(HardwareSerial *serial, bool secondary){
-    return this->connect(serial, secondary, -1, -1);
+void FujitsuAC::dropRxData() {
+    // whatever is buffered is suspect, start over at the next clean frame
+    bus->flushInput();
+    assembler.reset();
 }
 
-void FujitsuAC::connect(HardwareSerial *serial, bool secondary, int rxPin=-1, int txPin=-1){
-    _serial = serial;
-    if(rxPin != -1 && txPin != -1) {
-#ifdef ESP32
-        _serial->begin(500, SERIAL_8E1, rxPin, txPin);
-#else
-        Serial.print("Setting RX/TX pin unsupported, using defaults.\n"); // Serial.print("Setting RX/TX pin unsupported, using defaults.\n");
-        _serial->begin(500, SERIAL_8E1);
-#endif
-    } else {
-        _serial->begin(500, SERIAL_8E1);
+void FujitsuAC::serviceBus() {
+    if(pendingFrame && (long)(micros() - replyTargetMicros) >= 0) {
+        unsigned long lateMicros = micros() - replyTargetMicros;
+        if(lateMicros > kReplyLateLimitMicros) {
+            // the slot is long gone. any writes in it stay in flight and go out with the next
+            pendingFrame = false;
+            lateRepliesDropped++;
+        } else {
+            recordReplyJitter(lateMicros);
+            sendPendingFrame();
+        }
     }
-    _serial->setTimeout(200);
 
-    if(secondary) {
-        controllerIsPrimary = false;
-        controllerAddress = static_cast<byte>(ACAddress::SECONDARY);
-    } else {
-        controllerIsPrimary = true;
-        controllerAddress = static_cast<byte>(ACAddress::PRIMARY);
+    // complete frames first, a timeout event timestamps its frame further back than the
+    // frame gap and expiring first would throw it away
+    while(waitForFrame()) {
+        lastBusActivity = millis();
     }
+    assembler.expire(micros());
+    updateFrameRates();
 
-    lastFrameReceived = 0;
+    if(millis() - lastBusActivity > kConnectionTimeoutMillis) {
+        // counted in connectionResets, the network task logs it. no serial output on this task
+        resetConnection();
+        lastBusActivity = millis();
+    }
 }
 
 void FujitsuAC::resetConnection() {
-    _serial->flush();
-    controllerLoggedIn = false;
+    if(replyTimer != nullptr) {
+        esp_timer_stop(replyTimer);
+    }
+    pendingFrame = false;
+
+    // anything that never made it onto the wire, or was never confirmed, goes back into the
+    // next reply. that is not counted as a retry, the unit may not have seen it
+    retryFields |= inFlightFields | awaitingFields;
+    awaitingFields = 0;
+    inFlightFields = 0;
+    connectionResets++;
+    if(recoveryState == kRecoveryNone) {
+        // keep what was negotiated, the unit may well still have us logged in once the line
+        // comes back. the outage started with the last frame, not with the timeout
+        recoveryState = kRecoveryResuming;
+        recoveryStartMillis = lastBusActivity;
+        sessionSeenSecondary = seenSecondaryController;
+    }
+    echoPending = false;
+    lastSentFields = 0;
+    backoffSlots = 0;
+    lastFrameMicros = 0;
+    dropRxData();
     seenSecondaryController = false;
     lastFrameReceived = 0;
 }
 
-void FujitsuAC::printFrame(byte buf[8], ControlFrame ff) {
-    // Serial.printf("%X %X %X %X %X %X %X %X  ", buf[0], buf[1], buf[2], buf[3], buf[4], buf[5], buf[6], buf[7]);
-    // Serial.printf(" mSrc: %d mDst: %d mType: %d write: %d login: %d unknown: %d onOff: %d temp: %d, mode: %d cP:%d uM:%d cTemp:%d acError:%d \n", ff.messageSource, ff.messageDest, ff.messageType, ff.writeBit, ff.loginBit, ff.unknownBit, ff.onOff, ff.temperature, ff.acMode, ff.controllerPresent, ff.updateMagic, ff.controllerTemp, ff.acError);
-    Serial.printf("%X %X %X %X %X %X %X %X  ", buf[0], buf[1], buf[2], buf[3], buf[4], buf[5], buf[6], buf[7]);
-    Serial.printf(" mSrc: %d mDst: %d mType: %d write: %d login: %d unknown: %d onOff: %d temp: %d, mode: %d cP:%d uM:%d cTemp:%d acError:%d \n", ff.messageSource, ff.messageDest, ff.messageType, ff.writeBit, ff.loginBit, ff.unknownBit, ff.onOff, ff.temperature, ff.acMode, ff.controllerPresent, ff.updateMagic, ff.controllerTemp, ff.acError);
+void FujitsuAC::onReplyTimer(void *arg) {
+    // the write itself happens on the bus task so all protocol state stays on one task. it
+    // sleeps on a set holding this queue, a wake already queued when this one does not fit
+    // does the same job
+    FujitsuAC *ac = static_cast<FujitsuAC *>(arg);
+    byte due = 1;
+    xQueueSend(ac->replyDueQueue, &due, 0);
+}
+
+void FujitsuAC::scheduleReply() {
+    if(replyTimer == nullptr) {
+        return;
+    }
+
+    // the slot is measured from the last byte of the frame we are answering, not from when
+    // we got around to processing it
+    replyTargetMicros = assembler.getLastByteMicros() + replyDelayMicros;
+    long remaining = (long)(replyTargetMicros - micros());
+    if(remaining < 1) {
+        remaining = 1;
+    }
+
+    esp_timer_stop(replyTimer);
+    esp_timer_start_once(replyTimer, remaining);
+}
+
+void FujitsuAC::recordReplyJitter(unsigned long lateMicros) {
+    if((long)lateMicros < 0) {
+        lateMicros = 0;
+    }
+
+    byte bucket = 0;
+    while(bucket < kReplyJitterBuckets - 1 && lateMicros >= kReplyJitterBucketLimitsMicros[bucket]) {
+        bucket++;
+    }
+    replyJitterHistogram[bucket]++;
+
+    if(lateMicros > replyJitterMaxMicros) {
+        replyJitterMaxMicros = lateMicros;
+    }
+}
+
+void FujitsuAC::recordError(const FujitsuFrame &ff) {
+    uint32_t seq = errorsRecorded.load(std::memory_order_relaxed);
+    ACErrorRecord &record = errorHistory[seq & (kErrorHistorySize - 1)];
+    record.sequence = seq;
+    record.millis = millis();
+    record.source = ff.get<kFieldSource>();
+    record.code = (ff.raw >> 24) & 0xFF; // byte 3
+    ff.toBytes(record.frame);
+    record.state = currentState.raw;
+    errorsRecorded.store(seq + 1, std::memory_order_release);
+}
+
+void FujitsuAC::handleCollision() {
+    echoMismatches++;
+    echoPending = false;
+
+    // the unit most likely never saw the writes in the frame that collided, send them again.
+    // not counted as a retry, nothing was wrong with the write itself
+    byte lost = lastSentFields & awaitingFields;
+    retryFields |= lost;
+    awaitingFields &= ~lost;
+    lastSentFields = 0;
+
+    backoffSlots = 1 + esp_random() % kCollisionBackoffSlots;
+}
+
+void FujitsuAC::recordFrameGap(unsigned long frameMicros) {
+    if(lastFrameMicros != 0) {
+        // from the end of the previous frame to the start of this one, frames are only
+        // timestamped at their last byte
+        long gap = (long)(frameMicros - lastFrameMicros) - (long)(kFrameLength * kByteTimeMicros);
+        if(gap < 0) {
+            gap = 0;
+        }
 
+        byte bucket = 0;
+        while(bucket < kFrameGapBuckets - 1 && (unsigned long)gap >= kFrameGapBucketLimitsMicros[bucket]) {
+            bucket++;
+        }
+        frameGapHistogram[bucket]++;
+    }
+    lastFrameMicros = frameMicros;
+}
+
+void FujitsuAC::updateFrameRates() {
+    unsigned long elapsed = millis() - rateWindowStartMillis;
+    if(elapsed < kFrameRateWindowMillis) {
+        return;
+    }
+
+    receiveRate = (framesReceived - rateWindowReceived) * 1000.0f / elapsed;
+    sendRate = (framesSent - rateWindowSent) * 1000.0f / elapsed;
+    rateWindowReceived = framesReceived;
+    rateWindowSent = framesSent;
+    rateWindowStartMillis += elapsed;
 }
 
 void FujitsuAC::sendPendingFrame() {
-    if(pendingFrame && (millis() - lastFrameReceived) > 50) {
-        _serial->write(writeBuf, 8);
-        _serial->flush();
+    if(pendingFrame) {
+        // no flush and no read back here, the bus task must not wait on the wire. our own
+        // echo is skipped by waitForFrame as it carries our source address
+        bus->write(writeBuf, kFrameLength);
+        capture.record(kCaptureTx, writeBuf, micros());
         pendingFrame = false;
-        updateFields = 0;
+        framesSent++;
+        memcpy(lastSent, writeBuf, kFrameLength);
+        echoPending = true;
 
-        _serial->readBytes(writeBuf, 8); // read back our own frame so we dont process it again
+        // from here on the unit's status frames should start carrying the written values
+        byte sent = inFlightFields & trackedFields;
+        for(int i=0;i<8;i++) {
+            if(sent & (1 << i)) {
+                pendingWrites[i].framesWaited = 0;
+            }
+        }
+        awaitingFields |= sent;
+        lastSentFields = sent;
+        inFlightFields = 0;
     }
 }
 
 bool FujitsuAC::waitForFrame() {
-    ControlFrame ff;
+    FujitsuFrame ff;
+    byte fields;
 
-    if(_serial->available()) {
+    // only ever take complete frames, a partial frame stays in the assembler until the rest
+    // of it turns up with a later uart event
+    while(assembler.pop(readBuf)) {
 
-        memset(readBuf, 0, 8);
-        int bytesRead = _serial->readBytes(readBuf,8);
+        capture.record(kCaptureRx, readBuf, assembler.getLastByteMicros());
+        recordFrameGap(assembler.getLastByteMicros());
+        ff = FujitsuFrame::fromWire(readBuf);
 
-        if(bytesRead < 8) {
-            // skip incomplete frame
-            return false;
+        if(listenOnly) {
+            framesReceived++;
+            listenToFrame(ff);
+            return true;
         }
 
-        for(int i=0;i<8;i++) {
-            readBuf[i] ^= 0xFF;
+        if(detectingRole) {
+            framesReceived++;
+            detectRole(ff);
+            listenToFrame(ff);
+            return true;
         }
 
-        ff = decodeFrame();
+        if(ff.get<kFieldSource>() == controllerAddress) {
+            // echo of our own reply on the shared line, it should read back exactly as sent
+            if(echoPending && memcmp(readBuf, lastSent, kFrameLength) != 0) {
+                handleCollision();
+            }
+            echoPending = false;
+            continue;
+        }
 
-        if(debugPrint) {
-            Serial.printf("<-- "); // Serial.printf("<-- ");
-            printFrame(readBuf, ff);
+        if(echoPending) {
+            // someone else spoke before our reply came back, it never made it out intact
+            handleCollision();
         }
+        framesReceived++;
+
+        FujitsuFrame received = ff;
 
-        if(ff.messageDest == controllerAddress) {
+        byte messageDest = ff.get<kFieldDest>();
+        byte messageType = ff.get<kFieldMessageType>();
+
+        if(messageDest == controllerAddress) {
             lastFrameReceived = millis();
 
-            if(ff.messageType == static_cast<byte>(ACMessageType::STATUS)){
+            if(messageType == static_cast<byte>(ACMessageType::STATUS)){
+
+                trackRecovery(ff.get<kFieldControllerPresent>() == 1);
+                confirmWrites(received);
+                confirmReported(received);
 
-                if(ff.controllerPresent == 1) {
+                if(ff.get<kFieldControllerPresent>() == 1) {
                     // we have logged into the indoor unit
                     // this is what most frames are
-                    ff.messageSource     = controllerAddress;
+                    ff.set<kFieldSource>(controllerAddress);
 
                     if(seenSecondaryController) {
-                        ff.messageDest       = static_cast<byte>(ACAddress::SECONDARY);
-                        ff.loginBit          = true;
-                        ff.controllerPresent = 0;
+                        ff.set<kFieldDest>(static_cast<byte>(ACAddress::SECONDARY));
+                        ff.set<kFieldLoginBit>(1);
+                        ff.set<kFieldControllerPresent>(0);
                     } else {
-                        ff.messageDest       = static_cast<byte>(ACAddress::UNIT);
-                        ff.loginBit          = false;
-                        ff.controllerPresent = 1;
+                        ff.set<kFieldDest>(static_cast<byte>(ACAddress::UNIT));
+                        ff.set<kFieldLoginBit>(0);
+                        ff.set<kFieldControllerPresent>(1);
                     }
 
-                    ff.updateMagic       = 0;
-                    ff.unknownBit        = true;
-                    ff.writeBit          = 0;
-                    ff.messageType       = static_cast<byte>(ACMessageType::STATUS);
+                    ff.set<kFieldUpdateMagic>(0);
+                    ff.set<kFieldUnknownBit>(1);
+                    ff.set<kFieldWriteBit>(0);
+                    ff.set<kFieldMessageType>(static_cast<byte>(ACMessageType::STATUS));
 
                 } else {
                     if(controllerIsPrimary) {
                         // if this is the first message we have received, announce ourselves to the indoor unit
-                        ff.messageSource     = controllerAddress;
-                        ff.messageDest       = static_cast<byte>(ACAddress::UNIT);
-                        ff.loginBit          = false;
-                        ff.controllerPresent = 0;
-                        ff.updateMagic       = 0;
-                        ff.unknownBit        = true;
-                        ff.writeBit          = 0;
-                        ff.messageType       = static_cast<byte>(ACMessageType::LOGIN);
-
-                        ff.onOff             = 0;
-                        ff.temperature       = 0;
-                        ff.acMode            = 0;
-                        ff.fanMode           = 0;
-                        ff.swingMode         = 0;
-                        ff.swingStep         = 0;
-                        ff.acError           = 0;
+                        ff.set<kFieldSource>(controllerAddress);
+                        ff.set<kFieldDest>(static_cast<byte>(ACAddress::UNIT));
+                        ff.set<kFieldLoginBit>(0);
+                        ff.set<kFieldControllerPresent>(0);
+                        ff.set<kFieldUpdateMagic>(0);
+                        ff.set<kFieldUnknownBit>(1);
+                        ff.set<kFieldWriteBit>(0);
+                        ff.set<kFieldMessageType>(static_cast<byte>(ACMessageType::LOGIN));
+
+                        ff.clear(kLoginStateFieldsMask64);
                     } else {
                         // secondary controller never seems to get any other message types, only status with controllerPresent == 0
                         // the secondary controller seems to send the same flags no matter which message type
 
-                        ff.messageSource     = controllerAddress;
-                        ff.messageDest       = static_cast<byte>(ACAddress::UNIT);
-                        ff.loginBit          = false;
-                        ff.controllerPresent = 1;
-                        ff.updateMagic       = 2;
-                        ff.unknownBit        = true;
-                        ff.writeBit          = 0;
+                        ff.set<kFieldSource>(controllerAddress);
+                        ff.set<kFieldDest>(static_cast<byte>(ACAddress::UNIT));
+                        ff.set<kFieldLoginBit>(0);
+                        ff.set<kFieldControllerPresent>(1);
+                        ff.set<kFieldUpdateMagic>(2);
+                        ff.set<kFieldUnknownBit>(1);
+                        ff.set<kFieldWriteBit>(0);
                     }
 
                 }
 
-                // if we have any updates, set the flags
-                if(updateFields) {
-                    ff.writeBit = 1;
+                // collect pending updates, including any still waiting from a reply that was
+                // superseded before it went out
+                byte requested = updateFields.exchange(0, std::memory_order_acquire);
+                trackRequests(requested);
+                fields = inFlightFields | retryFields | requested;
+                retryFields = 0;
+                inFlightFields = fields;
+
+                // if we have any updates, set the flags and overlay the requested values
+                uint64_t mask = 0;
+                if(fields) {
+                    FujitsuFrame update = buildUpdateFrame(fields, &mask);
+                    ff.set<kFieldWriteBit>(1);
+                    ff.copyFrom(update, mask);
                 }
 
-                if(updateFields & kOnOffUpdateMask) {
-                    ff.onOff = updateState.onOff;
-                }
-
-                if(updateFields & kTempUpdateMask) {
-                    ff.temperature = updateState.temperature;
-                }
-
-                if(updateFields & kModeUpdateMask) {
-                    ff.acMode = updateState.acMode;
-                }
-
-                if(updateFields & kFanModeUpdateMask) {
-                    ff.fanMode = updateState.fanMode;
-                }
-
-                if(updateFields & kSwingModeUpdateMask) {
-                    ff.swingMode = updateState.swingMode;
-                }
-
-                if(updateFields & kSwingStepUpdateMask) {
-                    ff.swingStep = updateState.swingStep;
-                }
-
-                if(updateFields & kEconomyModeUpdateMask) {
-                    ff.economyMode = updateState.economyMode;
-                }
-
-                memcpy(&currentState, &ff, sizeof(ControlFrame));
+                // the reply still echoes what the unit sent, only what we publish is filtered.
+                // a write not yet confirmed shows the written value, not the one the unit
+                // reported before it
+                uint64_t trackedMask = 0;
+                FujitsuFrame tracked = buildTrackedFrame(&trackedMask);
+                currentState = ff;
+                currentState.copyFrom(reportedState, kReportedFieldsMask64 & ~(mask | trackedMask));
+                currentState.copyFrom(tracked, trackedMask);
+                publishState();
 
             }
-            else if(ff.messageType == static_cast<byte>(ACMessageType::LOGIN)){
+            else if(messageType == static_cast<byte>(ACMessageType::LOGIN)){
                 // received a login frame OK frame
                 // the primary will send packet to a secondary controller to see if it exists
-                ff.messageSource     = controllerAddress;
-                ff.messageDest       = static_cast<byte>(ACAddress::SECONDARY);
-                ff.loginBit          = true;
-                ff.controllerPresent = 1;
-                ff.updateMagic       = 0;
-                ff.unknownBit        = true;
-                ff.writeBit          = 0;
-
-                ff.onOff             = currentState.onOff;
-                ff.temperature       = currentState.temperature;
-                ff.acMode            = currentState.acMode;
-                ff.fanMode           = currentState.fanMode;
-                ff.swingMode         = currentState.swingMode;
-                ff.swingStep         = currentState.swingStep;
-                ff.acError           = currentState.acError;
-            } else if(ff.messageType == static_cast<byte>(ACMessageType::ERROR)) {
-                Serial.printf("AC ERROR RECV: "); // Serial.printf("AC ERROR RECV: ");
-                printFrame(readBuf, ff);
-                // handle errors here
-                return false;
+                ff.set<kFieldSource>(controllerAddress);
+                ff.set<kFieldDest>(static_cast<byte>(ACAddress::SECONDARY));
+                ff.set<kFieldLoginBit>(1);
+                ff.set<kFieldControllerPresent>(1);
+                ff.set<kFieldUpdateMagic>(0);
+                ff.set<kFieldUnknownBit>(1);
+                ff.set<kFieldWriteBit>(0);
+
+                ff.copyFrom(currentState, kLoginStateFieldsMask64);
+            } else if(messageType == static_cast<byte>(ACMessageType::ERROR)) {
+                recordError(ff);
+                continue;
             }
 
-            encodeFrame(ff);
-
-            if(debugPrint) {
-                Serial.printf("--> "); // Serial.printf("--> ");
-                printFrame(writeBuf, ff);
+            if(backoffSlots > 0) {
+                // backing off after a collision, let this slot go by. any writes in the reply
+                // stay in flight and go out with the next one
+                backoffSlots--;
+                repliesSkipped++;
+                return true;
             }
 
-            for(int i=0;i<8;i++) {
-                writeBuf[i] ^= 0xFF;
-            }
+            ff.toWire(writeBuf);
 
             pendingFrame = true;
+            scheduleReply();
 
-
-        } else if (ff.messageDest == static_cast<byte>(ACAddress::SECONDARY)) {
+        } else if (messageDest == static_cast<byte>(ACAddress::SECONDARY)) {
             seenSecondaryController = true;
-            currentState.controllerTemp = ff.controllerTemp; // we dont have a temp sensor, use the temp reading from the secondary controller
+            currentState.set<kFieldControllerTemp>(ff.get<kFieldControllerTemp>()); // we dont have a temp sensor, use the temp reading from the secondary controller
+            publishState();
         }
 
         return true;
@@ -293,6 +483,168 @@ bool FujitsuAC::waitForFrame() {
     return false;
 }
 
+void FujitsuAC::listenToFrame(const FujitsuFrame &ff) {
+    if(ff.get<kFieldSource>() != static_cast<byte>(ACAddress::UNIT)) {
+        // a wall controller talking, whatever it writes shows up in the unit's next status frame
+        return;
+    }
+
+    lastFrameReceived = millis();
+
+    byte messageType = ff.get<kFieldMessageType>();
+    if(messageType == static_cast<byte>(ACMessageType::ERROR)) {
+        recordError(ff);
+    } else if(messageType == static_cast<byte>(ACMessageType::STATUS)) {
+        trackRecovery(true);
+        confirmReported(ff);
+        currentState.copyFrom(reportedState, kReportedFieldsMask64);
+        publishState();
+    }
+}
+
+void FujitsuAC::trackRecovery(bool loggedIn) {
+    if(recoveryState == kRecoveryNone) {
+        return;
+    }
+
+    if(!controllerIsPrimary || listenOnly) {
+        // a secondary is only ever sent status frames without controllerPresent and a listener
+        // never logs in, nothing tells a resume from a login. the outage is over, count neither
+        finishRecovery();
+        return;
+    }
+
+    if(loggedIn) {
+        if(recoveryState == kRecoveryResuming) {
+            // the unit never dropped us, carry on where we left off
+            seenSecondaryController = sessionSeenSecondary;
+            fastResumes++;
+        }
+        finishRecovery();
+    } else if(recoveryState == kRecoveryResuming) {
+        // the unit has forgotten us, log in from scratch and take its state as it comes
+        recoveryState = kRecoveryLogin;
+        fullLogins++;
+        reportedValid = false;
+    }
+}
+
+void FujitsuAC::finishRecovery() {
+    lastRecoveryMillis = millis() - recoveryStartMillis;
+    if(lastRecoveryMillis > maxRecoveryMillis) {
+        maxRecoveryMillis = lastRecoveryMillis;
+    }
+    recoveryState = kRecoveryNone;
+}
+
+void FujitsuAC::confirmReported(const FujitsuFrame &status) {
+    if(!reportedValid) {
+        // nothing to hold a first frame against, take it as it is
+        reportedState.copyFrom(status, kReportedFieldsMask64);
+        memset(candidateFrames, 0, sizeof(candidateFrames));
+        reportedValid = true;
+        return;
+    }
+
+    for(int i=0;i<8;i++) {
+        FrameFieldId field = kUpdateFieldIds[i];
+        byte value = (status.raw & fieldMask64(field)) >> fieldShift64(field);
+        byte reported = (reportedState.raw & fieldMask64(field)) >> fieldShift64(field);
+
+        if(value == reported) {
+            if(candidateFrames[i] > 0) {
+                // flipped back before it was confirmed
+                glitchesRejected++;
+                candidateFrames[i] = 0;
+            }
+            continue;
+        }
+
+        if(candidateFrames[i] > 0 && candidateValues[i] == value) {
+            candidateFrames[i]++;
+        } else {
+            if(candidateFrames[i] > 0) {
+                glitchesRejected++;
+            }
+            candidateValues[i] = value;
+            candidateFrames[i] = 1;
+        }
+
+        if(candidateFrames[i] >= confirmFrames) {
+            reportedState.raw = (reportedState.raw & ~fieldMask64(field)) | ((uint64_t)value << fieldShift64(field));
+            candidateFrames[i] = 0;
+        }
+    }
+
+    // a single bit with no settings behind it, the error history has the detail
+    reportedState.copyFrom(status, fieldMask64(kFieldError));
+}
+
+void FujitsuAC::setConfirmFrames(byte frames) {
+    confirmFrames = frames < 1 ? 1 : frames;
+}
+
+byte FujitsuAC::getConfirmFrames() {
+    return confirmFrames;
+}
+
+unsigned long FujitsuAC::getFastResumes() {
+    return fastResumes;
+}
+
+unsigned long FujitsuAC::getFullLogins() {
+    return fullLogins;
+}
+
+unsigned long FujitsuAC::getLastRecoveryMillis() {
+    return lastRecoveryMillis;
+}
+
+unsigned long FujitsuAC::getMaxRecoveryMillis() {
+    return maxRecoveryMillis;
+}
+
+bool FujitsuAC::isRecovering() {
+    return recoveryState != kRecoveryNone;
+}
+
+unsigned long FujitsuAC::getGlitchesRejected() {
+    return glitchesRejected;
+}
+
+void FujitsuAC::setRoleDetection(bool enabled) {
+    detectingRole = enabled;
+}
+
+bool FujitsuAC::isDetectingRole() {
+    return detectingRole;
+}
+
+bool FujitsuAC::isPrimary() {
+    return controllerIsPrimary;
+}
+
+unsigned long FujitsuAC::getRoleWritesApplied(bool primary) {
+    return roleWritesApplied[primary ? 0 : 1];
+}
+
+unsigned long FujitsuAC::getRoleWriteLatencyAverage(bool primary) {
+    byte role = primary ? 0 : 1;
+    return roleWritesApplied[role] ? roleWriteLatencyTotalMillis[role] / roleWritesApplied[role] : 0;
+}
+
+unsigned long FujitsuAC::getRoleWriteLatencyMax(bool primary) {
+    return roleWriteLatencyMaxMillis[primary ? 0 : 1];
+}
+
+void FujitsuAC::setListenOnly(bool enabled) {
+    listenOnly = enabled;
+}
+
+bool FujitsuAC::isListenOnly() {
+    return listenOnly;
+}
+
 bool FujitsuAC::isBound() {
     if(millis() - lastFrameReceived < 1000) {
         return true;
@@ -300,75 +652,396 @@ bool FujitsuAC::isBound() {
     return false;
 }
 
+void FujitsuAC::setReplyDelay(unsigned long micros) {
+    replyDelayMicros = micros;
+}
+
+unsigned long FujitsuAC::getReplyDelay() {
+    return replyDelayMicros;
+}
+
+const unsigned long *FujitsuAC::getReplyJitterHistogram() {
+    return replyJitterHistogram;
+}
+
+unsigned long FujitsuAC::getReplyJitterMax() {
+    return replyJitterMaxMicros;
+}
+
+unsigned long FujitsuAC::getLateRepliesDropped() {
+    return lateRepliesDropped;
+}
+
+unsigned long FujitsuAC::getParityErrors() {
+    return parityErrors;
+}
+
+unsigned long FujitsuAC::getFramingErrors() {
+    return framingErrors;
+}
+
+unsigned long FujitsuAC::getBreaks() {
+    return breaks;
+}
+
+unsigned long FujitsuAC::getRxOverflows() {
+    return rxOverflows;
+}
+
+unsigned long FujitsuAC::getFramesReceived() {
+    return framesReceived;
+}
+
+unsigned long FujitsuAC::getFramesSent() {
+    return framesSent;
+}
+
+float FujitsuAC::getReceiveRate() {
+    return receiveRate;
+}
+
+float FujitsuAC::getSendRate() {
+    return sendRate;
+}
+
+unsigned long FujitsuAC::getIncompleteFrames() {
+    return assembler.getIncompleteFrames();
+}
+
+unsigned long FujitsuAC::getResyncBytes() {
+    return assembler.getResyncBytes();
+}
+
+uint32_t FujitsuAC::getErrorFrames() {
+    return errorsRecorded.load(std::memory_order_acquire);
+}
+
+uint32_t FujitsuAC::getOldestError() {
+    uint32_t end = errorsRecorded.load(std::memory_order_acquire);
+    return end > kErrorHistorySize ? end - kErrorHistorySize : 0;
+}
+
+bool FujitsuAC::readError(uint32_t seq, ACErrorRecord *record) {
+    *record = errorHistory[seq & (kErrorHistorySize - 1)];
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return errorsRecorded.load(std::memory_order_relaxed) - seq < kErrorHistorySize;
+}
+
+unsigned long FujitsuAC::getEchoMismatches() {
+    return echoMismatches;
+}
+
+unsigned long FujitsuAC::getRepliesSkipped() {
+    return repliesSkipped;
+}
+
+const unsigned long *FujitsuAC::getFrameGapHistogram() {
+    return frameGapHistogram;
+}
+
 bool FujitsuAC::updatePending() {
-    if(updateFields) {
+    if(updateFields.load() || inFlightFields) {
         return true;
     }
     return false;
 }
 
-void FujitsuAC::setOnOff(bool o){
-    updateFields |= kOnOffUpdateMask;
-    updateState.onOff = o ? 1 : 0;
+void FujitsuAC::requestUpdate(byte updateMask, byte value, uint32_t commandId) {
+    if(listenOnly) {
+        return;
+    }
+
+    int i = __builtin_ctz(updateMask);
+    if((updateFields.load(std::memory_order_acquire) & updateMask) && updateCommandIds[i] != commandId) {
+        // replaced before the bus task picked it up, it never goes out. the caller still gets
+        // a result for it
+        WriteResult result;
+        result.commandId = updateCommandIds[i];
+        result.field = updateMask;
+        result.status = kWriteSuperseded;
+        result.value = updateValues[i];
+        result.retries = 0;
+        result.latencyMillis = (micros() - updateRequestMicros[i]) / 1000;
+        postWriteResult(result);
+    }
+
+    updateValues[i] = value;
+    updateCommandIds[i] = commandId;
+    updateRequestMicros[i] = micros();
+    updateFields.fetch_or(updateMask, std::memory_order_release);
 }
-void FujitsuAC::setTemp(byte t){
-    updateFields |= kTempUpdateMask;
-    updateState.temperature = t;
+
+void FujitsuAC::trackRequests(byte fields) {
+    for(int i=1;i<8;i++) {
+        byte bit = 1 << i;
+        if(!(fields & bit)) {
+            continue;
+        }
+
+        uint32_t commandId = updateCommandIds[i];
+        byte value = updateValues[i] & fieldMaxValue(kFrameFields[kUpdateFieldIds[i]].mask);
+
+        if(trackedFields & bit) {
+            if(pendingWrites[i].commandId == commandId && pendingWrites[i].value == value) {
+                // the same write handed back after a connection reset, keep its clock running
+                continue;
+            }
+            reportWrite(bit, kWriteSuperseded);
+        }
+
+        pendingWrites[i].commandId = commandId;
+        pendingWrites[i].requestMicros = updateRequestMicros[i];
+        pendingWrites[i].value = value;
+        pendingWrites[i].framesWaited = 0;
+        pendingWrites[i].retries = 0;
+        trackedFields |= bit;
+        awaitingFields &= ~bit;
+        retryFields &= ~bit;
+    }
+}
+
+void FujitsuAC::confirmWrites(const FujitsuFrame &status) {
+    for(int i=1;i<8;i++) {
+        byte bit = 1 << i;
+        if(!(awaitingFields & bit)) {
+            continue;
+        }
+
+        FrameFieldId field = kUpdateFieldIds[i];
+        byte reported = (status.raw & fieldMask64(field)) >> fieldShift64(field);
+        if(reported == pendingWrites[i].value) {
+            // it is the value we wrote, no need to wait out the glitch filter for it
+            reportedState.raw = (reportedState.raw & ~fieldMask64(field)) | ((uint64_t)reported << fieldShift64(field));
+            candidateFrames[i] = 0;
+            reportWrite(bit, kWriteApplied);
+        } else if(++pendingWrites[i].framesWaited >= kWriteConfirmFrames) {
+            awaitingFields &= ~bit;
+            if(pendingWrites[i].retries < kWriteMaxRetries) {
+                pendingWrites[i].retries++;
+                writeRetries++;
+                retryFields |= bit;
+            } else {
+                reportWrite(bit, kWriteFailed);
+            }
+        }
+    }
+}
+
+void FujitsuAC::reportWrite(byte field, byte status) {
+    PendingWrite &write = pendingWrites[__builtin_ctz(field)];
+
+    WriteResult result;
+    result.commandId = write.commandId;
+    result.field = field;
+    result.status = status;
+    result.value = write.value;
+    result.retries = write.retries;
+    result.latencyMillis = (micros() - write.requestMicros) / 1000;
+
+    if(status == kWriteApplied) {
+        byte bucket = 0;
+        while(bucket < kWriteLatencyBuckets - 1 && result.latencyMillis >= kWriteLatencyBucketLimitsMillis[bucket]) {
+            bucket++;
+        }
+        writeLatencyHistogram[bucket]++;
+        writesApplied++;
+
+        byte role = controllerIsPrimary ? 0 : 1;
+        roleWritesApplied[role]++;
+        roleWriteLatencyTotalMillis[role] += result.latencyMillis;
+        if(result.latencyMillis > roleWriteLatencyMaxMillis[role]) {
+            roleWriteLatencyMaxMillis[role] = result.latencyMillis;
+        }
+    } else if(status == kWriteFailed) {
+        writeFailures++;
+    }
+
+    trackedFields &= ~field;
+    awaitingFields &= ~field;
+    retryFields &= ~field;
+
+    postWriteResult(result);
+}
+
+void FujitsuAC::postWriteResult(const WriteResult &result) {
+    if(writeResults != nullptr && xQueueSend(writeResults, &result, 0) != pdTRUE) {
+        // nobody is collecting results, keep the newest
+        WriteResult dropped;
+        xQueueReceive(writeResults, &dropped, 0);
+        xQueueSend(writeResults, &result, 0);
+    }
 }
-void FujitsuAC::setMode(byte m){
-    updateFields |= kModeUpdateMask;
-    updateState.acMode = m;
+
+bool FujitsuAC::takeWriteResult(WriteResult *result) {
+    return writeResults != nullptr && xQueueReceive(writeResults, result, 0) == pdTRUE;
 }
-void FujitsuAC::setFanMode(byte fm){
-    updateFields |= kFanModeUpdateMask;
-    updateState.fanMode = fm;
+
+bool FujitsuAC::getPendingWrite(byte updateMask, byte *value, uint32_t *commandId) {
+    // trackedFields belongs to the bus task, a stale read costs at most one redundant write
+    if(!((updateFields.load(std::memory_order_acquire) | trackedFields) & updateMask)) {
+        return false;
+    }
+    // the last request for the field is the one being written, or is about to replace it
+    *value = updateValues[__builtin_ctz(updateMask)];
+    if(commandId != nullptr) {
+        *commandId = updateCommandIds[__builtin_ctz(updateMask)];
+    }
+    return true;
 }
-void FujitsuAC::setEconomyMode(byte em){
-    updateFields |= kEconomyModeUpdateMask;
-    updateState.economyMode = em;
+
+const unsigned long *FujitsuAC::getWriteLatencyHistogram() {
+    return writeLatencyHistogram;
 }
-void FujitsuAC::setSwingMode(byte sm){
-    updateFields |= kSwingModeUpdateMask;
-    updateState.swingMode = sm;
+
+unsigned long FujitsuAC::getWritesApplied() {
+    return writesApplied;
 }
-void FujitsuAC::setSwingStep(byte ss){
-    updateFields |= kSwingStepUpdateMask;
-    updateState.swingStep = ss;
+
+unsigned long FujitsuAC::getWriteRetries() {
+    return writeRetries;
+}
+
+unsigned long FujitsuAC::getWriteFailures() {
+    return writeFailures;
+}
+
+FujitsuFrame FujitsuAC::buildUpdateFrame(byte fields, uint64_t *mask) {
+    FujitsuFrame update;
+    *mask = 0;
+
+    for(int i=1;i<8;i++) {
+        if(fields & (1 << i)) {
+            FrameFieldId field = kUpdateFieldIds[i];
+            update.raw |= ((uint64_t)updateValues[i] << fieldShift64(field)) & fieldMask64(field);
+            *mask |= fieldMask64(field);
+        }
+    }
+
+    return update;
+}
+
+FujitsuFrame FujitsuAC::buildTrackedFrame(uint64_t *mask) {
+    FujitsuFrame tracked;
+    *mask = 0;
+
+    for(int i=1;i<8;i++) {
+        if(trackedFields & (1 << i)) {
+            FrameFieldId field = kUpdateFieldIds[i];
+            tracked.raw |= ((uint64_t)pendingWrites[i].value << fieldShift64(field)) & fieldMask64(field);
+            *mask |= fieldMask64(field);
+        }
+    }
+
+    return tracked;
+}
+
+byte FujitsuAC::diffFields(const FujitsuFrame &a, const FujitsuFrame &b) {
+    uint64_t diff = a.raw ^ b.raw;
+    byte fields = 0;
+
+    if(diff == 0) {
+        return 0;
+    }
+
+    for(int i=0;i<8;i++) {
+        if(diff & fieldMask64(kUpdateFieldIds[i])) {
+            fields |= (1 << i);
+        }
+    }
+    return fields;
+}
+
+void FujitsuAC::publishState() {
+    uint32_t sequence = stateSequence.load(std::memory_order_relaxed);
+
+    byte fields = diffFields(stateBuffers[sequence & 1], currentState);
+    if(fields) {
+        changedFields.fetch_or(fields, std::memory_order_relaxed);
+    }
+
+    stateBuffers[(sequence + 1) & 1] = currentState;
+    stateSequence.store(sequence + 1, std::memory_order_release);
+}
+
+void FujitsuAC::setOnOff(bool o, uint32_t commandId){
+    requestUpdate(kOnOffUpdateMask, o ? 1 : 0, commandId);
+}
+void FujitsuAC::setTemp(byte t, uint32_t commandId){
+    requestUpdate(kTempUpdateMask, t, commandId);
+}
+void FujitsuAC::setMode(byte m, uint32_t commandId){
+    requestUpdate(kModeUpdateMask, m, commandId);
+}
+void FujitsuAC::setFanMode(byte fm, uint32_t commandId){
+    requestUpdate(kFanModeUpdateMask, fm, commandId);
+}
+void FujitsuAC::setEconomyMode(byte em, uint32_t commandId){
+    requestUpdate(kEconomyModeUpdateMask, em, commandId);
+}
+void FujitsuAC::setSwingMode(byte sm, uint32_t commandId){
+    requestUpdate(kSwingModeUpdateMask, sm, commandId);
+}
+void FujitsuAC::setSwingStep(byte ss, uint32_t commandId){
+    requestUpdate(kSwingStepUpdateMask, ss, commandId);
 }
 
 bool FujitsuAC::getOnOff(){
-    return currentState.onOff == 1 ? true : false;
+    return getCurrentState().get<kFieldEnabled>() == 1 ? true : false;
 }
 byte FujitsuAC::getTemp(){
-    return currentState.temperature;
+    return getCurrentState().get<kFieldTemperature>();
 }
 byte FujitsuAC::getMode(){
-    return currentState.acMode;
+    return getCurrentState().get<kFieldMode>();
 }
 byte FujitsuAC::getFanMode(){
-    return currentState.fanMode;
+    return getCurrentState().get<kFieldFan>();
 }
 byte FujitsuAC::getEconomyMode(){
-    return currentState.economyMode;
+    return getCurrentState().get<kFieldEconomy>();
 }
 byte FujitsuAC::getSwingMode(){
-    return currentState.swingMode;
+    return getCurrentState().get<kFieldSwing>();
 }
 byte FujitsuAC::getSwingStep(){
-    return currentState.swingStep;
+    return getCurrentState().get<kFieldSwingStep>();
 }
 byte FujitsuAC::getControllerTemp(){
-    return currentState.controllerTemp;
+    return getCurrentState().get<kFieldControllerTemp>();
 }
 
-ControlFrame *FujitsuAC::getCurrentState(){
-    return &currentState;
+FujitsuFrame FujitsuAC::getCurrentState(){
+    FujitsuFrame snapshot;
+    uint32_t before;
+    uint32_t after;
+
+    do {
+        before = stateSequence.load(std::memory_order_acquire);
+        snapshot = stateBuffers[before & 1];
+        std::atomic_thread_fence(std::memory_order_acquire);
+        after = stateSequence.load(std::memory_order_relaxed);
+    } while(before != after);
+
+    return snapshot;
 }
 
-ControlFrame *FujitsuAC::getUpdateState(){
-    return &updateState;
+FujitsuFrame FujitsuAC::getUpdateState(){
+    uint64_t mask;
+    return buildUpdateFrame(0xFF, &mask);
 }
 
 byte FujitsuAC::getUpdateFields(){
-    return updateFields;
+    return updateFields.load();
+}
+
+uint32_t FujitsuAC::getStateSequence(){
+    return stateSequence.load(std::memory_order_acquire);
+}
+
+byte FujitsuAC::takeChangedFields(){
+    return changedFields.exchange(0, std::memory_order_acquire);
+}
+
+uint32_t FujitsuAC::getConnectionResets(){
+    return connectionResets.load();
 }
@@ -1,114 +1,343 @@
-#include <HardwareSerial.h>
-#include <Arduino.h>
-
-
-const byte kModeIndex = 3;
-const byte kModeMask = 0b00001110;
-const byte kModeOffset = 1;
-
-const byte kFanIndex = 3;
-const byte kFanMask = 0b01110000;
-const byte kFanOffset = 4;
-
-const byte kEnabledIndex = 3;
-const byte kEnabledMask = 0b00000001;
-const byte kEnabledOffset = 0;
+#ifndef FUJITSU_AC_H
+#define FUJITSU_AC_H
 
-const byte kErrorIndex = 3;
-const byte kErrorMask = 0b10000000;
-const byte kErrorOffset = 7;
+#include <Arduino.h>
+#include <esp_timer.h>
+#include <driver/uart.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/queue.h>
+#include <atomic>
+#include "FujitsuFrameAssembler.h"
+#include "FujitsuBusPort.h"
+#include "FujitsuFrame.h"
+#include "FujitsuCapture.h"
+
+
+// replies go out this long after the last byte of the frame they answer
+const unsigned long kDefaultReplyDelayMicros = 60000;
+
+// upper bounds of the reply timer lateness histogram buckets, the last bucket catches the rest
+const byte kReplyJitterBuckets = 8;
+const unsigned long kReplyJitterBucketLimitsMicros[kReplyJitterBuckets - 1] = { 250, 500, 1000, 2000, 5000, 10000, 20000 };
+// a reply this far past its slot could land on the unit's next frame, it is dropped instead
+const unsigned long kReplyLateLimitMicros = kByteTimeMicros;
+
+// a write the unit has not reported back within this many of its status frames is sent again,
+// up to kWriteMaxRetries times before it is given up on
+const byte kWriteConfirmFrames = 3;
+const byte kWriteMaxRetries = 2;
+
+// upper bounds of the command to applied latency histogram buckets, the last bucket catches the rest
+const byte kWriteLatencyBuckets = 8;
+const unsigned long kWriteLatencyBucketLimitsMillis[kWriteLatencyBuckets - 1] = { 250, 500, 750, 1000, 1500, 2000, 5000 };
+
+const UBaseType_t kWriteResultQueueSize = 16;
+
+enum WriteStatus : byte {
+    kWriteApplied = 0,    // the unit reported the requested value
+    kWriteFailed,         // still not applied after all retries
+    kWriteSuperseded,     // a newer write to the same field replaced it first
+};
 
-const byte kEconomyIndex = 4;
-const byte kEconomyMask = 0b10000000;
-const byte kEconomyOffset = 7;
+// outcome of one field written by a setter, commandId is whatever the caller passed in
+struct WriteResult {
+    uint32_t commandId;
+    byte     field;       // one of the update masks
+    byte     status;      // WriteStatus
+    byte     value;
+    byte     retries;
+    uint32_t latencyMillis;
+};
 
-const byte kTemperatureIndex = 4;
-const byte kTemperatureMask = 0b01111111;
-const byte kTemperatureOffset = 0;
+// an error frame from the unit. its layout is not known beyond the header, code is the first
+// payload byte (power, mode and fan on a status frame) and the whole frame is kept so older
+// records can be read again once more of it is understood
+struct ACErrorRecord {
+    uint32_t sequence;
+    uint32_t millis;
+    byte     source;
+    byte     code;
+    byte     frame[kFrameLength]; // not inverted
+    uint64_t state;               // our last published state when it arrived
+};
 
-const byte kUpdateMagicIndex = 5;
-const byte kUpdateMagicMask = 0b11110000;
-const byte kUpdateMagicOffset = 4;
+const uint32_t kErrorHistorySize = 16; // power of two
 
-const byte kSwingIndex = 5;
-const byte kSwingMask = 0b00000100;
-const byte kSwingOffset = 2;
+// upper bounds of the inter-frame gap histogram buckets, the last bucket catches the rest
+const byte kFrameGapBuckets = 8;
+const unsigned long kFrameGapBucketLimitsMicros[kFrameGapBuckets - 1] = { 20000, 40000, 60000, 80000, 120000, 250000, 1000000 };
 
-const byte kSwingStepIndex = 5;
-const byte kSwingStepMask = 0b00000010;
-const byte kSwingStepOffset = 1;
+// frames per second are averaged over this window
+const unsigned long kFrameRateWindowMillis = 10000;
 
-const byte kControllerPresentIndex = 6;
-const byte kControllerPresentMask = 0b00000001;
-const byte kControllerPresentOffset = 0;
+// after a collision up to this many of our reply slots are let go by, picked at random so
+// two controllers that collided do not pick the same slot again. the unit tolerates a few
+// missed replies before it logs a controller out
+const byte kCollisionBackoffSlots = 2;
 
-const byte kControllerTempIndex = 6;
-const byte kControllerTempMask = 0b01111110;
-const byte kControllerTempOffset = 1;
+// a field the unit reports has to read the same in this many status frames in a row before
+// the change is published, a single corrupted frame then never reaches the observers
+const byte kDefaultConfirmFrames = 2;
 
+// while detecting the role, this many polls of the primary address going unanswered means
+// there is no primary wall controller and we take that role
+const byte kRoleDetectPolls = 3;
 
-typedef struct ControlFrames  {
-    byte onOff = 0;
-    byte temperature = 16;
-    byte acMode = 0;
-    byte fanMode = 0;
-    byte acError = 0;
-    byte economyMode = 0;
-    byte swingMode = 0;
-    byte swingStep = 0;
-    byte controllerPresent = 0;
-    byte updateMagic = 0; // unsure what this value indicates
-    byte controllerTemp = 16;
+// the bus is declared lost and the login starts over after this long without a frame
+const unsigned long kConnectionTimeoutMillis = 2000;
 
-    bool writeBit = false;
-    bool loginBit = false;
-    bool unknownBit = false; // unsure what this bit indicates
 
-    byte messageType = 0;
-    byte messageSource = 0;
-    byte messageDest = 0;
-} ControlFrame;
 
 class FujitsuAC
 {
   private:
-    HardwareSerial *_serial;
+    FujitsuUartPort uartPort;
+    FujitsuBusPort *bus = nullptr;
+    QueueHandle_t   uartQueue = nullptr;
+    QueueHandle_t   replyDueQueue = nullptr; // the reply timer wakes the bus task through this
+    FujitsuFrameAssembler assembler;
     byte            readBuf[8];
     byte            writeBuf[8];
 
     byte            controllerAddress;
     bool            controllerIsPrimary = true;
-    bool            seenSecondaryController = false;
-    bool            controllerLoggedIn = false;
-    unsigned long   lastFrameReceived;
+    bool            listenOnly = false;
+    bool            detectingRole = false;
+    byte            unansweredPrimaryPolls = 0;
 
-    byte            updateFields;
-    ControlFrame    updateState;
-    ControlFrame    currentState;
+    void setRole(bool secondary);
+    void detectRole(const FujitsuFrame &ff);
+    bool            seenSecondaryController = false;
 
-    ControlFrame decodeFrame();
-    void encodeFrame(ControlFrame ff);
-    void printFrame(byte buf[8], ControlFrame ff);
+    // after the line goes quiet the session is kept and tried again first. if the unit's next
+    // frame still has us logged in we carry on, otherwise it is a full login. only a primary
+    // can tell, for a secondary or a listener just the recovery time is kept
+    enum RecoveryState : byte {
+        kRecoveryNone = 0,
+        kRecoveryResuming,
+        kRecoveryLogin,
+    };
+    RecoveryState   recoveryState = kRecoveryNone;
+    bool            sessionSeenSecondary = false;
+    unsigned long   recoveryStartMillis = 0;
+    volatile unsigned long lastRecoveryMillis = 0;
+    volatile unsigned long maxRecoveryMillis = 0;
+    unsigned long   fastResumes = 0;
+    unsigned long   fullLogins = 0;
+
+    void trackRecovery(bool loggedIn);
+    void finishRecovery();
+    unsigned long   lastFrameReceived;
+    unsigned long   lastBusActivity = 0;
+    std::atomic<uint32_t> connectionResets{0};
+
+    // setters run on the async_tcp and loop tasks. they store the value in updateValues first
+    // and then publish its bit in updateFields, the bus task collects the bits before reading
+    // the values. several writes to one field before the next slot collapse into the last one.
+    // values are kept a byte per field so concurrent setters never share a read-modify-write
+    std::atomic<uint8_t> updateFields{0};
+    volatile byte   updateValues[8] = {};
+    byte            inFlightFields = 0; // fields encoded into the reply waiting on the timer
+    volatile uint32_t updateCommandIds[8] = {};
+    volatile unsigned long updateRequestMicros[8] = {};
+
+    // bus task side of write confirmation. a write is tracked from the moment the bus task
+    // picks it up until the unit reports the value back, fails or is superseded
+    struct PendingWrite {
+        uint32_t      commandId;
+        unsigned long requestMicros;
+        byte          value;
+        byte          framesWaited;
+        byte          retries;
+    };
+    PendingWrite    pendingWrites[8];
+    byte            trackedFields = 0;  // writes not yet confirmed
+    byte            awaitingFields = 0; // of those, the ones already sent and being watched for
+    byte            retryFields = 0;    // to go out again with the next reply
+    QueueHandle_t   writeResults = nullptr;
+
+    unsigned long   writeLatencyHistogram[kWriteLatencyBuckets] = {};
+    unsigned long   writesApplied = 0;
+    unsigned long   writeRetries = 0;
+    unsigned long   writeFailures = 0;
+
+    // command to applied latency per role, 0 primary and 1 secondary
+    unsigned long   roleWritesApplied[2] = {};
+    unsigned long long roleWriteLatencyTotalMillis[2] = {};
+    unsigned long   roleWriteLatencyMaxMillis[2] = {};
+
+    void trackRequests(byte fields);
+    void confirmWrites(const FujitsuFrame &status);
+    void reportWrite(byte field, byte status);
+    void postWriteResult(const WriteResult &result);
+
+    // bus task private state, other tasks read the published copy in stateBuffers
+    FujitsuFrame    currentState;
+
+    // the unit's own view of the fields, as confirmed by the glitch filter. a changed value is
+    // a candidate until it has been seen confirmFrames times in a row
+    FujitsuFrame    reportedState;
+    bool            reportedValid = false;
+    byte            confirmFrames = kDefaultConfirmFrames;
+    byte            candidateValues[8] = {};
+    byte            candidateFrames[8] = {};
+    unsigned long   glitchesRejected = 0;
+
+    void confirmReported(const FujitsuFrame &status);
+
+    // double buffered snapshot, stateSequence is bumped after each publish and selects the
+    // buffer readers copy from. a reader retries if a publish overlapped its copy
+    FujitsuFrame    stateBuffers[2];
+    std::atomic<uint32_t> stateSequence{0};
+
+    // fields that differ between successive published states, same bit layout as the update
+    // masks. accumulated until a consumer takes them
+    std::atomic<uint8_t> changedFields{0};
+
+    void publishState();
+    byte diffFields(const FujitsuFrame &a, const FujitsuFrame &b);
+    void requestUpdate(byte updateMask, byte value, uint32_t commandId);
+    FujitsuFrame buildUpdateFrame(byte fields, uint64_t *mask);
+    FujitsuFrame buildTrackedFrame(uint64_t *mask);
+
+    volatile bool   pendingFrame = false;
+
+    esp_timer_handle_t replyTimer = nullptr;
+    unsigned long   replyDelayMicros = kDefaultReplyDelayMicros;
+    unsigned long   replyTargetMicros = 0;
+    unsigned long   replyJitterHistogram[kReplyJitterBuckets] = {};
+    unsigned long   replyJitterMaxMicros = 0;
+    unsigned long   lateRepliesDropped = 0;
+
+    void scheduleReply();
+    void recordReplyJitter(unsigned long lateMicros);
+    static void onReplyTimer(void *arg);
 
-    bool pendingFrame = false;
+    bool waitForFrame();
+    void listenToFrame(const FujitsuFrame &ff);
+    void sendPendingFrame();
+    void resetConnection();
+    void serviceBus();
+    void handleUartEvent(uart_event_t &event);
+    void dropRxData();
+
+    unsigned long   parityErrors = 0;
+    unsigned long   framingErrors = 0;
+    unsigned long   breaks = 0;
+    unsigned long   rxOverflows = 0;
+
+    // bus statistics, only the bus task counts
+    unsigned long   framesReceived = 0;
+    unsigned long   framesSent = 0;
+    unsigned long   echoMismatches = 0;
+    byte            lastSent[kFrameLength];
+    byte            lastSentFields = 0; // writes carried by lastSent
+    bool            echoPending = false;
+    byte            backoffSlots = 0;
+    unsigned long   repliesSkipped = 0;
+    unsigned long   lastFrameMicros = 0;
+    unsigned long   frameGapHistogram[kFrameGapBuckets] = {};
+    unsigned long   rateWindowStartMillis = 0;
+    unsigned long   rateWindowReceived = 0;
+    unsigned long   rateWindowSent = 0;
+    volatile float  receiveRate = 0;
+    volatile float  sendRate = 0;
+
+    void recordFrameGap(unsigned long frameMicros);
+    void handleCollision();
+
+    // error frames, written by the bus task only, same overwrite check as the capture ring
+    ACErrorRecord   errorHistory[kErrorHistorySize];
+    std::atomic<uint32_t> errorsRecorded{0};
+
+    void recordError(const FujitsuFrame &ff);
+    void updateFrameRates();
+
+    friend class FujitsuBusScheduler;
 
   public:
-    void connect(HardwareSerial *serial, bool secondary);
-    void connect(HardwareSerial *serial, bool secondary, int rxPin, int txPin);
-    void resetConnection();
+    void connect(uart_port_t port, bool secondary);
+    void connect(uart_port_t port, bool secondary, int rxPin, int txPin);
+    void connect(FujitsuBusPort *port, bool secondary);
+
+    // listen-only never logs in or writes anything, state is decoded from the unit's frames
+    // to the wall controllers. set before connect, setters are ignored while it is on
+    void setListenOnly(bool enabled);
+    bool isListenOnly();
+
+    // 1 publishes every frame as it comes, as before the filter
+    void setConfirmFrames(byte frames);
+    byte getConfirmFrames();
+    // field changes that did not last long enough to be published
+    unsigned long getGlitchesRejected();
+
+    // recoveries from a lost line, measured from the last frame before it went quiet to the
+    // first frame that has us logged in again
+    unsigned long getFastResumes();
+    unsigned long getFullLogins();
+    unsigned long getLastRecoveryMillis();
+    unsigned long getMaxRecoveryMillis();
+    bool isRecovering();
+
+    // with detection on the driver only listens after connect, until the traffic shows
+    // whether a primary wall controller is present. then it takes whichever role is free.
+    // set before connect
+    void setRoleDetection(bool enabled);
+    bool isDetectingRole();
+    bool isPrimary();
+
+    unsigned long getRoleWritesApplied(bool primary);
+    unsigned long getRoleWriteLatencyAverage(bool primary);
+    unsigned long getRoleWriteLatencyMax(bool primary);
 
-    bool waitForFrame();
-    void sendPendingFrame();
     bool isBound();
     bool updatePending();
 
-    void setOnOff(bool o);
-    void setTemp(byte t);
-    void setMode(byte m);
-    void setFanMode(byte fm);
-    void setEconomyMode(byte em);
-    void setSwingMode(byte sm);
-    void setSwingStep(byte ss);
+    void setReplyDelay(unsigned long micros);
+    unsigned long getReplyDelay();
+    const unsigned long *getReplyJitterHistogram();
+    unsigned long getReplyJitterMax();
+    unsigned long getLateRepliesDropped();
+
+    unsigned long getParityErrors();
+    unsigned long getFramingErrors();
+    unsigned long getBreaks();
+    unsigned long getRxOverflows();
+
+    unsigned long getFramesReceived();
+    unsigned long getFramesSent();
+    float getReceiveRate();
+    float getSendRate();
+    unsigned long getIncompleteFrames();
+    unsigned long getResyncBytes();
+    uint32_t getErrorFrames();
+    uint32_t getOldestError();
+    // copies error number seq out of the history, false once it has been overwritten
+    bool readError(uint32_t seq, ACErrorRecord *record);
+    // our reply did not come back off the line as it was sent, a collision or a bad line
+    unsigned long getEchoMismatches();
+    // reply slots let go by while backing off after a collision
+    unsigned long getRepliesSkipped();
+    const unsigned long *getFrameGapHistogram();
+
+    // commandId comes back in the WriteResult for the field, 0 when nobody is asking
+    void setOnOff(bool o, uint32_t commandId = 0);
+    void setTemp(byte t, uint32_t commandId = 0);
+    void setMode(byte m, uint32_t commandId = 0);
+    void setFanMode(byte fm, uint32_t commandId = 0);
+    void setEconomyMode(byte em, uint32_t commandId = 0);
+    void setSwingMode(byte sm, uint32_t commandId = 0);
+    void setSwingStep(byte ss, uint32_t commandId = 0);
+
+    bool takeWriteResult(WriteResult *result);
+    // true while a write to the field is queued or not yet confirmed, value is what it writes
+    // and commandId the command whose result will answer it
+    bool getPendingWrite(byte updateMask, byte *value, uint32_t *commandId = nullptr);
+    const unsigned long *getWriteLatencyHistogram();
+    unsigned long getWritesApplied();
+    unsigned long getWriteRetries();
+    unsigned long getWriteFailures();
 
     bool getOnOff();
     byte getTemp();
@@ -119,11 +348,15 @@ class FujitsuAC
     byte getSwingStep();
     byte getControllerTemp();
 
-    ControlFrame *getCurrentState();
-    ControlFrame *getUpdateState();
+    FujitsuFrame getCurrentState();
+    FujitsuFrame getUpdateState();
     byte getUpdateFields();
+    uint32_t getStateSequence();
+    byte takeChangedFields();
+    uint32_t getConnectionResets();
 
-    bool debugPrint = false;
+    // raw rx/tx frames, off until started. also what FujitsuTracePrinter prints from
+    FujitsuCapture capture;
 };
 
 enum class ACMode : byte {
@@ -164,3 +397,6 @@ const byte kFanModeUpdateMask     = 0b00010000;
 const byte kEconomyModeUpdateMask = 0b00001000;
 const byte kSwingModeUpdateMask   = 0b00000100;
 const byte kSwingStepUpdateMask   = 0b00000010;
+const byte kControllerTempUpdateMask = 0b00000001; // read only, only ever reported as changed
+
+#endif
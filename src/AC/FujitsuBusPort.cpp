@@ -0,0 +1,42 @@
+#include "FujitsuBusPort.h"
+#include "FujitsuFrameAssembler.h"
+
+QueueHandle_t FujitsuUartPort::begin() {
+    QueueHandle_t queue = nullptr;
+
+    uart_config_t uartConfig = {};
+    uartConfig.baud_rate = 500;
+    uartConfig.data_bits = UART_DATA_8_BITS;
+    uartConfig.parity = UART_PARITY_EVEN;
+    uartConfig.stop_bits = UART_STOP_BITS_1;
+    uartConfig.flow_ctrl = UART_HW_FLOWCTRL_DISABLE;
+    uartConfig.source_clk = UART_SCLK_APB;
+
+    if(uart_driver_install(port, kUartRxBufferSize, kUartTxBufferSize, kUartEventQueueSize, &queue, 0) != ESP_OK) {
+        return nullptr;
+    }
+    uart_param_config(port, &uartConfig);
+    uart_set_pin(port,
+                 txPin == -1 ? UART_PIN_NO_CHANGE : txPin,
+                 rxPin == -1 ? UART_PIN_NO_CHANGE : rxPin,
+                 UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE);
+
+    // raise a data event as soon as a whole frame is in the fifo, or shortly after the line
+    // goes quiet with less than a frame in it
+    uart_set_rx_full_threshold(port, kFrameLength);
+    uart_set_rx_timeout(port, kUartRxTimeoutSymbols);
+
+    return queue;
+}
+
+int FujitsuUartPort::read(byte *buf, size_t len) {
+    return uart_read_bytes(port, buf, len, 0);
+}
+
+int FujitsuUartPort::write(const byte *buf, size_t len) {
+    return uart_write_bytes(port, (const char *)buf, len);
+}
+
+void FujitsuUartPort::flushInput() {
+    uart_flush_input(port);
+}
@@ -0,0 +1,47 @@
+#ifndef FUJITSU_BUS_PORT_H
+#define FUJITSU_BUS_PORT_H
+
+#include <Arduino.h>
+#include <driver/uart.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+
+const int  kUartRxBufferSize = 256;
+const int  kUartTxBufferSize = 256;
+const int  kUartEventQueueSize = 16;
+const byte kUartRxTimeoutSymbols = 2;
+
+// The line FujitsuAC talks over. A port owns the queue the bus task sleeps on and posts
+// uart_event_t events into it, UART_DATA when bytes can be read and the error events for
+// whatever went wrong on the line. All calls below come from the bus task.
+class FujitsuBusPort
+{
+  public:
+    virtual ~FujitsuBusPort() {}
+
+    // sets the port up at 500 baud 8E1, returns the event queue or nullptr on failure
+    virtual QueueHandle_t begin() = 0;
+    virtual int read(byte *buf, size_t len) = 0;
+    virtual int write(const byte *buf, size_t len) = 0;
+    virtual void flushInput() = 0;
+};
+
+// the real bus, through the ESP-IDF uart driver
+class FujitsuUartPort : public FujitsuBusPort
+{
+  private:
+    uart_port_t port;
+    int         rxPin;
+    int         txPin;
+
+  public:
+    FujitsuUartPort(uart_port_t port = UART_NUM_2, int rxPin = -1, int txPin = -1)
+        : port(port), rxPin(rxPin), txPin(txPin) {}
+
+    QueueHandle_t begin() override;
+    int read(byte *buf, size_t len) override;
+    int write(const byte *buf, size_t len) override;
+    void flushInput() override;
+};
+
+#endif
@@ -0,0 +1,80 @@
+#include "FujitsuBusScheduler.h"
+
+bool FujitsuBusScheduler::addUnit(FujitsuAC *unit) {
+    if(busTask != nullptr || unitCount >= kMaxBusUnits || unit->uartQueue == nullptr || unit->replyDueQueue == nullptr) {
+        return false;
+    }
+
+    units[unitCount] = unit;
+    queues[unitCount] = unit->uartQueue;
+    replyQueues[unitCount] = unit->replyDueQueue;
+    unitCount++;
+    return true;
+}
+
+bool FujitsuBusScheduler::start() {
+    if(busTask != nullptr || unitCount == 0) {
+        return false;
+    }
+
+    // a set has to be able to hold every event of every member queue, plus one reply wakeup
+    // per unit
+    queueSet = xQueueCreateSet((kUartEventQueueSize + 1) * unitCount);
+    if(queueSet == nullptr) {
+        return false;
+    }
+    for(int i=0;i<unitCount;i++) {
+        xQueueAddToSet(queues[i], queueSet);
+        xQueueAddToSet(replyQueues[i], queueSet);
+    }
+
+    return xTaskCreatePinnedToCore(&FujitsuBusScheduler::busTaskLoop, "fujitsu_bus", kBusTaskStackSize, this, kBusTaskPriority, &busTask, kBusTaskCore) == pdPASS;
+}
+
+void FujitsuBusScheduler::busTaskLoop(void *arg) {
+    FujitsuBusScheduler *scheduler = static_cast<FujitsuBusScheduler *>(arg);
+
+    for(;;) {
+        scheduler->runOnce(kBusTaskHousekeepingTicks);
+    }
+}
+
+void FujitsuBusScheduler::runOnce(TickType_t wait) {
+    uart_event_t event;
+    byte due;
+
+    // sleeps until a uart driver has a frame or an error for us, or a reply timer fires
+    QueueSetMemberHandle_t ready = xQueueSelectFromSet(queueSet, wait);
+
+    for(int i=0;ready != nullptr && i<unitCount;i++) {
+        if(queues[i] == ready) {
+            if(xQueueReceive(queues[i], &event, 0) == pdTRUE) {
+                units[i]->handleUartEvent(event);
+            }
+        } else if(replyQueues[i] == ready) {
+            // serviceBus sends the reply
+            xQueueReceive(replyQueues[i], &due, 0);
+        } else {
+            continue;
+        }
+        units[i]->serviceBus();
+        lastServiced[i] = xTaskGetTickCount();
+    }
+
+    // a quiet line still needs its timeouts checked while the others keep the task busy
+    TickType_t now = xTaskGetTickCount();
+    for(int i=0;i<unitCount;i++) {
+        if(now - lastServiced[i] >= kBusTaskHousekeepingTicks) {
+            units[i]->serviceBus();
+            lastServiced[i] = now;
+        }
+    }
+}
+
+byte FujitsuBusScheduler::getUnitCount() {
+    return unitCount;
+}
+
+TaskHandle_t FujitsuBusScheduler::getTask() {
+    return busTask;
+}
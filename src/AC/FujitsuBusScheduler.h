@@ -0,0 +1,47 @@
+#ifndef FUJITSU_BUS_SCHEDULER_H
+#define FUJITSU_BUS_SCHEDULER_H
+
+#include <Arduino.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/queue.h>
+#include "FujitsuAC.h"
+
+const byte kMaxBusUnits = 3;
+
+const uint32_t    kBusTaskStackSize = 4096;
+const UBaseType_t kBusTaskPriority  = 12; // above the loop and async_tcp tasks, below esp_timer
+const BaseType_t  kBusTaskCore      = 1;
+const TickType_t  kBusTaskHousekeepingTicks = pdMS_TO_TICKS(100);
+
+// Runs the protocol engine of every FujitsuAC on one task. The units' event queues and reply
+// wakeups are joined in a queue set, so the task sleeps until any of the lines has something
+// for it and then handles that one unit. Units never preempt each other, a reply timer that
+// fires while another unit is being serviced just waits in its queue for the next turn.
+class FujitsuBusScheduler
+{
+  private:
+    FujitsuAC       *units[kMaxBusUnits];
+    QueueHandle_t   queues[kMaxBusUnits];
+    QueueHandle_t   replyQueues[kMaxBusUnits];
+    TickType_t      lastServiced[kMaxBusUnits] = {};
+    byte            unitCount = 0;
+    QueueSetHandle_t queueSet = nullptr;
+    TaskHandle_t    busTask = nullptr;
+
+    static void busTaskLoop(void *arg);
+
+  public:
+    // units must be connected first, and all of them added before start
+    bool addUnit(FujitsuAC *unit);
+    bool start();
+
+    // one turn of the bus task, waits up to wait ticks for an event and services the units.
+    // the task runs it forever, the native tests call it themselves
+    void runOnce(TickType_t wait);
+
+    byte getUnitCount();
+    TaskHandle_t getTask();
+};
+
+#endif
@@ -0,0 +1,86 @@
+#include "FujitsuCapture.h"
+
+bool FujitsuCapture::start(byte user) {
+    if(entries == nullptr) {
+        entries = (CaptureEntry *)calloc(kCaptureEntries, sizeof(CaptureEntry));
+        if(entries == nullptr) {
+            return false;
+        }
+    }
+    users.fetch_or(user, std::memory_order_release);
+    return true;
+}
+
+void FujitsuCapture::stop(byte user) {
+    users.fetch_and(~user, std::memory_order_release);
+}
+
+void FujitsuCapture::clear() {
+    // the ring itself belongs to the bus task, just hide everything recorded so far
+    cleared.store(written.load(std::memory_order_acquire));
+}
+
+bool FujitsuCapture::isEnabled() {
+    return users.load(std::memory_order_acquire) != 0;
+}
+
+bool FujitsuCapture::isUsedBy(byte user) {
+    return (users.load(std::memory_order_acquire) & user) != 0;
+}
+
+void FujitsuCapture::record(byte direction, const byte frame[kFrameLength], uint32_t timestampMicros) {
+    if(users.load(std::memory_order_acquire) == 0) {
+        return;
+    }
+
+    uint32_t seq = written.load(std::memory_order_relaxed);
+    CaptureEntry &entry = entries[seq & (kCaptureEntries - 1)];
+    entry.micros = timestampMicros;
+    entry.sequence = seq;
+    entry.direction = direction;
+    entry.flags = 0;
+    memcpy(entry.frame, frame, kFrameLength);
+
+    written.store(seq + 1, std::memory_order_release);
+}
+
+uint32_t FujitsuCapture::getWritten() {
+    return written.load(std::memory_order_acquire);
+}
+
+uint32_t FujitsuCapture::getOldest() {
+    uint32_t end = written.load(std::memory_order_acquire);
+    uint32_t first = cleared.load();
+    if(end - first > kCaptureEntries) {
+        first = end - kCaptureEntries;
+    }
+    return first;
+}
+
+uint32_t FujitsuCapture::getCount() {
+    return getWritten() - getOldest();
+}
+
+bool FujitsuCapture::read(uint32_t seq, CaptureEntry *entry) {
+    if(entries == nullptr) {
+        return false;
+    }
+
+    *entry = entries[seq & (kCaptureEntries - 1)];
+
+    // while the bus task records entry seq + kCaptureEntries it is overwriting this slot,
+    // so the copy only counts if the writer had not got that far once it finished
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return written.load(std::memory_order_relaxed) - seq < kCaptureEntries;
+}
+
+void FujitsuCapture::writeHeader(byte buf[kCaptureHeaderSize], uint32_t first) {
+    uint16_t entrySize = sizeof(CaptureEntry);
+    uint32_t capacity = kCaptureEntries;
+
+    memcpy(buf, kCaptureMagic, 4);
+    memcpy(buf + 4, &kCaptureFormatVersion, 2);
+    memcpy(buf + 6, &entrySize, 2);
+    memcpy(buf + 8, &capacity, 4);
+    memcpy(buf + 12, &first, 4);
+}
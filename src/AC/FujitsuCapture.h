@@ -0,0 +1,67 @@
+#ifndef FUJITSU_CAPTURE_H
+#define FUJITSU_CAPTURE_H
+
+#include <Arduino.h>
+#include <atomic>
+#include "FujitsuFrameAssembler.h"
+
+const byte kCaptureRx = 0;
+const byte kCaptureTx = 1;
+
+// one captured frame, 16 bytes little endian as exported. the frame is kept exactly as it was
+// on the wire, still inverted, so a capture can be played straight back into a uart
+struct CaptureEntry {
+    uint32_t micros;
+    uint16_t sequence; // low bits of the capture sequence number, gaps mean dropped entries
+    byte     direction;
+    byte     flags;    // reserved
+    byte     frame[kFrameLength];
+};
+
+static_assert(sizeof(CaptureEntry) == 16, "capture entries are exported as 16 bytes");
+
+// export format: this header followed by the entries, oldest first, until the end of the body.
+// header is the magic, u16 version, u16 entry size, u32 ring capacity, u32 sequence number of
+// the first entry
+const char     kCaptureMagic[4] = { 'F', 'J', 'C', 'P' };
+const uint16_t kCaptureFormatVersion = 1;
+const byte     kCaptureHeaderSize = 16;
+
+// ~4 frames a second on the bus, this holds the last few minutes of traffic
+const uint32_t kCaptureEntries = 1024; // power of two
+
+// who wants the ring recording, it keeps going until none of them does
+const byte kCaptureUserHttp  = 0b01;
+const byte kCaptureUserTrace = 0b10;
+
+// Records bus frames into a fixed ring while any user wants it. Only the bus task records,
+// any other task may read. The buffer is allocated the first time a capture starts and then
+// kept, so an idle controller pays nothing for it.
+class FujitsuCapture
+{
+  private:
+    CaptureEntry           *entries = nullptr;
+    std::atomic<uint8_t>    users{0};
+    std::atomic<uint32_t>   written{0}; // entries ever recorded, only the bus task moves it
+    std::atomic<uint32_t>   cleared{0}; // entries before this one are hidden by clear()
+
+  public:
+    bool start(byte user = kCaptureUserHttp);
+    void stop(byte user = kCaptureUserHttp);
+    void clear();
+    // recording, for whichever user
+    bool isEnabled();
+    bool isUsedBy(byte user);
+
+    void record(byte direction, const byte frame[kFrameLength], uint32_t timestampMicros);
+
+    uint32_t getWritten();
+    uint32_t getCount();
+    uint32_t getOldest();
+
+    // copies entry number seq out of the ring, false once it has been overwritten
+    bool read(uint32_t seq, CaptureEntry *entry);
+    void writeHeader(byte buf[kCaptureHeaderSize], uint32_t first);
+};
+
+#endif
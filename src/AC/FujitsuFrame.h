@@ -0,0 +1,80 @@
+#ifndef FUJITSU_FRAME_H
+#define FUJITSU_FRAME_H
+
+#include <Arduino.h>
+#include "FujitsuFrameCodec.h"
+#include "FujitsuFrameAssembler.h"
+
+// Field positions inside the frame held as one little endian 64 bit word, byte i of the
+// frame is bits 8i..8i+7
+constexpr byte fieldShift64(FrameFieldId f) {
+    return 8 * kFrameFields[f].index + fieldOffset(kFrameFields[f].mask);
+}
+
+constexpr uint64_t fieldMask64(FrameFieldId f) {
+    return (uint64_t)kFrameFields[f].mask << (8 * kFrameFields[f].index);
+}
+
+// the unit state we report and write, the bits a change notification cares about
+constexpr uint64_t kSettingsFieldsMask64 = fieldMask64(kFieldEnabled)
+                                         | fieldMask64(kFieldMode)
+                                         | fieldMask64(kFieldFan)
+                                         | fieldMask64(kFieldEconomy)
+                                         | fieldMask64(kFieldTemperature)
+                                         | fieldMask64(kFieldSwing)
+                                         | fieldMask64(kFieldSwingStep);
+
+// state copied back to the unit when answering a login
+constexpr uint64_t kLoginStateFieldsMask64 = fieldMask64(kFieldEnabled)
+                                           | fieldMask64(kFieldMode)
+                                           | fieldMask64(kFieldFan)
+                                           | fieldMask64(kFieldError)
+                                           | fieldMask64(kFieldTemperature)
+                                           | fieldMask64(kFieldSwing)
+                                           | fieldMask64(kFieldSwingStep);
+
+// A frame kept in its raw 8 byte form. Fields are only decoded when asked for, copying or
+// comparing frames is a single 64 bit operation.
+class FujitsuFrame
+{
+  public:
+    uint64_t raw = 0;
+
+    // bytes on the wire are inverted, undo that with one xor
+    static FujitsuFrame fromWire(const byte buf[kFrameLength]) {
+        FujitsuFrame frame;
+        memcpy(&frame.raw, buf, kFrameLength);
+        frame.raw ^= ~(uint64_t)0;
+        return frame;
+    }
+
+    void toWire(byte buf[kFrameLength]) const {
+        uint64_t wire = raw ^ ~(uint64_t)0;
+        memcpy(buf, &wire, kFrameLength);
+    }
+
+    void toBytes(byte buf[kFrameLength]) const {
+        memcpy(buf, &raw, kFrameLength);
+    }
+
+    template<FrameFieldId F>
+    byte get() const {
+        return (raw >> fieldShift64(F)) & fieldMaxValue(kFrameFields[F].mask);
+    }
+
+    template<FrameFieldId F>
+    void set(byte value) {
+        raw = (raw & ~fieldMask64(F)) | (((uint64_t)value << fieldShift64(F)) & fieldMask64(F));
+    }
+
+    // take the bits under mask from another frame
+    void copyFrom(const FujitsuFrame &other, uint64_t mask) {
+        raw = (raw & ~mask) | (other.raw & mask);
+    }
+
+    void clear(uint64_t mask) {
+        raw &= ~mask;
+    }
+};
+
+#endif
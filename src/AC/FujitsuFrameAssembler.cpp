@@ -0,0 +1,98 @@
+#include "FujitsuFrameAssembler.h"
+
+byte FujitsuFrameAssembler::peek(byte offset) {
+    return ring[(head + offset) & (kRingSize - 1)];
+}
+
+void FujitsuFrameAssembler::drop(byte n) {
+    if(n > count) {
+        n = count;
+    }
+    head = (head + n) & (kRingSize - 1);
+    count -= n;
+}
+
+bool FujitsuFrameAssembler::isPlausibleHeader() {
+    // bytes are inverted on the wire, the source is a full byte address and the destination
+    // shares its byte with the unknown bit
+    byte source = peek(0) ^ 0xFF;
+    byte dest   = (peek(1) ^ 0xFF) & 0b01111111;
+
+    bool sourceOk = source == 1 || source == 32 || source == 33;
+    bool destOk   = dest == 0 || dest == 1 || dest == 32 || dest == 33;
+
+    return sourceOk && destOk;
+}
+
+void FujitsuFrameAssembler::push(byte b, unsigned long nowMicros) {
+    expire(nowMicros);
+
+    if(count == kRingSize) {
+        // consumer fell behind, make room by discarding the oldest byte
+        drop(1);
+        resyncBytes++;
+    }
+
+    ring[(head + count) & (kRingSize - 1)] = b;
+    count++;
+    lastByteMicros = nowMicros;
+}
+
+bool FujitsuFrameAssembler::pop(byte frame[kFrameLength]) {
+    while(count >= kFrameLength) {
+        if(isPlausibleHeader()) {
+            for(int i=0;i<kFrameLength;i++) {
+                frame[i] = peek(i);
+            }
+            drop(kFrameLength);
+            return true;
+        }
+
+        // out of step with the frame boundaries, slide forward until the header lines up
+        drop(1);
+        resyncBytes++;
+    }
+
+    return false;
+}
+
+void FujitsuFrameAssembler::expire(unsigned long nowMicros) {
+    if(count > 0 && (nowMicros - lastByteMicros) > frameGapMicros) {
+        // the line went quiet mid frame, whatever is buffered can never complete
+        if(count < kFrameLength) {
+            incompleteFrames++;
+        } else {
+            resyncBytes += count;
+        }
+        drop(count);
+    }
+}
+
+void FujitsuFrameAssembler::reset() {
+    head = 0;
+    count = 0;
+}
+
+void FujitsuFrameAssembler::setFrameGap(unsigned long micros) {
+    frameGapMicros = micros;
+}
+
+unsigned long FujitsuFrameAssembler::getFrameGap() {
+    return frameGapMicros;
+}
+
+unsigned long FujitsuFrameAssembler::getLastByteMicros() {
+    return lastByteMicros;
+}
+
+bool FujitsuFrameAssembler::isReceiving() {
+    return count > 0;
+}
+
+unsigned long FujitsuFrameAssembler::getIncompleteFrames() {
+    return incompleteFrames;
+}
+
+unsigned long FujitsuFrameAssembler::getResyncBytes() {
+    return resyncBytes;
+}
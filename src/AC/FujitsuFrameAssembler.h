@@ -0,0 +1,51 @@
+#ifndef FUJITSU_FRAME_ASSEMBLER_H
+#define FUJITSU_FRAME_ASSEMBLER_H
+
+#include <Arduino.h>
+
+const byte kFrameLength = 8;
+
+// at 500 baud 8E1 one byte takes 11 bits = 22ms on the wire. bytes within a frame are sent
+// back to back, frames are separated by a reply gap of ~50-60ms
+const unsigned long kByteTimeMicros = 22000;
+const unsigned long kDefaultFrameGapMicros = 40000;
+
+// Incrementally assembles 8 byte frames from the raw (still inverted) byte stream.
+// Bytes are pushed as they arrive and complete frames are popped out, so nothing ever
+// waits for the rest of a frame. A silence longer than the frame gap marks a frame
+// boundary and throws away any partial frame, and a frame whose header does not decode to
+// a known bus address is slid forward one byte at a time until it lines up again.
+class FujitsuFrameAssembler
+{
+  private:
+    static const byte kRingSize = 32; // power of two
+
+    byte            ring[kRingSize];
+    byte            head = 0;
+    byte            count = 0;
+    unsigned long   lastByteMicros = 0;
+    unsigned long   frameGapMicros = kDefaultFrameGapMicros;
+
+    unsigned long   incompleteFrames = 0;
+    unsigned long   resyncBytes = 0;
+
+    byte peek(byte offset);
+    void drop(byte n);
+    bool isPlausibleHeader();
+
+  public:
+    void push(byte b, unsigned long nowMicros);
+    bool pop(byte frame[kFrameLength]);
+    void expire(unsigned long nowMicros);
+    void reset();
+
+    void setFrameGap(unsigned long micros);
+    unsigned long getFrameGap();
+    unsigned long getLastByteMicros();
+    bool isReceiving();
+
+    unsigned long getIncompleteFrames();
+    unsigned long getResyncBytes();
+};
+
+#endif
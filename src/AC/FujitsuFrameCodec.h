@@ -0,0 +1,82 @@
+#ifndef FUJITSU_FRAME_CODEC_H
+#define FUJITSU_FRAME_CODEC_H
+
+#include <Arduino.h>
+
+// Every field of a (non inverted) 8 byte frame is described once in kFrameFields, by the
+// byte it lives in and its mask. The shift is derived from the mask. FujitsuFrame resolves
+// the descriptors at compile time into shifts and masks on the frame's 64 bit word.
+
+struct FrameFieldDescriptor {
+    byte index;
+    byte mask;
+};
+
+enum FrameFieldId : byte {
+    kFieldSource = 0,
+    kFieldDest,
+    kFieldUnknownBit,
+    kFieldLoginBit,
+    kFieldMessageType,
+    kFieldWriteBit,
+    kFieldEnabled,
+    kFieldMode,
+    kFieldFan,
+    kFieldError,
+    kFieldEconomy,
+    kFieldTemperature,
+    kFieldUpdateMagic,
+    kFieldSwing,
+    kFieldSwingStep,
+    kFieldControllerPresent,
+    kFieldControllerTemp,
+    kFieldCount
+};
+
+// first field carrying unit state rather than addressing, the header fields overlap on purpose
+const byte kFirstStateField = kFieldEnabled;
+
+constexpr FrameFieldDescriptor kFrameFields[kFieldCount] = {
+    { 0, 0b11111111 }, // kFieldSource
+    { 1, 0b01111111 }, // kFieldDest
+    { 1, 0b10000000 }, // kFieldUnknownBit, unsure what this bit indicates
+    { 1, 0b00100000 }, // kFieldLoginBit, shares bit 5 with the destination, encode it after kFieldDest
+    { 2, 0b00110000 }, // kFieldMessageType
+    { 2, 0b00001000 }, // kFieldWriteBit
+    { 3, 0b00000001 }, // kFieldEnabled
+    { 3, 0b00001110 }, // kFieldMode
+    { 3, 0b01110000 }, // kFieldFan
+    { 3, 0b10000000 }, // kFieldError
+    { 4, 0b10000000 }, // kFieldEconomy
+    { 4, 0b01111111 }, // kFieldTemperature
+    { 5, 0b11110000 }, // kFieldUpdateMagic
+    { 5, 0b00000100 }, // kFieldSwing
+    { 5, 0b00000010 }, // kFieldSwingStep
+    { 6, 0b00000001 }, // kFieldControllerPresent
+    { 6, 0b01111110 }, // kFieldControllerTemp, the leading bit is unknown - probably a sign bit for negative temps?
+};
+
+constexpr byte fieldOffset(byte mask) {
+    return (mask & 1) ? 0 : 1 + fieldOffset(mask >> 1);
+}
+
+constexpr byte fieldMaxValue(byte mask) {
+    return mask >> fieldOffset(mask);
+}
+
+// no two state fields share a bit, checked at compile time. test/test_native_frame_codec checks
+// the table against the hand-written layout it replaced
+
+constexpr bool fieldDisjointFrom(byte f, byte other) {
+    return other >= kFieldCount
+        || ((kFrameFields[f].index != kFrameFields[other].index || (kFrameFields[f].mask & kFrameFields[other].mask) == 0)
+            && fieldDisjointFrom(f, other + 1));
+}
+
+constexpr bool fieldsDisjoint(byte f) {
+    return f >= kFieldCount || (fieldDisjointFrom(f, f + 1) && fieldsDisjoint(f + 1));
+}
+
+static_assert(fieldsDisjoint(kFirstStateField), "frame state fields overlap");
+
+#endif
@@ -0,0 +1,345 @@
+#include "FujitsuSimBus.h"
+
+QueueHandle_t FujitsuSimBus::begin() {
+    if(eventQueue == nullptr) {
+        eventQueue = xQueueCreate(kUartEventQueueSize, sizeof(uart_event_t));
+        rxStream = xStreamBufferCreate(kUartRxBufferSize, 1);
+        txQueue = xQueueCreate(4, kFrameLength);
+    }
+    return eventQueue;
+}
+
+void FujitsuSimBus::start(FujitsuAC *ac, bool acIsSecondary) {
+    begin();
+    this->ac = ac;
+
+    if(acIsSecondary) {
+        acAddress = static_cast<byte>(ACAddress::SECONDARY);
+        wallAddress = static_cast<byte>(ACAddress::PRIMARY);
+    } else {
+        acAddress = static_cast<byte>(ACAddress::PRIMARY);
+        wallAddress = static_cast<byte>(ACAddress::SECONDARY);
+    }
+
+    unitState.set<kFieldEnabled>(0);
+    unitState.set<kFieldMode>(static_cast<byte>(ACMode::COOL));
+    unitState.set<kFieldFan>(static_cast<byte>(ACFanMode::FAN_AUTO));
+    unitState.set<kFieldTemperature>(22);
+
+    startMillis = millis();
+    loginStartMicros = micros();
+
+    if(simTask == nullptr) {
+        xTaskCreatePinnedToCore(&FujitsuSimBus::simTaskLoop, "fujitsu_sim", kSimTaskStackSize, this, kSimTaskPriority, &simTask, kSimTaskCore);
+    }
+}
+
+void FujitsuSimBus::simTaskLoop(void *arg) {
+    FujitsuSimBus *sim = static_cast<FujitsuSimBus *>(arg);
+
+    for(;;) {
+        sim->pollCycle();
+    }
+}
+
+void FujitsuSimBus::pollCycle() {
+    byte stale[kFrameLength];
+
+    // a write outside the reply window would have collided with someone, drop it
+    while(xQueueReceive(txQueue, stale, 0) == pdTRUE) {}
+
+    pollController(acAddress);
+    runBenchmark();
+    waitMicros(kSimPollGapMicros);
+
+    if(wallController) {
+        pollController(wallAddress);
+        waitMicros(kSimPollGapMicros);
+    }
+}
+
+bool FujitsuSimBus::chance(uint16_t permille) {
+    return permille > 0 && (esp_random() % 1000) < permille;
+}
+
+void FujitsuSimBus::waitMicros(unsigned long micros) {
+    vTaskDelay(pdMS_TO_TICKS((micros + 999) / 1000));
+}
+
+void FujitsuSimBus::deliver(const byte frame[kFrameLength], bool faults) {
+    // the frame takes its time on the wire, plus whatever latency we were asked to add
+    waitMicros(kFrameLength * kByteTimeMicros + (faults ? latencyMicros : 0));
+    framesOnLine++;
+
+    byte buf[kFrameLength];
+    size_t len = 0;
+    for(int i=0;i<kFrameLength;i++) {
+        if(faults && chance(byteLossPermille)) {
+            bytesDropped++;
+            continue;
+        }
+        buf[len++] = frame[i];
+    }
+    xStreamBufferSend(rxStream, buf, len, 0);
+
+    // like the uart, tell the bus task once the line has been quiet for the rx timeout
+    waitMicros(kUartRxTimeoutSymbols * kByteTimeMicros);
+
+    uart_event_t event = {};
+    if(faults && chance(parityErrorPermille)) {
+        parityErrorsRaised++;
+        event.type = UART_PARITY_ERR;
+    } else {
+        event.type = UART_DATA;
+        event.size = len;
+        event.timeout_flag = true;
+    }
+    xQueueSend(eventQueue, &event, 0);
+}
+
+void FujitsuSimBus::pollController(byte dest) {
+    bool toAc = dest == acAddress;
+
+    FujitsuFrame ff = unitState;
+    ff.set<kFieldSource>(static_cast<byte>(ACAddress::UNIT));
+    ff.set<kFieldDest>(dest);
+    ff.set<kFieldMessageType>(static_cast<byte>(toAc && loginAckDue ? ACMessageType::LOGIN : ACMessageType::STATUS));
+    ff.set<kFieldControllerPresent>(toAc ? acLoggedIn : 1);
+    ff.set<kFieldControllerTemp>(roomTemp);
+    if(toAc) {
+        loginAckDue = false;
+    }
+
+    byte wire[kFrameLength];
+    ff.toWire(wire);
+    deliver(wire, true);
+
+    if(toAc && benchmarkApplied) {
+        // the unit has now reported the benchmark value back to the controller
+        unsigned long latency = micros() - benchmarkStartMicros;
+        confirmedLatencyLastMicros = latency;
+        confirmedLatencyTotalMicros += latency;
+        if(latency > confirmedLatencyMaxMicros) {
+            confirmedLatencyMaxMicros = latency;
+        }
+        confirmedCommands++;
+        benchmarkApplied = false;
+        benchmarkPending = false;
+    }
+
+    if(!toAc) {
+        // the wall controller is always logged in, it just reports the room temperature
+        FujitsuFrame wall = unitState;
+        wall.set<kFieldSource>(wallAddress);
+        wall.set<kFieldDest>(static_cast<byte>(ACAddress::UNIT));
+        wall.set<kFieldMessageType>(static_cast<byte>(ACMessageType::STATUS));
+        wall.set<kFieldControllerPresent>(1);
+        wall.set<kFieldControllerTemp>(roomTemp);
+        wall.toWire(wire);
+
+        waitMicros(kSimWallReplyDelayMicros);
+        deliver(wire, true);
+        return;
+    }
+
+    byte reply[kFrameLength];
+    if(xQueueReceive(txQueue, reply, pdMS_TO_TICKS(kSimReplyTimeoutMicros / 1000)) == pdTRUE) {
+        missedReplies = 0;
+        // the controller hears its own reply on the shared line, it must skip it
+        deliver(reply, false);
+        handleReply(FujitsuFrame::fromWire(reply));
+    } else {
+        repliesMissed++;
+        if(++missedReplies >= kSimMissedRepliesLogout && acLoggedIn) {
+            acLoggedIn = false;
+            loginStartMicros = micros();
+        }
+    }
+}
+
+void FujitsuSimBus::markLoggedIn() {
+    if(!acLoggedIn) {
+        acLoggedIn = true;
+        logins++;
+        loginMicros = micros() - loginStartMicros;
+    }
+}
+
+void FujitsuSimBus::handleReply(const FujitsuFrame &reply) {
+    if(reply.get<kFieldSource>() != acAddress) {
+        return;
+    }
+
+    byte type = reply.get<kFieldMessageType>();
+    if(type == static_cast<byte>(ACMessageType::LOGIN)) {
+        if(reply.get<kFieldDest>() == static_cast<byte>(ACAddress::UNIT)) {
+            // a primary asking to log in, acknowledged with a login frame on the next poll
+            loginAckDue = true;
+        } else {
+            // the primary probing for a secondary, it only does that once it is logged in
+            markLoggedIn();
+        }
+    } else if(type == static_cast<byte>(ACMessageType::STATUS) && reply.get<kFieldControllerPresent>() == 1) {
+        markLoggedIn();
+    }
+
+    if(reply.get<kFieldWriteBit>()) {
+        unitState.copyFrom(reply, kSettingsFieldsMask64);
+
+        if(benchmarkPending && !benchmarkApplied && unitState.get<kFieldTemperature>() == benchmarkTemp) {
+            unsigned long latency = micros() - benchmarkStartMicros;
+            appliedLatencyLastMicros = latency;
+            appliedLatencyTotalMicros += latency;
+            if(latency > appliedLatencyMaxMicros) {
+                appliedLatencyMaxMicros = latency;
+            }
+            appliedCommands++;
+            benchmarkApplied = true;
+        }
+    }
+}
+
+void FujitsuSimBus::runBenchmark() {
+    if(ac == nullptr || benchmarkIntervalMillis == 0) {
+        return;
+    }
+
+    if(benchmarkPending) {
+        if(millis() - lastBenchmarkMillis > kSimBenchmarkTimeoutMillis) {
+            commandTimeouts++;
+            benchmarkPending = false;
+            benchmarkApplied = false;
+        }
+        return;
+    }
+
+    if(acLoggedIn && millis() - lastBenchmarkMillis >= benchmarkIntervalMillis) {
+        benchmarkTemp = unitState.get<kFieldTemperature>() == 20 ? 24 : 20;
+        benchmarkStartMicros = micros();
+        benchmarkPending = true;
+        benchmarkApplied = false;
+        lastBenchmarkMillis = millis();
+        commands++;
+        ac->setTemp(benchmarkTemp);
+    }
+}
+
+int FujitsuSimBus::read(byte *buf, size_t len) {
+    return xStreamBufferReceive(rxStream, buf, len, 0);
+}
+
+int FujitsuSimBus::write(const byte *buf, size_t len) {
+    if(len != kFrameLength || xQueueSend(txQueue, buf, 0) != pdTRUE) {
+        return 0;
+    }
+    return len;
+}
+
+void FujitsuSimBus::flushInput() {
+    byte buf[kFrameLength];
+    while(xStreamBufferReceive(rxStream, buf, sizeof(buf), 0) > 0) {}
+}
+
+void FujitsuSimBus::setLatency(unsigned long micros) {
+    latencyMicros = micros;
+}
+
+void FujitsuSimBus::setByteLoss(uint16_t permille) {
+    byteLossPermille = permille;
+}
+
+void FujitsuSimBus::setParityErrors(uint16_t permille) {
+    parityErrorPermille = permille;
+}
+
+void FujitsuSimBus::setWallController(bool enabled) {
+    wallController = enabled;
+}
+
+void FujitsuSimBus::setBenchmarkInterval(unsigned long millis) {
+    benchmarkIntervalMillis = millis;
+}
+
+unsigned long FujitsuSimBus::getLatency() {
+    return latencyMicros;
+}
+
+uint16_t FujitsuSimBus::getByteLoss() {
+    return byteLossPermille;
+}
+
+uint16_t FujitsuSimBus::getParityErrors() {
+    return parityErrorPermille;
+}
+
+bool FujitsuSimBus::getWallController() {
+    return wallController;
+}
+
+unsigned long FujitsuSimBus::getBenchmarkInterval() {
+    return benchmarkIntervalMillis;
+}
+
+bool FujitsuSimBus::isLoggedIn() {
+    return acLoggedIn;
+}
+
+unsigned long FujitsuSimBus::getLoginMicros() {
+    return loginMicros;
+}
+
+unsigned long FujitsuSimBus::getLogins() {
+    return logins;
+}
+
+float FujitsuSimBus::getFramesPerSecond() {
+    unsigned long elapsed = millis() - startMillis;
+    if(elapsed == 0) {
+        return 0;
+    }
+    return framesOnLine * 1000.0f / elapsed;
+}
+
+unsigned long FujitsuSimBus::getRepliesMissed() {
+    return repliesMissed;
+}
+
+unsigned long FujitsuSimBus::getBytesDropped() {
+    return bytesDropped;
+}
+
+unsigned long FujitsuSimBus::getParityErrorsRaised() {
+    return parityErrorsRaised;
+}
+
+unsigned long FujitsuSimBus::getCommands() {
+    return commands;
+}
+
+unsigned long FujitsuSimBus::getCommandTimeouts() {
+    return commandTimeouts;
+}
+
+unsigned long FujitsuSimBus::getAppliedLatencyLast() {
+    return appliedLatencyLastMicros;
+}
+
+unsigned long FujitsuSimBus::getAppliedLatencyMax() {
+    return appliedLatencyMaxMicros;
+}
+
+unsigned long FujitsuSimBus::getAppliedLatencyAverage() {
+    return appliedCommands ? appliedLatencyTotalMicros / appliedCommands : 0;
+}
+
+unsigned long FujitsuSimBus::getConfirmedLatencyLast() {
+    return confirmedLatencyLastMicros;
+}
+
+unsigned long FujitsuSimBus::getConfirmedLatencyMax() {
+    return confirmedLatencyMaxMicros;
+}
+
+unsigned long FujitsuSimBus::getConfirmedLatencyAverage() {
+    return confirmedCommands ? confirmedLatencyTotalMicros / confirmedCommands : 0;
+}
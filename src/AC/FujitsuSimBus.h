@@ -0,0 +1,136 @@
+#ifndef FUJITSU_SIM_BUS_H
+#define FUJITSU_SIM_BUS_H
+
+#include <Arduino.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/queue.h>
+#include <freertos/stream_buffer.h>
+#include "FujitsuAC.h"
+
+const uint32_t    kSimTaskStackSize = 4096;
+const UBaseType_t kSimTaskPriority  = 10; // below the bus task, like the real unit it never waits on us
+const BaseType_t  kSimTaskCore      = 0;
+
+// the indoor unit waits this long for a reply before polling the next controller
+const unsigned long kSimReplyTimeoutMicros = 250000;
+const unsigned long kSimPollGapMicros = 50000;
+// missed replies in a row before the unit forgets a controller was logged in
+const byte kSimMissedRepliesLogout = 3;
+// the wall controller answers this long after the unit's frame, like a real one
+const unsigned long kSimWallReplyDelayMicros = 55000;
+// a benchmark command that has not been confirmed by then is given up on
+const unsigned long kSimBenchmarkTimeoutMillis = 10000;
+
+// A simulated indoor unit, and optionally a wall controller, on a virtual line that replaces
+// the uart. Lets the protocol engine run on a bare board: the unit polls the controllers,
+// takes the login handshake, applies written settings and reports them back.
+//
+// The line can be made worse on purpose, with extra latency before each frame, bytes dropped
+// and parity errors raised. A built in benchmark changes the set temperature every so often
+// through FujitsuAC and times how long until the unit applies it, and until the unit's next
+// status frame confirms it back to the controller.
+class FujitsuSimBus : public FujitsuBusPort
+{
+  private:
+    QueueHandle_t        eventQueue = nullptr;
+    StreamBufferHandle_t rxStream = nullptr;   // bytes on their way to FujitsuAC
+    QueueHandle_t        txQueue = nullptr;    // frames FujitsuAC wrote, one per entry
+    TaskHandle_t         simTask = nullptr;
+    FujitsuAC           *ac = nullptr;
+
+    byte            acAddress;
+    byte            wallAddress;
+    bool            acLoggedIn = false;
+    bool            loginAckDue = false;
+    byte            missedReplies = 0;
+
+    // the unit's own settings, the raw (non inverted) layout of a status frame
+    FujitsuFrame    unitState;
+    byte            roomTemp = 22;
+
+    // line faults, per mille
+    volatile unsigned long latencyMicros = 0; // on top of the frame time
+    volatile uint16_t byteLossPermille = 0;
+    volatile uint16_t parityErrorPermille = 0;
+    volatile bool   wallController = true;
+
+    volatile unsigned long benchmarkIntervalMillis = 0;
+    unsigned long   lastBenchmarkMillis = 0;
+    bool            benchmarkPending = false;
+    bool            benchmarkApplied = false;
+    byte            benchmarkTemp = 0;
+    unsigned long   benchmarkStartMicros = 0;
+
+    unsigned long   startMillis = 0;
+    unsigned long   loginStartMicros = 0;
+    unsigned long   loginMicros = 0;
+    unsigned long   logins = 0;
+    unsigned long   framesOnLine = 0;
+    unsigned long   repliesMissed = 0;
+    unsigned long   bytesDropped = 0;
+    unsigned long   parityErrorsRaised = 0;
+    unsigned long   commands = 0;
+    unsigned long   commandTimeouts = 0;
+    unsigned long   appliedLatencyLastMicros = 0;
+    unsigned long   appliedLatencyMaxMicros = 0;
+    unsigned long long appliedLatencyTotalMicros = 0;
+    unsigned long   appliedCommands = 0;
+    unsigned long   confirmedLatencyLastMicros = 0;
+    unsigned long   confirmedLatencyMaxMicros = 0;
+    unsigned long long confirmedLatencyTotalMicros = 0;
+    unsigned long   confirmedCommands = 0;
+
+    bool chance(uint16_t permille);
+    void deliver(const byte frame[kFrameLength], bool faults);
+    void waitMicros(unsigned long micros);
+    void pollController(byte dest);
+    void handleReply(const FujitsuFrame &reply);
+    void markLoggedIn();
+    void runBenchmark();
+    static void simTaskLoop(void *arg);
+
+  public:
+    // ac is the driver under test, used by the benchmark. the unit polls acAddress and, if
+    // the wall controller is on, the other controller address too
+    void start(FujitsuAC *ac, bool acIsSecondary);
+
+    // one round of the unit polling its controllers, with the line time it takes. the sim
+    // task runs it forever, the native tests call it themselves
+    void pollCycle();
+
+    QueueHandle_t begin() override;
+    int read(byte *buf, size_t len) override;
+    int write(const byte *buf, size_t len) override;
+    void flushInput() override;
+
+    void setLatency(unsigned long micros);
+    void setByteLoss(uint16_t permille);
+    void setParityErrors(uint16_t permille);
+    void setWallController(bool enabled);
+    void setBenchmarkInterval(unsigned long millis);
+
+    unsigned long getLatency();
+    uint16_t getByteLoss();
+    uint16_t getParityErrors();
+    bool getWallController();
+    unsigned long getBenchmarkInterval();
+
+    bool isLoggedIn();
+    unsigned long getLoginMicros();
+    unsigned long getLogins();
+    float getFramesPerSecond();
+    unsigned long getRepliesMissed();
+    unsigned long getBytesDropped();
+    unsigned long getParityErrorsRaised();
+    unsigned long getCommands();
+    unsigned long getCommandTimeouts();
+    unsigned long getAppliedLatencyLast();
+    unsigned long getAppliedLatencyMax();
+    unsigned long getAppliedLatencyAverage();
+    unsigned long getConfirmedLatencyLast();
+    unsigned long getConfirmedLatencyMax();
+    unsigned long getConfirmedLatencyAverage();
+};
+
+#endif
@@ -0,0 +1,84 @@
+#include "FujitsuTracePrinter.h"
+
+bool FujitsuTracePrinter::addUnit(FujitsuAC *unit) {
+    if(unitCount >= kMaxTraceUnits) {
+        return false;
+    }
+
+    units[unitCount++] = unit;
+    return true;
+}
+
+bool FujitsuTracePrinter::start() {
+    for(int i=0;i<unitCount;i++) {
+        if(!units[i]->capture.start(kCaptureUserTrace)) {
+            return false;
+        }
+        cursors[i] = units[i]->capture.getWritten();
+    }
+
+    if(traceTask == nullptr &&
+       xTaskCreatePinnedToCore(&FujitsuTracePrinter::traceTaskLoop, "fujitsu_trace", kTraceTaskStackSize, this, kTraceTaskPriority, &traceTask, kTraceTaskCore) != pdPASS) {
+        return false;
+    }
+
+    enabled = true;
+    return true;
+}
+
+void FujitsuTracePrinter::stop() {
+    // the ring keeps recording if a capture was started over http as well
+    enabled = false;
+    for(int i=0;i<unitCount;i++) {
+        units[i]->capture.stop(kCaptureUserTrace);
+    }
+}
+
+bool FujitsuTracePrinter::isEnabled() {
+    return enabled;
+}
+
+void FujitsuTracePrinter::traceTaskLoop(void *arg) {
+    FujitsuTracePrinter *printer = static_cast<FujitsuTracePrinter *>(arg);
+
+    for(;;) {
+        vTaskDelay(kTraceTaskPeriodTicks);
+        if(!printer->enabled) {
+            continue;
+        }
+
+        for(int i=0;i<printer->unitCount;i++) {
+            printer->printNew(i);
+        }
+    }
+}
+
+void FujitsuTracePrinter::printNew(byte unit) {
+    FujitsuCapture &capture = units[unit]->capture;
+    uint32_t end = capture.getWritten();
+    uint32_t oldest = capture.getOldest();
+
+    if((int32_t)(cursors[unit] - oldest) < 0) {
+        Serial.printf("AC%d ... %lu frames lost\n", unit, (unsigned long)(oldest - cursors[unit]));
+        cursors[unit] = oldest;
+    }
+
+    CaptureEntry entry;
+    for(; cursors[unit] != end; cursors[unit]++) {
+        if(!capture.read(cursors[unit], &entry)) {
+            Serial.printf("AC%d ... frame %lu lost\n", unit, (unsigned long)cursors[unit]);
+            continue;
+        }
+
+        FujitsuFrame ff = FujitsuFrame::fromWire(entry.frame);
+        byte buf[kFrameLength];
+        ff.toBytes(buf);
+        Serial.printf("AC%d %10lu %s %02X %02X %02X %02X %02X %02X %02X %02X ",
+                      unit, (unsigned long)entry.micros, entry.direction == kCaptureTx ? "-->" : "<--",
+                      buf[0], buf[1], buf[2], buf[3], buf[4], buf[5], buf[6], buf[7]);
+        Serial.printf(" mSrc: %d mDst: %d mType: %d write: %d login: %d unknown: %d onOff: %d temp: %d, mode: %d cP:%d uM:%d cTemp:%d acError:%d\n",
+                      ff.get<kFieldSource>(), ff.get<kFieldDest>(), ff.get<kFieldMessageType>(), ff.get<kFieldWriteBit>(), ff.get<kFieldLoginBit>(),
+                      ff.get<kFieldUnknownBit>(), ff.get<kFieldEnabled>(), ff.get<kFieldTemperature>(), ff.get<kFieldMode>(),
+                      ff.get<kFieldControllerPresent>(), ff.get<kFieldUpdateMagic>(), ff.get<kFieldControllerTemp>(), ff.get<kFieldError>());
+    }
+}
@@ -0,0 +1,42 @@
+#ifndef FUJITSU_TRACE_PRINTER_H
+#define FUJITSU_TRACE_PRINTER_H
+
+#include <Arduino.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include "FujitsuAC.h"
+
+const byte kMaxTraceUnits = 3;
+
+const uint32_t    kTraceTaskStackSize = 3072;
+const UBaseType_t kTraceTaskPriority  = 1; // just above idle, printing waits for everyone else
+const BaseType_t  kTraceTaskCore      = 0;
+const TickType_t  kTraceTaskPeriodTicks = pdMS_TO_TICKS(200);
+
+// Prints the bus traffic of each unit as text, on a low priority task. The bus task only
+// copies frames into the unit's capture ring, the decoding and the slow serial writes happen
+// here, so tracing can stay on without moving the reply timing. Frames the ring overwrote
+// before they were printed are reported as lost rather than held up for.
+class FujitsuTracePrinter
+{
+  private:
+    FujitsuAC       *units[kMaxTraceUnits];
+    uint32_t        cursors[kMaxTraceUnits] = {};
+    byte            unitCount = 0;
+    volatile bool   enabled = false;
+    TaskHandle_t    traceTask = nullptr;
+
+    void printNew(byte unit);
+    static void traceTaskLoop(void *arg);
+
+  public:
+    bool addUnit(FujitsuAC *unit);
+
+    // starts the capture ring of every unit as one of its users, printing begins with the
+    // next frame
+    bool start();
+    void stop();
+    bool isEnabled();
+};
+
+#endif
@@ -7,12 +7,20 @@ const char* CONTROLLER_VERSION = "2.5";
 #include <PubSubClient.h>
 #include <ESPAsyncWebServer.h>
 #include "OTA/OTA.h"
+#include "LoopScheduler/LoopScheduler.h"
+#include "Profiler/LatencyProfiler.h"
 #include <ArduinoJson.h>
 #include "AC/FujitsuAC.h"
+#include "AC/FujitsuBusScheduler.h"
+#include "AC/FujitsuTracePrinter.h"
+#ifdef FUJITSU_SIM_BUS
+#include "AC/FujitsuSimBus.h"
+#endif
 #include <FastLED.h>
 #include <Preferences.h>
 #include <DNSServer.h>
 #include <SPIFFS.h>
+#include <atomic>
 // #include <esp_wifi.h>
 
 #include "melody_player/melody_player.h"
@@ -39,6 +47,13 @@ const char* PREF_KEY_MQTT_DISCOVERY_PREFIX = "mqtt_disc_pfx";
 // Preferences keys for pin configuration
 const char* PREF_KEY_AC_RX_PIN = "ac_rx_pin";
 const char* PREF_KEY_AC_TX_PIN = "ac_tx_pin";
+const char* PREF_KEY_AC_REPLY_DELAY = "ac_reply_us";
+const char* PREF_KEY_AC_UNITS = "ac_units";
+const char* PREF_KEY_AC_LISTEN_ONLY = "ac_listen";
+const char* PREF_KEY_AC_TRACE = "ac_trace";
+const char* PREF_KEY_AC_CONFIRM_FRAMES = "ac_confirm";
+const char* PREF_KEY_AC_ROLE = "ac_role";
+const char* PREF_KEY_AC_COALESCE = "ac_coalesce";
 const char* PREF_KEY_OUTPUT_PINS = "output_pins";
 const char* PREF_KEY_INPUT_PINS = "input_pins";
 const char* PREF_KEY_ZONES = "zones";
@@ -70,7 +85,16 @@ uint8_t INITIAL_BUZZER_VOLUME = 64; // 0-255, 32 default
 MelodyPlayer player(BUZZER_PIN, 0U, true);
 
 CRGB leds[LEDS_COUNT];
-FujitsuAC fujitsu;
+// One FujitsuAC per indoor unit, all serviced by the one bus task. The ESP32 has three UARTs
+// and UART0 is the serial console, so units take UART2 and then UART1
+#define MAX_AC_UNITS 2
+const uart_port_t AC_UNIT_UARTS[MAX_AC_UNITS] = { UART_NUM_2, UART_NUM_1 };
+FujitsuAC acUnits[MAX_AC_UNITS];
+FujitsuBusScheduler acBusScheduler;
+FujitsuTracePrinter acTracePrinter;
+#ifdef FUJITSU_SIM_BUS
+FujitsuSimBus simBus;
+#endif
 AsyncWebServer server(apiPort);
 AsyncWebSocket ws("/ws");
 StaticWebServer staticWebServer(&server);
@@ -79,12 +103,67 @@ bool colourLEDState = true;
 uint8_t colourLEDBrightness = 30;
 
 // Default pin configurations that can be overridden by preferences
-uint8_t acRxPin = 25;
-uint8_t acTxPin = 32;
-
-// Store previous AC state to detect changes
-ControlFrame previousACState;
-bool acStateInitialized = false;
+uint8_t acUnitCount = 1;
+// The second unit's defaults stay clear of the default output and input pins below
+uint8_t acRxPins[MAX_AC_UNITS] = { 25, 18 };
+uint8_t acTxPins[MAX_AC_UNITS] = { 32, 17 };
+uint32_t acReplyDelayUs[MAX_AC_UNITS] = { kDefaultReplyDelayMicros, kDefaultReplyDelayMicros };
+// Listen-only units never transmit, they follow the wall controller's traffic read only
+bool acListenOnly[MAX_AC_UNITS] = { false };
+// Status frames a changed AC field must survive before it is published
+uint8_t acConfirmFrames[MAX_AC_UNITS] = { kDefaultConfirmFrames, kDefaultConfirmFrames };
+// Bus role of each unit, auto takes whichever role no wall controller holds at boot
+#define AC_ROLE_AUTO 0
+#define AC_ROLE_PRIMARY 1
+#define AC_ROLE_SECONDARY 2
+uint8_t acRoles[MAX_AC_UNITS] = { AC_ROLE_AUTO, AC_ROLE_AUTO };
+
+// Fields whose change notifies observers (economy and swing are left out for now)
+const byte notifyACFields = kOnOffUpdateMask | kTempUpdateMask | kModeUpdateMask | kFanModeUpdateMask | kControllerTempUpdateMask;
+bool acStateInitialized[MAX_AC_UNITS] = { false };
+uint32_t lastACStateSequence[MAX_AC_UNITS] = { 0 };
+uint32_t lastACConnectionResets[MAX_AC_UNITS] = { 0 };
+bool lastACDetectingRole[MAX_AC_UNITS] = { false };
+uint32_t lastACErrorFrames[MAX_AC_UNITS] = { 0 };
+
+// Bus statistics go out on <base>/ac/state/bus (<base>/ac/<n>/state/bus) this often
+const unsigned long acBusStatsInterval = 60000;
+
+// Correlation ids handed to AC setters, reported back with each field's write result. The
+// network task records results, /api/ac/result reads them on the async_tcp task, both under
+// acWriteResultsMux. Ids we hand out have the top bit set, a client's own (the optional "id"
+// on ~/ac/set) must leave it clear, so the two can never meet
+const uint32_t AC_GENERATED_COMMAND_ID_BIT = 0x80000000;
+const uint32_t AC_CLIENT_COMMAND_ID_MAX = AC_GENERATED_COMMAND_ID_BIT - 1;
+std::atomic<uint32_t> nextACCommandId{1};
+const int AC_WRITE_RESULT_HISTORY = 16;
+struct ACWriteRecord {
+  uint8_t unit;
+  WriteResult result;
+};
+ACWriteRecord acWriteResults[AC_WRITE_RESULT_HISTORY];
+int acWriteResultCount = 0;
+int acWriteResultNext = 0;
+// Commands with field writes still to report, so a command on its way can be told apart from
+// an id that was never issued or whose results have left the history
+struct ACOutstandingCommand {
+  uint32_t commandId;
+  int fields;
+};
+ACOutstandingCommand acOutstandingCommands[AC_WRITE_RESULT_HISTORY] = {};
+int acOutstandingNext = 0;
+// Commands that asked for a value an earlier write is already carrying, they get that write's
+// result when it comes in. Loop task only
+struct ACAttachedCommand {
+  uint32_t commandId; // 0 when the slot is free
+  uint32_t carrierId;
+  uint8_t unit;
+  byte field;
+  byte value;
+};
+ACAttachedCommand acAttachedCommands[AC_WRITE_RESULT_HISTORY] = {};
+int acAttachedNext = 0;
+portMUX_TYPE acWriteResultsMux = portMUX_INITIALIZER_UNLOCKED;
 
 // Maximum number of pins we'll support
 #define MAX_OUTPUT_PINS 8
@@ -114,17 +193,126 @@ const uint8_t STATUS_LED_PIN = outputPins[0];
 
 const uint8_t resetButtonPin = 0;
 const int resetButtonSamplingFrequency = 300;
-unsigned long resetButtonLastPressMillis = millis();
 
 const int colourCycleProcessFrequency = 300;
-unsigned long colourCycleLastProcessedMillis = millis();
 int colourCycleOffset = 0;
 
 const int pinStateCheckInterval = 250;
-unsigned long pinStateCheckLastMillis = millis();
 
-const int fujitsuConnectionTimeout = 2000;
-unsigned long fujitsuLastConnected = millis();
+// The loop task is the network task: MQTT, OTA, the web socket and publishing AC state. Its
+// jobs run off the scheduler, loop() sleeps until the next one is due
+LoopScheduler loopScheduler;
+const int dnsProcessInterval = 10;
+const int mqttProcessInterval = 20;
+const int acCommsProcessInterval = 20;
+const int wsCleanupInterval = 1000;
+const int otaProcessInterval = 100;
+int dnsLoopTask = -1;
+
+// State changes from any task are posted here and published in batches by the network task,
+// producers never wait on JSON, the web socket or MQTT
+enum StateEventType : uint8_t {
+  EVENT_AC_CHANGED,     // unit and fields say what changed
+  EVENT_ZONE_CHANGED,
+  EVENT_PIN_CHANGED,
+  EVENT_CONFIG_CHANGED
+};
+struct StateEvent {
+  StateEventType type;
+  uint8_t unit;
+  byte fields;
+  bool audible;
+};
+const int stateEventQueueSize = 32;
+QueueHandle_t stateEventQueue = nullptr;
+std::atomic<bool> stateEventsOverflowed{false}; // some were dropped, the next batch publishes everything
+int stateEventsJob = -1;
+uint32_t stateEventsReceived = 0;
+uint32_t stateEventBatches = 0;
+uint32_t stateEventOverflows = 0;
+
+// Commands from every ingress path (HTTP, MQTT) go through one queue to the network task. AC
+// field writes are held for the coalescing window, last writer wins per field, so dragging a
+// slider ends up as one bus write
+enum ControlTarget : uint8_t {
+  CONTROL_AC,   // field is the update mask, value what to write
+  CONTROL_ZONE  // field is the ZoneAction
+};
+enum ZoneAction : uint8_t {
+  ZONE_TOGGLE,
+  ZONE_ON,
+  ZONE_OFF
+};
+struct ControlCommand {
+  ControlTarget target;
+  uint8_t index; // AC unit or zone index
+  byte field;
+  byte value;
+  uint32_t commandId;
+  bool powerOn; // AC only, switch the unit on as well. one entry, so it is queued whole or not at all
+};
+struct PendingACWrite {
+  bool pending;
+  byte value;
+  uint32_t commandId;
+  unsigned long firstMillis;
+};
+const int controlQueueSize = 32;
+QueueHandle_t controlQueue = nullptr;
+int controlCommandsJob = -1;
+uint16_t acCoalesceMillis = 300;
+PendingACWrite pendingACWrites[MAX_AC_UNITS][8] = {};
+uint32_t controlCommandsReceived = 0;
+uint32_t controlCommandsCoalesced = 0;
+uint32_t controlCommandsDeduplicated = 0;
+uint32_t controlCommandsRejected = 0;
+
+// Pin sensing, relay pulses, the LED and the buzzer run on the IO task on the other core, a
+// slow publish never holds up the pins and a relay pulse never holds up a publish. The AC bus
+// has its own task above both (FujitsuBusScheduler)
+LoopScheduler ioScheduler;
+TaskHandle_t ioTask = nullptr;
+const uint32_t ioTaskStackSize = 4096;
+const UBaseType_t ioTaskPriority = 3;
+const BaseType_t ioTaskCore = 0;
+
+enum IOCommandType : uint8_t {
+  IO_PULSE, // value is the pulse length in ms
+  IO_SET,   // value is the level
+  IO_TONE   // value is the melody index
+};
+struct IOCommand {
+  IOCommandType type;
+  uint8_t pin;
+  uint16_t value;
+};
+const int ioCommandQueueSize = 8;
+QueueHandle_t ioCommandQueue = nullptr;
+int ioCommandJob = -1;
+
+// A press holds an output inverted for its length and the IO task releases it on a deadline,
+// nothing waits in between. A press that comes in while one is still held goes out after the
+// release and a gap as long as the press, two presses must not merge into one
+enum OutputPulseState : uint8_t {
+  PULSE_IDLE,
+  PULSE_HELD,
+  PULSE_GAP
+};
+struct OutputPulse {
+  OutputPulseState state;
+  unsigned long dueMillis; // end of the press or of the gap
+  uint16_t lengthMs;
+  uint8_t queued;          // presses waiting behind this one
+  uint16_t queuedLengthMs;
+};
+OutputPulse outputPulses[MAX_OUTPUT_PINS] = {};
+int outputPulseJob = -1;
+
+// Latency histograms for every loop job and HTTP handler, served at /api/profile
+LatencyProfiler profiler;
+int mqttReconnectStage = -1;
+int mqttLoopStage = -1;
+int wsEventStage = -1;
 
 String htmlWiFiConfigCaptivePortal = R"rawliteral(
 <!DOCTYPE HTML><html><head>
@@ -163,13 +351,14 @@ void processApiStatusRoute(AsyncWebServerRequest *request);
 void processColourLEDControl(AsyncWebServerRequest *request, String setting, String value);
 void processBuzzerControl(AsyncWebServerRequest *request, String setting, String value);
 void processOutputPinControl(AsyncWebServerRequest *request, String pinStr, String valueStr);
-void processACControl(AsyncWebServerRequest *request, String setting, String value);
+void processACControl(AsyncWebServerRequest *request, String setting, String value, uint32_t commandId = 0, uint8_t unit = 0);
 void process404(AsyncWebServerRequest *request);
 void onWsEvent(AsyncWebSocket *server, AsyncWebSocketClient *client, AwsEventType type, void *arg, uint8_t *data, size_t len);
 String buildHtmlPage(); // Keep existing HTML builder
 void mqttCallback(char* topic, byte* payload, unsigned int length);
 void reconnectMQTT();
 void publishHomeAssistantDiscovery();
+void setupLoopTasks();
 // --- End Forward declarations ---
 
 
@@ -193,6 +382,20 @@ String ACModeToString(ACMode mode) {
   }
 }
 
+String ACRoleToString(uint8_t role) {
+  switch (role) {
+    case AC_ROLE_PRIMARY: return "primary";
+    case AC_ROLE_SECONDARY: return "secondary";
+    default: return "auto";
+  }
+}
+
+uint8_t ACRoleFromString(String role) {
+  if (role == "primary") return AC_ROLE_PRIMARY;
+  if (role == "secondary") return AC_ROLE_SECONDARY;
+  return AC_ROLE_AUTO;
+}
+
 String ACFanModeToString(ACFanMode mode) {
   switch (mode) {
     case ACFanMode::FAN_AUTO: return "Auto";
@@ -248,13 +451,78 @@ bool getZoneState(int zoneIndex) {
   return inputStates[inputIndex];
 }
 
-void simulateButtonPressWithNegation(uint8_t pin, int delayMs) {
+bool sendIOCommand(IOCommandType type, uint8_t pin, uint16_t value) {
+  IOCommand command = { type, pin, value };
+  if (xQueueSend(ioCommandQueue, &command, 0) != pdTRUE) {
+    Serial.println("IO command queue full, command dropped");
+    return false;
+  }
+  ioScheduler.signal(ioCommandJob);
+  return true;
+}
+
+void startOutputPulse(int idx, uint16_t lengthMs) {
+  OutputPulse &pulse = outputPulses[idx];
+  digitalWrite(outputPins[idx], outputStates[idx] ? LOW : HIGH);
+  pulse.state = PULSE_HELD;
+  pulse.lengthMs = lengthMs;
+  pulse.dueMillis = millis() + lengthMs;
+}
+
+// Sets the pulse job's deadline to the nearest release, from the IO task only
+void armOutputPulses() {
+  unsigned long now = millis();
+  bool pending = false;
+  unsigned long nearest = 0;
+  for (int i = 0; i < MAX_OUTPUT_PINS; i++) {
+    if (outputPulses[i].state == PULSE_IDLE) continue;
+    long remaining = (long)(outputPulses[i].dueMillis - now);
+    unsigned long wait = remaining > 0 ? remaining : 0;
+    if (!pending || wait < nearest) nearest = wait;
+    pending = true;
+  }
+  if (pending) ioScheduler.runIn(outputPulseJob, nearest);
+}
+
+void pulseOutputPin(uint8_t pin, int delayMs) {
   int idx = findOutputIndexByPin(pin);
   if (idx == -1) return;
-  bool level = outputStates[idx];
-  digitalWrite(pin, level ? LOW : HIGH);
-  delay(delayMs);
-  digitalWrite(pin, level ? HIGH : LOW);
+  OutputPulse &pulse = outputPulses[idx];
+  if (pulse.state == PULSE_IDLE) {
+    startOutputPulse(idx, delayMs);
+  } else if (pulse.queued < UINT8_MAX) {
+    pulse.queued++;
+    pulse.queuedLengthMs = delayMs;
+  }
+  armOutputPulses();
+}
+
+void processOutputPulses() {
+  unsigned long now = millis();
+  for (int i = 0; i < MAX_OUTPUT_PINS; i++) {
+    OutputPulse &pulse = outputPulses[i];
+    if (pulse.state == PULSE_IDLE || (long)(now - pulse.dueMillis) < 0) continue;
+
+    if (pulse.state == PULSE_HELD) {
+      // back to whatever level the output is meant to have now
+      digitalWrite(outputPins[i], outputStates[i] ? HIGH : LOW);
+      if (pulse.queued > 0) {
+        pulse.state = PULSE_GAP;
+        pulse.dueMillis = now + pulse.lengthMs;
+      } else {
+        pulse.state = PULSE_IDLE;
+      }
+    } else {
+      pulse.queued--;
+      startOutputPulse(i, pulse.queuedLengthMs);
+    }
+  }
+  armOutputPulses();
+}
+
+// The IO task does the pulse, the caller does not wait for it
+void simulateButtonPressWithNegation(uint8_t pin, int delayMs) {
+  sendIOCommand(IO_PULSE, pin, delayMs);
 }
 
 void toggleZone(int zoneIndex) {
@@ -281,6 +549,95 @@ void processRootRoute(AsyncWebServerRequest *request) {
   request->send(200, "text/html", getStaticWebApp());
 }
 
+// Preferences key of a per unit AC setting, unit 0 keeps the original "ac_..." keys
+String ACPrefKey(const char* key, uint8_t unit) {
+  if (unit == 0) return String(key);
+  return String("ac") + String(unit) + String(key + 2);
+}
+
+// MQTT topic of an AC unit below the base topic, unit 0 keeps the original "/ac"
+String ACTopic(uint8_t unit) {
+  if (unit == 0) return String("/ac");
+  return String("/ac/") + String(unit);
+}
+
+void addACState(JsonObject ac, FujitsuAC &unit) {
+  ac["power"] = unit.getOnOff();
+  ac["mode"] = ACModeToString(static_cast<ACMode>(unit.getMode()));
+  ac["fanMode"] = ACFanModeToString(static_cast<ACFanMode>(unit.getFanMode()));
+  ac["temp"] = unit.getTemp();
+  ac["currentTemp"] = unit.getControllerTemp();
+}
+
+void addACBusMetrics(JsonObject acBus, FujitsuAC &unit) {
+  acBus["listen_only"] = unit.isListenOnly();
+  acBus["role"] = unit.isDetectingRole() ? "detecting" : unit.isPrimary() ? "primary" : "secondary";
+  acBus["frames_received"] = unit.getFramesReceived();
+  acBus["frames_sent"] = unit.getFramesSent();
+  acBus["rx_frames_per_second"] = unit.getReceiveRate();
+  acBus["tx_frames_per_second"] = unit.getSendRate();
+  acBus["incomplete_frames"] = unit.getIncompleteFrames();
+  acBus["resync_bytes"] = unit.getResyncBytes();
+  acBus["error_frames"] = unit.getErrorFrames();
+  acBus["echo_mismatches"] = unit.getEchoMismatches();
+  acBus["replies_skipped"] = unit.getRepliesSkipped();
+  acBus["glitches_rejected"] = unit.getGlitchesRejected();
+  acBus["connection_resets"] = unit.getConnectionResets();
+  acBus["recovering"] = unit.isRecovering();
+  // only a primary can tell a resumed session from a new login
+  if(unit.isPrimary() && !unit.isListenOnly()) {
+    acBus["fast_resumes"] = unit.getFastResumes();
+    acBus["full_logins"] = unit.getFullLogins();
+  }
+  acBus["last_recovery_ms"] = unit.getLastRecoveryMillis();
+  acBus["max_recovery_ms"] = unit.getMaxRecoveryMillis();
+  acBus["reply_delay_us"] = unit.getReplyDelay();
+  acBus["reply_jitter_max_us"] = unit.getReplyJitterMax();
+  acBus["late_replies_dropped"] = unit.getLateRepliesDropped();
+  acBus["parity_errors"] = unit.getParityErrors();
+  acBus["framing_errors"] = unit.getFramingErrors();
+  acBus["breaks"] = unit.getBreaks();
+  acBus["rx_overflows"] = unit.getRxOverflows();
+  acBus["capture_enabled"] = unit.capture.isEnabled();
+  acBus["capture_entries"] = unit.capture.getCount();
+  acBus["writes_applied"] = unit.getWritesApplied();
+  acBus["write_retries"] = unit.getWriteRetries();
+  acBus["write_failures"] = unit.getWriteFailures();
+  for (int primary = 1; primary >= 0; primary--) {
+    JsonObject role = acBus["write_latency_by_role"][primary ? "primary" : "secondary"].to<JsonObject>();
+    role["writes_applied"] = unit.getRoleWritesApplied(primary);
+    role["avg_ms"] = unit.getRoleWriteLatencyAverage(primary);
+    role["max_ms"] = unit.getRoleWriteLatencyMax(primary);
+  }
+  JsonArray writeLatency = acBus["write_latency_histogram"].to<JsonArray>();
+  const unsigned long *writeHistogram = unit.getWriteLatencyHistogram();
+  for (int i = 0; i < kWriteLatencyBuckets; i++) {
+    writeLatency.add(writeHistogram[i]);
+  }
+  JsonArray replyJitter = acBus["reply_jitter_histogram"].to<JsonArray>();
+  const unsigned long *jitterHistogram = unit.getReplyJitterHistogram();
+  for (int i = 0; i < kReplyJitterBuckets; i++) {
+    replyJitter.add(jitterHistogram[i]);
+  }
+  JsonArray frameGaps = acBus["frame_gap_histogram"].to<JsonArray>();
+  const unsigned long *gapHistogram = unit.getFrameGapHistogram();
+  for (int i = 0; i < kFrameGapBuckets; i++) {
+    frameGaps.add(gapHistogram[i]);
+  }
+}
+
+void addLoopTaskMetrics(JsonArray tasks, LoopScheduler &scheduler) {
+  for (byte i = 0; i < scheduler.getTaskCount(); i++) {
+    const LoopTask &task = scheduler.getTask(i);
+    JsonObject t = tasks.add<JsonObject>();
+    t["name"] = task.name;
+    t["period_ms"] = task.periodMillis;
+    t["runs"] = task.runs;
+    t["max_late_ms"] = task.maxLateMillis;
+    t["max_run_us"] = task.maxRunMicros;
+  }
+}
+
 String buildCurrentStatePayload(bool includeConfigs = false, bool includeMetrics = false) {
   JsonDocument doc;
   JsonArray outputsConfig;
@@ -288,8 +645,24 @@ String buildCurrentStatePayload(bool includeConfigs = false, bool includeMetrics
   JsonArray zonesConfig;
   doc["version"] = CONTROLLER_VERSION;
   if (includeConfigs) {
-    doc["config"]["ac"]["rxPin"] = acRxPin;
-    doc["config"]["ac"]["txPin"] = acTxPin;
+    doc["config"]["ac"]["rxPin"] = acRxPins[0];
+    doc["config"]["ac"]["txPin"] = acTxPins[0];
+    doc["config"]["ac"]["replyDelayUs"] = acReplyDelayUs[0];
+    doc["config"]["ac"]["listenOnly"] = acListenOnly[0];
+    doc["config"]["ac"]["confirmFrames"] = acConfirmFrames[0];
+    doc["config"]["ac"]["role"] = ACRoleToString(acRoles[0]);
+    doc["config"]["ac"]["coalesceMs"] = acCoalesceMillis;
+    doc["config"]["acUnitCount"] = acUnitCount;
+    JsonArray acUnitsConfig = doc["config"]["acUnits"].to<JsonArray>();
+    for (int i = 0; i < acUnitCount; i++) {
+      JsonObject unitConfig = acUnitsConfig.add<JsonObject>();
+      unitConfig["rxPin"] = acRxPins[i];
+      unitConfig["txPin"] = acTxPins[i];
+      unitConfig["replyDelayUs"] = acReplyDelayUs[i];
+      unitConfig["listenOnly"] = acListenOnly[i];
+      unitConfig["confirmFrames"] = acConfirmFrames[i];
+      unitConfig["role"] = ACRoleToString(acRoles[i]);
+    }
     doc["config"]["mqtt"]["brokerUrl"] = mqttBroker;
     doc["config"]["mqtt"]["brokerPort"] = mqttPort;
     doc["config"]["mqtt"]["username"] = mqttUser;
@@ -300,11 +673,14 @@ String buildCurrentStatePayload(bool includeConfigs = false, bool includeMetrics
     inputsConfig = doc["config"]["inputs"].to<JsonArray>();
     zonesConfig = doc["config"]["zones"].to<JsonArray>();
   }
-  doc["ac"]["power"] = fujitsu.getOnOff();
-  doc["ac"]["mode"] = ACModeToString(static_cast<ACMode>(fujitsu.getMode()));
-  doc["ac"]["fanMode"] = ACFanModeToString(static_cast<ACFanMode>(fujitsu.getFanMode()));
-  doc["ac"]["temp"] = fujitsu.getTemp();
-  doc["ac"]["currentTemp"] = fujitsu.getControllerTemp();
+  // "ac" stays the first unit for existing clients, "acUnits" has them all
+  addACState(doc["ac"].to<JsonObject>(), acUnits[0]);
+  JsonArray acUnitsArray = doc["acUnits"].to<JsonArray>();
+  for (int i = 0; i < acUnitCount; i++) {
+    JsonObject unitState = acUnitsArray.add<JsonObject>();
+    unitState["unit"] = i;
+    addACState(unitState, acUnits[i]);
+  }
 
   JsonArray outputs = doc["outputs"].to<JsonArray>();
   for (int i = 0; i < outputPinCount; i++) {
@@ -352,7 +728,52 @@ String buildCurrentStatePayload(bool includeConfigs = false, bool includeMetrics
     metrics["flash_size"] = ESP.getFlashChipSize();
     metrics["wifi_rssi"] = WiFi.RSSI();
     metrics["mqtt_connected"] = mqttClient.connected();
+    metrics["ac_trace"] = acTracePrinter.isEnabled();
     metrics["ws_clients"] = ws.count();
+
+    addLoopTaskMetrics(metrics["loop_tasks"].to<JsonArray>(), loopScheduler);
+    addLoopTaskMetrics(metrics["io_tasks"].to<JsonArray>(), ioScheduler);
+    JsonObject stateEvents = metrics["state_events"].to<JsonObject>();
+    stateEvents["received"] = stateEventsReceived;
+    stateEvents["batches"] = stateEventBatches;
+    stateEvents["overflows"] = stateEventOverflows;
+    JsonObject commands = metrics["commands"].to<JsonObject>();
+    commands["received"] = controlCommandsReceived;
+    commands["coalesced"] = controlCommandsCoalesced;
+    commands["deduplicated"] = controlCommandsDeduplicated;
+    commands["rejected"] = controlCommandsRejected;
+
+    JsonObject acBus = metrics["ac_bus"].to<JsonObject>();
+    addACBusMetrics(acBus, acUnits[0]);
+#ifdef FUJITSU_SIM_BUS
+    JsonObject sim = acBus["sim"].to<JsonObject>();
+    sim["latency_us"] = simBus.getLatency();
+    sim["byte_loss_permille"] = simBus.getByteLoss();
+    sim["parity_error_permille"] = simBus.getParityErrors();
+    sim["wall_controller"] = simBus.getWallController();
+    sim["benchmark_interval_ms"] = simBus.getBenchmarkInterval();
+    sim["logged_in"] = simBus.isLoggedIn();
+    sim["login_us"] = simBus.getLoginMicros();
+    sim["logins"] = simBus.getLogins();
+    sim["frames_per_second"] = simBus.getFramesPerSecond();
+    sim["replies_missed"] = simBus.getRepliesMissed();
+    sim["bytes_dropped"] = simBus.getBytesDropped();
+    sim["parity_errors_raised"] = simBus.getParityErrorsRaised();
+    sim["commands"] = simBus.getCommands();
+    sim["command_timeouts"] = simBus.getCommandTimeouts();
+    sim["applied_latency_last_us"] = simBus.getAppliedLatencyLast();
+    sim["applied_latency_avg_us"] = simBus.getAppliedLatencyAverage();
+    sim["applied_latency_max_us"] = simBus.getAppliedLatencyMax();
+    sim["confirmed_latency_last_us"] = simBus.getConfirmedLatencyLast();
+    sim["confirmed_latency_avg_us"] = simBus.getConfirmedLatencyAverage();
+    sim["confirmed_latency_max_us"] = simBus.getConfirmedLatencyMax();
+#endif
+    JsonArray acBusUnits = metrics["ac_bus_units"].to<JsonArray>();
+    for (int i = 0; i < acUnitCount; i++) {
+      JsonObject unitBus = acBusUnits.add<JsonObject>();
+      unitBus["unit"] = i;
+      addACBusMetrics(unitBus, acUnits[i]);
+    }
   }
 
   String payload;
@@ -456,9 +877,19 @@ void processSavePinConfigRoute(AsyncWebServerRequest *request, uint8_t *data, si
             return;
         }
 
+        // "acUnits" lists every unit including the first, whatever its first entry sets takes the
+        // place of the top level AC settings
+        JsonObject firstAcUnit = doc["acUnits"][0];
+        if (firstAcUnit["rxPin"].is<uint8_t>()) doc["acRxPin"] = firstAcUnit["rxPin"];
+        if (firstAcUnit["txPin"].is<uint8_t>()) doc["acTxPin"] = firstAcUnit["txPin"];
+        if (firstAcUnit["replyDelayUs"].is<uint32_t>()) doc["acReplyDelayUs"] = firstAcUnit["replyDelayUs"];
+        if (firstAcUnit["listenOnly"].is<bool>()) doc["acListenOnly"] = firstAcUnit["listenOnly"];
+        if (firstAcUnit["confirmFrames"].is<uint8_t>()) doc["acConfirmFrames"] = firstAcUnit["confirmFrames"];
+        if (firstAcUnit["role"].is<String>()) doc["acRole"] = firstAcUnit["role"];
+
         // Extract the pin configurations
-        uint8_t newAcRxPin = doc["acRxPin"];
-        uint8_t newAcTxPin = doc["acTxPin"];
+        uint8_t newAcRxPin = doc["acRxPin"] | acRxPins[0];
+        uint8_t newAcTxPin = doc["acTxPin"] | acTxPins[0];
 
         // Extract output pins
         JsonArray outputPinsArray = doc["outputPins"];
@@ -484,10 +915,54 @@ void processSavePinConfigRoute(AsyncWebServerRequest *request, uint8_t *data, si
             newInputPins[i] = inputPinsArray[i];
         }
 
+        // The AC uarts must not share a GPIO with the zone pins, the sampler and the uart would fight over it
+        uint8_t newAcUnitCount = doc["acUnits"].is<JsonArray>() ? constrain((int)doc["acUnits"].size(), 1, MAX_AC_UNITS) : acUnitCount;
+        for (int i = 0; i < newAcUnitCount; i++) {
+            uint8_t rxPin = i == 0 ? newAcRxPin : (doc["acUnits"][i]["rxPin"] | acRxPins[i]);
+            uint8_t txPin = i == 0 ? newAcTxPin : (doc["acUnits"][i]["txPin"] | acTxPins[i]);
+            for (int j = 0; j < newOutputPinCount + newInputPinCount; j++) {
+                uint8_t pin = j < newOutputPinCount ? newOutputPins[j] : newInputPins[j - newOutputPinCount];
+                if (pin == rxPin || pin == txPin) {
+                    request->send(400, "application/json", "{\"success\":false,\"error\":\"AC unit " + String(i) + " pin " + String(pin) + " is also an input or output pin\"}");
+                    return;
+                }
+            }
+        }
+
         // Save the pin configurations to preferences
         preferences.begin("pin-config", false);
         preferences.putUChar(PREF_KEY_AC_RX_PIN, newAcRxPin);
         preferences.putUChar(PREF_KEY_AC_TX_PIN, newAcTxPin);
+        if (doc["acReplyDelayUs"].is<uint32_t>()) {
+            preferences.putUInt(PREF_KEY_AC_REPLY_DELAY, doc["acReplyDelayUs"].as<uint32_t>());
+        }
+        if (doc["acListenOnly"].is<bool>()) {
+            preferences.putBool(PREF_KEY_AC_LISTEN_ONLY, doc["acListenOnly"].as<bool>());
+        }
+        if (doc["acConfirmFrames"].is<uint8_t>()) {
+            preferences.putUChar(PREF_KEY_AC_CONFIRM_FRAMES, doc["acConfirmFrames"].as<uint8_t>());
+        }
+        if (doc["acRole"].is<String>()) {
+            preferences.putUChar(PREF_KEY_AC_ROLE, ACRoleFromString(doc["acRole"].as<String>()));
+        }
+        if (doc["acCoalesceMs"].is<uint16_t>()) {
+            preferences.putUShort(PREF_KEY_AC_COALESCE, doc["acCoalesceMs"].as<uint16_t>());
+        }
+
+        // Optional extra indoor units, the first entry went into the top level settings above
+        if (doc["acUnits"].is<JsonArray>()) {
+            JsonArray acUnitsArray = doc["acUnits"];
+            preferences.putUChar(PREF_KEY_AC_UNITS, newAcUnitCount);
+            for (int i = 1; i < newAcUnitCount; i++) {
+                JsonObject unitConfig = acUnitsArray[i];
+                preferences.putUChar(ACPrefKey(PREF_KEY_AC_RX_PIN, i).c_str(), unitConfig["rxPin"] | acRxPins[i]);
+                preferences.putUChar(ACPrefKey(PREF_KEY_AC_TX_PIN, i).c_str(), unitConfig["txPin"] | acTxPins[i]);
+                preferences.putUInt(ACPrefKey(PREF_KEY_AC_REPLY_DELAY, i).c_str(), unitConfig["replyDelayUs"] | acReplyDelayUs[i]);
+                preferences.putBool(ACPrefKey(PREF_KEY_AC_LISTEN_ONLY, i).c_str(), unitConfig["listenOnly"] | acListenOnly[i]);
+                preferences.putUChar(ACPrefKey(PREF_KEY_AC_CONFIRM_FRAMES, i).c_str(), unitConfig["confirmFrames"] | acConfirmFrames[i]);
+                preferences.putUChar(ACPrefKey(PREF_KEY_AC_ROLE, i).c_str(), ACRoleFromString(unitConfig["role"] | ACRoleToString(acRoles[i])));
+            }
+        }
 
         // Save output pins as a string of comma-separated values
         String outputPinsStr = "";
@@ -600,13 +1075,9 @@ Melody getMelodyByIndex(int index) {
   }
 }
 
-void notifyAudibleTone(uint8_t index = currentMelodyIndex) {
-  // Cycle through different melodies each time this function is called
+void playAudibleTone(uint8_t index) {
   Melody melody = getMelodyByIndex(index);
 
-  // Move to next melody for next time (cycle through 0-13)
-  currentMelodyIndex = (currentMelodyIndex + 1) % 14;
-
   Serial.println(String(" Title: ") + melody.getTitle());
   Serial.println(String(" Time unit: ") + melody.getTimeUnit());
   Serial.println("Start playing in non-blocking mode...");
@@ -615,6 +1086,13 @@ void notifyAudibleTone(uint8_t index = currentMelodyIndex) {
   Serial.println("Melody is playing!");
 }
 
+void notifyAudibleTone(uint8_t index = currentMelodyIndex) {
+  // Cycle through different melodies each time this function is called (0-13), the IO task plays it
+  currentMelodyIndex = (currentMelodyIndex + 1) % 14;
+
+  sendIOCommand(IO_TONE, 0, index);
+}
+
 void notifyWSSubscribers(String message = buildCurrentStatePayload()) {
   ws.textAll(message);
 }
@@ -626,14 +1104,270 @@ void notifyMqttTopics(String message = buildCurrentStatePayload()) {
     }
 }
 
-void notifyObservers() {
+void postStateEvent(StateEventType type, uint8_t unit = 0, byte fields = 0, bool audible = true) {
+  StateEvent event = { type, unit, fields, audible };
+  if (xQueueSend(stateEventQueue, &event, 0) != pdTRUE) {
+    stateEventsOverflowed = true;
+  }
+  loopScheduler.signal(stateEventsJob);
+}
+
+// Home Assistant climate mode, power and mode folded into one value
+String ACHvacModeString(FujitsuAC &ac) {
+  if (!ac.getOnOff()) return "off";
+  ACMode mode = static_cast<ACMode>(ac.getMode());
+  if (mode == ACMode::FAN) return "fan_only";
+  String modeStr = ACModeToString(mode);
+  modeStr.toLowerCase();
+  return modeStr;
+}
+
+// Only the AC fields in changedFields, as {"type":"ac","unit":n,"ac":{...}}
+String buildACDeltaPayload(uint8_t unit, byte changedFields) {
+  FujitsuAC &unitAC = acUnits[unit];
+  JsonDocument doc;
+  doc["type"] = "ac";
+  doc["unit"] = unit;
+  JsonObject ac = doc["ac"].to<JsonObject>();
+  if (changedFields & kOnOffUpdateMask) ac["power"] = unitAC.getOnOff();
+  if (changedFields & kModeUpdateMask) ac["mode"] = ACModeToString(static_cast<ACMode>(unitAC.getMode()));
+  if (changedFields & kFanModeUpdateMask) ac["fanMode"] = ACFanModeToString(static_cast<ACFanMode>(unitAC.getFanMode()));
+  if (changedFields & kTempUpdateMask) ac["temp"] = unitAC.getTemp();
+  if (changedFields & kControllerTempUpdateMask) ac["currentTemp"] = unitAC.getControllerTemp();
+
+  String payload;
+  serializeJson(doc, payload);
+  return payload;
+}
+
+// Retained per field state topics under <base>/ac/state/ (<base>/ac/<n>/state/ for further
+// units), these back the HA climate entities
+void publishACStateTopics(uint8_t unit, byte changedFields) {
+  if (!mqttClient.connected()) return;
+
+  FujitsuAC &ac = acUnits[unit];
+  String stateTopic = String(mqttBaseTopic) + ACTopic(unit) + "/state/";
+  if (changedFields & (kOnOffUpdateMask | kModeUpdateMask)) {
+    mqttClient.publish((stateTopic + "mode").c_str(), ACHvacModeString(ac).c_str(), true);
+  }
+  if (changedFields & kFanModeUpdateMask) {
+    String fanMode = ACFanModeToString(static_cast<ACFanMode>(ac.getFanMode()));
+    fanMode.toLowerCase();
+    mqttClient.publish((stateTopic + "fan_mode").c_str(), fanMode.c_str(), true);
+  }
+  if (changedFields & kTempUpdateMask) {
+    mqttClient.publish((stateTopic + "temp").c_str(), String(ac.getTemp()).c_str(), true);
+  }
+  if (changedFields & kControllerTempUpdateMask) {
+    mqttClient.publish((stateTopic + "current_temp").c_str(), String(ac.getControllerTemp()).c_str(), true);
+  }
+}
+
+// Publishes everything queued since the last run once: one status payload however many zone,
+// pin and config events came in, one delta per AC unit with the changed fields merged, one tone
+void processStateEvents() {
+  bool fullState = stateEventsOverflowed.exchange(false);
+  bool audible = false;
+  byte acFields[MAX_AC_UNITS] = { 0 };
+  if (fullState) {
+    stateEventOverflows++;
+    for (uint8_t unit = 0; unit < acUnitCount; unit++) acFields[unit] = notifyACFields;
+  }
+
+  StateEvent event;
+  while (xQueueReceive(stateEventQueue, &event, 0) == pdTRUE) {
+    stateEventsReceived++;
+    if (event.type == EVENT_AC_CHANGED) {
+      if (event.unit >= MAX_AC_UNITS) continue;
+      acFields[event.unit] |= event.fields;
+      // the room temperature drifting on its own is not worth a tone
+      if (event.audible && (event.fields & ~kControllerTempUpdateMask)) audible = true;
+    } else {
+      fullState = true;
+      if (event.audible) audible = true;
+    }
+  }
+  stateEventBatches++;
+
+  if (fullState) {
     String message = buildCurrentStatePayload();
     notifyWSSubscribers(message);
-    notifyAudibleTone(4);
     notifyMqttTopics(message);
+  }
+  for (uint8_t unit = 0; unit < acUnitCount; unit++) {
+    if (!acFields[unit]) continue;
+    notifyWSSubscribers(buildACDeltaPayload(unit, acFields[unit]));
+    publishACStateTopics(unit, acFields[unit]);
+  }
+  if (audible) notifyAudibleTone(4);
+}
+
+String ACWriteFieldToString(byte field) {
+  switch (field) {
+    case kOnOffUpdateMask: return "power";
+    case kTempUpdateMask: return "temp";
+    case kModeUpdateMask: return "mode";
+    case kFanModeUpdateMask: return "fan";
+    case kEconomyModeUpdateMask: return "economy";
+    case kSwingModeUpdateMask: return "swing";
+    case kSwingStepUpdateMask: return "swingStep";
+    default: return "unknown";
+  }
+}
+
+String ACWriteStatusToString(byte status) {
+  switch (status) {
+    case kWriteApplied: return "applied";
+    case kWriteFailed: return "failed";
+    case kWriteSuperseded: return "superseded";
+    default: return "unknown";
+  }
+}
+
+void addACWriteResult(JsonObject obj, uint8_t unit, const WriteResult &result) {
+  obj["id"] = result.commandId;
+  obj["unit"] = unit;
+  obj["field"] = ACWriteFieldToString(result.field);
+  obj["status"] = ACWriteStatusToString(result.status);
+  obj["value"] = result.value;
+  obj["retries"] = result.retries;
+  obj["latencyMs"] = result.latencyMillis;
+}
+
+// Bus statistics of every unit on its ~/ac/state/bus topic
+void publishACBusStats() {
+  if (!mqttClient.connected()) return;
+
+  for (uint8_t unit = 0; unit < acUnitCount; unit++) {
+    JsonDocument doc;
+    addACBusMetrics(doc.to<JsonObject>(), acUnits[unit]);
+    String payload;
+    serializeJson(doc, payload);
+    mqttClient.publish((String(mqttBaseTopic) + ACTopic(unit) + "/state/bus").c_str(), payload.c_str());
+  }
+}
+
+// Call with acWriteResultsMux held
+ACOutstandingCommand *findOutstandingACCommand(uint32_t commandId) {
+  for (int i = 0; i < AC_WRITE_RESULT_HISTORY; i++) {
+    if (acOutstandingCommands[i].fields > 0 && acOutstandingCommands[i].commandId == commandId) return &acOutstandingCommands[i];
+  }
+  return nullptr;
+}
+
+// Counts field writes a command has yet to report, fields < 0 takes back ones that will never
+// report. The oldest command makes room once the table is full
+void trackACCommand(uint32_t commandId, int fields) {
+  if (commandId == 0) return;
+  portENTER_CRITICAL(&acWriteResultsMux);
+  ACOutstandingCommand *command = findOutstandingACCommand(commandId);
+  if (!command && fields > 0) {
+    command = &acOutstandingCommands[acOutstandingNext];
+    acOutstandingNext = (acOutstandingNext + 1) % AC_WRITE_RESULT_HISTORY;
+    command->commandId = commandId;
+    command->fields = 0;
+  }
+  if (command) command->fields += fields;
+  portEXIT_CRITICAL(&acWriteResultsMux);
+}
+
+// Tell whoever issued the write how it went, on websocket and ~/ac/result
+void notifyACWriteResult(uint8_t unit, const WriteResult &result) {
+  portENTER_CRITICAL(&acWriteResultsMux);
+  acWriteResults[acWriteResultNext].unit = unit;
+  acWriteResults[acWriteResultNext].result = result;
+  acWriteResultNext = (acWriteResultNext + 1) % AC_WRITE_RESULT_HISTORY;
+  if (acWriteResultCount < AC_WRITE_RESULT_HISTORY) acWriteResultCount++;
+  ACOutstandingCommand *command = result.commandId ? findOutstandingACCommand(result.commandId) : nullptr;
+  if (command) command->fields--;
+  portEXIT_CRITICAL(&acWriteResultsMux);
+
+  JsonDocument doc;
+  addACWriteResult(doc.to<JsonObject>(), unit, result);
+  String payload;
+  serializeJson(doc, payload);
+
+  if (mqttClient.connected()) {
+    mqttClient.publish((String(mqttBaseTopic) + "/ac/result").c_str(), payload.c_str());
+  }
+
+  doc["type"] = "ac_result";
+  payload = "";
+  serializeJson(doc, payload);
+  notifyWSSubscribers(payload);
+
+  // Whatever rode along on this write gets the same answer
+  for (int i = 0; i < AC_WRITE_RESULT_HISTORY; i++) {
+    ACAttachedCommand &attached = acAttachedCommands[i];
+    if (attached.commandId == 0 || attached.unit != unit || attached.field != result.field || attached.carrierId != result.commandId) continue;
+    WriteResult attachedResult = result;
+    attachedResult.commandId = attached.commandId;
+    attached.commandId = 0;
+    notifyACWriteResult(unit, attachedResult);
+  }
+}
+
+void addACError(JsonObject obj, const ACErrorRecord &record) {
+  obj["seq"] = record.sequence;
+  obj["ageMs"] = millis() - record.millis;
+  obj["code"] = record.code;
+  obj["source"] = record.source;
+  char frame[kFrameLength * 2 + 1];
+  for (int i = 0; i < kFrameLength; i++) sprintf(frame + i * 2, "%02X", record.frame[i]);
+  obj["frame"] = frame;
+
+  FujitsuFrame state;
+  state.raw = record.state;
+  JsonObject stateObj = obj["state"].to<JsonObject>();
+  stateObj["power"] = state.get<kFieldEnabled>() == 1;
+  stateObj["mode"] = ACModeToString(static_cast<ACMode>(state.get<kFieldMode>()));
+  stateObj["fanMode"] = ACFanModeToString(static_cast<ACFanMode>(state.get<kFieldFan>()));
+  stateObj["temp"] = state.get<kFieldTemperature>();
+  stateObj["currentTemp"] = state.get<kFieldControllerTemp>();
+}
+
+// Latest error frame of a unit on its retained ~/ac/state/error topic, backs the HA error sensor
+void publishACErrorState(uint8_t unit) {
+  if (!mqttClient.connected()) return;
+
+  FujitsuAC &ac = acUnits[unit];
+  JsonDocument doc;
+  uint32_t count = ac.getErrorFrames();
+  ACErrorRecord record;
+  if (count > 0 && ac.readError(count - 1, &record)) {
+    addACError(doc.to<JsonObject>(), record);
+  } else {
+    doc["code"] = nullptr;
+  }
+  doc["count"] = count;
+
+  String payload;
+  serializeJson(doc, payload);
+  mqttClient.publish((String(mqttBaseTopic) + ACTopic(unit) + "/state/error").c_str(), payload.c_str(), true);
+}
+
+void notifyACErrors(uint8_t unit, uint32_t from, uint32_t to) {
+  FujitsuAC &ac = acUnits[unit];
+  if (from < ac.getOldestError()) from = ac.getOldestError();
+
+  for (uint32_t seq = from; seq < to; seq++) {
+    ACErrorRecord record;
+    if (!ac.readError(seq, &record)) continue;
+    Serial.printf("AC %d error frame, code %02X\n", unit, record.code);
+
+    JsonDocument doc;
+    doc["type"] = "ac_error";
+    doc["unit"] = unit;
+    addACError(doc["error"].to<JsonObject>(), record);
+    String payload;
+    serializeJson(doc, payload);
+    notifyWSSubscribers(payload);
+  }
+  publishACErrorState(unit);
 }
 
 void onWsEvent(AsyncWebSocket *server, AsyncWebSocketClient *client, AwsEventType type, void *arg, uint8_t *data, size_t len) {
+  ProfileSpan span(profiler, wsEventStage);
   switch (type) {
     case WS_EVT_CONNECT:
       Serial.printf("WebSocket client #%u connected from %s\n", client->id(), client->remoteIP().toString().c_str());
@@ -657,7 +1391,7 @@ void processColourLEDControl(AsyncWebServerRequest *request, String setting, Str
   } else {
     if (request) request->send(400, "application/json", "{\"success\":false,\"error\":\"Unknown setting\"}"); return;
   }
-  if (changed) notifyObservers();
+  if (changed) postStateEvent(EVENT_CONFIG_CHANGED);
 }
 
 void processBuzzerControl(AsyncWebServerRequest *request, String setting, String value) {
@@ -683,86 +1417,199 @@ void processBuzzerControl(AsyncWebServerRequest *request, String setting, String
   } else {
     if (request) request->send(400, "application/json", "{\"success\":false,\"error\":\"Unknown setting\"}"); return;
   }
-  if (changed) notifyObservers();
+  if (changed) postStateEvent(EVENT_CONFIG_CHANGED);
+}
+
+bool queueControlCommand(ControlTarget target, uint8_t index, byte field, byte value, uint32_t commandId = 0, bool powerOn = false) {
+  ControlCommand command = { target, index, field, value, commandId, powerOn };
+  int fields = powerOn ? 2 : 1;
+  // Counted before it is sent, the network task may report it before we get to run again
+  if (target == CONTROL_AC) trackACCommand(commandId, fields);
+  if (xQueueSend(controlQueue, &command, 0) != pdTRUE) {
+    if (target == CONTROL_AC) trackACCommand(commandId, -fields);
+    controlCommandsRejected++;
+    return false;
+  }
+  loopScheduler.signal(controlCommandsJob);
+  return true;
+}
+
+// Write results for commands that never reach the driver, so /api/ac/result still answers them
+void reportACCommand(uint8_t unit, byte field, byte value, uint32_t commandId, WriteStatus status) {
+  if (commandId == 0) return;
+  WriteResult result = { commandId, field, status, value, 0, 0 };
+  notifyACWriteResult(unit, result);
+}
+
+void attachACCommand(uint8_t unit, byte field, byte value, uint32_t commandId, uint32_t carrierId) {
+  if (commandId == 0) return;
+  ACAttachedCommand &slot = acAttachedCommands[acAttachedNext];
+  acAttachedNext = (acAttachedNext + 1) % AC_WRITE_RESULT_HISTORY;
+  // Out of room, the oldest one is let go without waiting for its carrier
+  if (slot.commandId != 0) reportACCommand(slot.unit, slot.field, slot.value, slot.commandId, kWriteSuperseded);
+  slot = { commandId, carrierId, unit, field, value };
+}
+
+byte getACFieldValue(FujitsuAC &ac, byte field) {
+  switch (field) {
+    case kOnOffUpdateMask: return ac.getOnOff();
+    case kTempUpdateMask: return ac.getTemp();
+    case kModeUpdateMask: return ac.getMode();
+    case kFanModeUpdateMask: return ac.getFanMode();
+    default: return 0;
+  }
+}
+
+void applyACWrite(uint8_t unit, byte field, byte value, uint32_t commandId) {
+  FujitsuAC &ac = acUnits[unit];
+
+  // Nothing to send if the same value is already on its way, or already set with nothing else pending
+  byte pendingValue;
+  uint32_t pendingCommandId;
+  bool pending = ac.getPendingWrite(field, &pendingValue, &pendingCommandId);
+  if (pending ? pendingValue == value : getACFieldValue(ac, field) == value) {
+    controlCommandsDeduplicated++;
+    if (pending) attachACCommand(unit, field, value, commandId, pendingCommandId);
+    else reportACCommand(unit, field, value, commandId, kWriteApplied);
+    return;
+  }
+
+  // Observers hear about it through the driver's changed fields once it publishes the write
+  switch (field) {
+    case kOnOffUpdateMask: ac.setOnOff(value, commandId); break;
+    case kTempUpdateMask: ac.setTemp(value, commandId); break;
+    case kModeUpdateMask: ac.setMode(value, commandId); break;
+    case kFanModeUpdateMask: ac.setFanMode(value, commandId); break;
+  }
+}
+
+void applyZoneCommand(int zoneIndex, byte action) {
+  bool currentState = getZoneState(zoneIndex);
+  if (action == ZONE_TOGGLE || (action == ZONE_ON && !currentState) || (action == ZONE_OFF && currentState)) {
+    toggleZone(zoneIndex);
+    postStateEvent(EVENT_ZONE_CHANGED);
+  }
+}
+
+// Starts or joins the field's coalescing window
+void holdACWrite(uint8_t unit, byte field, byte value, uint32_t commandId) {
+  PendingACWrite &write = pendingACWrites[unit][__builtin_ctz(field)];
+  if (write.pending) {
+    // Last writer wins, the one it replaces never goes out
+    controlCommandsCoalesced++;
+    if (write.commandId != commandId) reportACCommand(unit, field, write.value, write.commandId, kWriteSuperseded);
+    else trackACCommand(write.commandId, -1); // Same command again, one result answers both
+  } else {
+    write.pending = true;
+    write.firstMillis = millis();
+  }
+  write.value = value;
+  write.commandId = commandId;
+}
+
+void processControlCommands() {
+  ControlCommand command;
+  while (xQueueReceive(controlQueue, &command, 0) == pdTRUE) {
+    controlCommandsReceived++;
+    if (command.target == CONTROL_ZONE) {
+      applyZoneCommand(command.index, command.field);
+      continue;
+    }
+
+    if (command.powerOn) holdACWrite(command.index, kOnOffUpdateMask, true, command.commandId);
+    holdACWrite(command.index, command.field, command.value, command.commandId);
+  }
+
+  // Write whatever has sat out its window, come back for the rest when the next one closes
+  unsigned long now = millis();
+  unsigned long nextDue = 0;
+  bool waiting = false;
+  for (uint8_t unit = 0; unit < acUnitCount; unit++) {
+    for (int i = 1; i < 8; i++) {
+      PendingACWrite &write = pendingACWrites[unit][i];
+      if (!write.pending) continue;
+      unsigned long held = now - write.firstMillis;
+      if (held >= acCoalesceMillis) {
+        write.pending = false;
+        applyACWrite(unit, 1 << i, write.value, write.commandId);
+      } else if (!waiting || acCoalesceMillis - held < nextDue) {
+        nextDue = acCoalesceMillis - held;
+        waiting = true;
+      }
+    }
+  }
+  if (waiting) loopScheduler.runIn(controlCommandsJob, nextDue);
 }
 
 void processZoneControl(AsyncWebServerRequest *request, String zoneId, String action) {
   int zoneIndex = findZoneById(zoneId);
-  bool changed = false;
 
   if (zoneIndex == -1) {
     if (request) request->send(404, "application/json", "{\"success\":false,\"error\":\"Zone not found\"}");
     return;
   }
 
+  ZoneAction zoneAction;
   if (action == "toggle") {
-    toggleZone(zoneIndex);
-    changed = true;
-    if (request) request->send(200, "application/json", "{\"success\":true,\"action\":\"toggle\",\"zone\":\"" + zoneId + "\"}");
+    zoneAction = ZONE_TOGGLE;
   } else if (action == "on" || action == "1") {
-    bool currentState = getZoneState(zoneIndex);
-    if (!currentState) {
-      toggleZone(zoneIndex);
-      changed = true;
-    }
-    if (request) request->send(200, "application/json", "{\"success\":true,\"action\":\"on\",\"zone\":\"" + zoneId + "\"}");
+    zoneAction = ZONE_ON;
+    action = "on";
   } else if (action == "off" || action == "0") {
-    bool currentState = getZoneState(zoneIndex);
-    if (currentState) {
-      toggleZone(zoneIndex);
-      changed = true;
-    }
-    if (request) request->send(200, "application/json", "{\"success\":true,\"action\":\"off\",\"zone\":\"" + zoneId + "\"}");
+    zoneAction = ZONE_OFF;
+    action = "off";
   } else {
     if (request) request->send(400, "application/json", "{\"success\":false,\"error\":\"Unknown action\"}");
     return;
   }
 
-  if (changed) notifyObservers();
+  if (!queueControlCommand(CONTROL_ZONE, zoneIndex, zoneAction, 0)) {
+    if (request) request->send(503, "application/json", "{\"success\":false,\"error\":\"Command queue full\"}");
+    return;
+  }
+  if (request) request->send(200, "application/json", "{\"success\":true,\"action\":\"" + action + "\",\"zone\":\"" + zoneId + "\"}");
 }
 
 void processOutputPinControl(AsyncWebServerRequest *request, String pinStr, String valueStr) {
   int pin = pinStr.toInt();
-  bool changed = false;
-  if (valueStr == "press") {
-    simulateButtonPressWithNegation(pin, 350);
-    changed = true; // Assume change for notification
+  bool press = valueStr == "press";
+  // The IO task owns the pins, a level set is reported by it once it has been made
+  if (!sendIOCommand(press ? IO_PULSE : IO_SET, pin, press ? 350 : valueStr.toInt() > 0)) {
+    if (request) request->send(503, "application/json", "{\"success\":false,\"error\":\"Command queue full\"}");
+    return;
+  }
+  if (press) {
     if (request) request->send(200, "application/json", "{\"success\":true,\"action\":\"press\",\"pin\":" + pinStr + "}");
+    postStateEvent(EVENT_PIN_CHANGED); // Assume change for notification
   } else {
-    bool newState = (valueStr.toInt() > 0);
-    int outputIndex = findOutputIndexByPin(pin);
-    if (outputIndex != -1 && outputStates[outputIndex] != newState) {
-      digitalWrite(pin, newState ? HIGH : LOW);
-      outputStates[outputIndex] = newState;
-      changed = true;
-    }
     if (request) request->send(200, "application/json", "{\"success\":true,\"pin\":" + pinStr + ",\"value\":" + valueStr + "}");
   }
-  if (changed) notifyObservers();
 }
 
-void processACControl(AsyncWebServerRequest *request, String setting, String value) {
+void processACControl(AsyncWebServerRequest *request, String setting, String value, uint32_t commandId, uint8_t unit) {
 
-  bool changed = false;
+  FujitsuAC &ac = acUnits[unit];
+
+  if (ac.isListenOnly()) {
+    // Nothing is ever written to the bus in listen-only mode
+    if (request) request->send(409, "application/json", "{\"success\":false,\"error\":\"AC unit is listen-only\",\"unit\":" + String(unit) + "}");
+    return;
+  }
+
+  if (commandId == 0) commandId = (nextACCommandId++ & AC_CLIENT_COMMAND_ID_MAX) | AC_GENERATED_COMMAND_ID_BIT;
 
+  // The network task writes the fields once their coalescing window closes
+  bool queued;
   if (setting == "temp") {
 
-    int temp = value.toInt();
-    if (static_cast<int>(fujitsu.getTemp()) != temp) {
-        fujitsu.setTemp(temp);
-        changed = true;
-    }
-    if (request) request->send(200, "application/json", "{\"success\":true,\"setting\":\"temp\",\"value\":" + value + "}");
+    queued = queueControlCommand(CONTROL_AC, unit, kTempUpdateMask, value.toInt(), commandId);
 
   } else if (setting == "mode") {
 
     // Handle the combined mode/power setting
     if (value == "off") {
         // Turn off the AC
-        if (static_cast<bool>(fujitsu.getOnOff()) != false) {
-            fujitsu.setOnOff(false);
-            changed = true;
-        }
+        queued = queueControlCommand(CONTROL_AC, unit, kOnOffUpdateMask, false, commandId);
     } else {
         // Set the mode and ensure power is on
         byte newModeByte = static_cast<byte>(ACMode::AUTO);
@@ -777,19 +1624,8 @@ void processACControl(AsyncWebServerRequest *request, String setting, String val
             Serial.println("Unknown mode string received: " + value + ". Using default AUTO.");
         }
 
-        // Turn on the AC if it's off
-        if (static_cast<bool>(fujitsu.getOnOff()) != true) {
-            fujitsu.setOnOff(true);
-            changed = true;
-        }
-
-        // Set the mode if it's different
-        if (static_cast<byte>(fujitsu.getMode()) != newModeByte) {
-            fujitsu.setMode(newModeByte);
-            changed = true;
-        }
+        queued = queueControlCommand(CONTROL_AC, unit, kModeUpdateMask, newModeByte, commandId, true);
     }
-    if (request) request->send(200, "application/json", "{\"success\":true,\"setting\":\"mode\",\"value\":\"" + value + "\"}");
 
   } else if (setting == "fan") {
 
@@ -803,21 +1639,13 @@ void processACControl(AsyncWebServerRequest *request, String setting, String val
     else {
         Serial.println("Unknown fan mode string received: " + value + ". Using default FAN_AUTO.");
     }
-    if (static_cast<byte>(fujitsu.getFanMode()) != newFanMode) {
-        fujitsu.setFanMode(newFanMode);
-        changed = true;
-    }
-    if (request) request->send(200, "application/json", "{\"success\":true,\"setting\":\"fan\",\"value\":\"" + value + "\"}");
+    queued = queueControlCommand(CONTROL_AC, unit, kFanModeUpdateMask, newFanMode, commandId);
 
   } else if (setting == "power") {
 
     // Keep the legacy power control for backward compatibility
     bool newPower = (value == "on" || value == "1");
-    if (static_cast<bool>(fujitsu.getOnOff()) != newPower) {
-        fujitsu.setOnOff(newPower);
-        changed = true;
-    }
-    if (request) request->send(200, "application/json", "{\"success\":true,\"setting\":\"power\",\"value\":\"" + value + "\"}");
+    queued = queueControlCommand(CONTROL_AC, unit, kOnOffUpdateMask, newPower, commandId);
 
   } else {
 
@@ -825,7 +1653,241 @@ void processACControl(AsyncWebServerRequest *request, String setting, String val
 
   }
 
-  if (changed) notifyObservers();
+  if (!queued) {
+    if (request) request->send(503, "application/json", "{\"success\":false,\"error\":\"Command queue full\",\"id\":" + String(commandId) + ",\"unit\":" + String(unit) + "}");
+    return;
+  }
+  String valueJson = setting == "temp" ? value : "\"" + value + "\"";
+  if (request) request->send(200, "application/json", "{\"success\":true,\"setting\":\"" + setting + "\",\"value\":" + valueJson + ",\"id\":" + String(commandId) + ",\"unit\":" + String(unit) + ",\"queued\":true}");
+}
+
+// ?unit=n picks the indoor unit, the first one by default
+FujitsuAC *ACUnitFromRequest(AsyncWebServerRequest *request) {
+  int unit = request->hasParam("unit") ? request->getParam("unit")->value().toInt() : 0;
+  if (unit < 0 || unit >= acUnitCount) return nullptr;
+  return &acUnits[unit];
+}
+
+void processACCaptureControl(AsyncWebServerRequest *request, String action) {
+  FujitsuAC *ac = ACUnitFromRequest(request);
+  if (!ac) {
+    request->send(404, "application/json", "{\"success\":false,\"error\":\"Unknown AC unit\"}");
+    return;
+  }
+  FujitsuCapture &capture = ac->capture;
+
+  if (action == "start") {
+    if (!capture.start(kCaptureUserHttp)) {
+      request->send(500, "application/json", "{\"success\":false,\"error\":\"Not enough memory for the capture buffer\"}");
+      return;
+    }
+  } else if (action == "stop") {
+    // Only our own hold on the ring, the serial trace reads it too
+    capture.stop(kCaptureUserHttp);
+  } else if (action == "clear") {
+    capture.clear();
+  }
+  request->send(200, "application/json", "{\"success\":true,\"action\":\"" + action + "\",\"entries\":" + String(capture.getCount()) +
+                ",\"recording\":" + (capture.isEnabled() ? "true" : "false") + ",\"trace\":" + (capture.isUsedBy(kCaptureUserTrace) ? "true" : "false") + "}");
+}
+
+// Serial trace of every unit's bus traffic, remembered across restarts
+void processACTraceControl(AsyncWebServerRequest *request, String action) {
+  if (action != "start" && action != "stop") {
+    request->send(400, "application/json", "{\"success\":false,\"error\":\"Unknown action\"}");
+    return;
+  }
+
+  bool enable = action == "start";
+  if (enable) {
+    if (!acTracePrinter.start()) {
+      request->send(500, "application/json", "{\"success\":false,\"error\":\"Not enough memory for the trace\"}");
+      return;
+    }
+  } else {
+    acTracePrinter.stop();
+  }
+
+  preferences.begin("pin-config", false);
+  preferences.putBool(PREF_KEY_AC_TRACE, enable);
+  preferences.end();
+
+  request->send(200, "application/json", "{\"success\":true,\"action\":\"" + action + "\"}");
+}
+
+// Streams the capture ring as it is right now, in the FJCP binary format (see FujitsuCapture.h).
+// Entries are copied out a chunk at a time, recording carries on while the export runs
+void processACCaptureExport(AsyncWebServerRequest *request) {
+  FujitsuAC *ac = ACUnitFromRequest(request);
+  if (!ac) {
+    request->send(404, "application/json", "{\"success\":false,\"error\":\"Unknown AC unit\"}");
+    return;
+  }
+  FujitsuCapture *capture = &ac->capture;
+
+  struct ExportCursor {
+    uint32_t next;
+    uint32_t end;
+    bool headerSent;
+  };
+  std::shared_ptr<ExportCursor> cursor = std::make_shared<ExportCursor>();
+  cursor->next = capture->getOldest();
+  cursor->end = capture->getWritten();
+  cursor->headerSent = false;
+
+  AsyncWebServerResponse *response = request->beginChunkedResponse("application/octet-stream",
+    [cursor, capture](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+      size_t len = 0;
+      if (!cursor->headerSent) {
+        if (maxLen < kCaptureHeaderSize) return RESPONSE_TRY_AGAIN;
+        capture->writeHeader(buffer, cursor->next);
+        cursor->headerSent = true;
+        len = kCaptureHeaderSize;
+      }
+
+      // anything overwritten since the export started is skipped, the entry sequence shows the gap
+      uint32_t oldest = capture->getOldest();
+      if ((int32_t)(oldest - cursor->next) > 0) cursor->next = oldest;
+
+      CaptureEntry entry;
+      while (cursor->next != cursor->end && maxLen - len >= sizeof(CaptureEntry)) {
+        if (capture->read(cursor->next, &entry)) {
+          memcpy(buffer + len, &entry, sizeof(CaptureEntry));
+          len += sizeof(CaptureEntry);
+        }
+        cursor->next++;
+      }
+      return len;
+    });
+  response->addHeader("Content-Disposition", "attachment; filename=\"fujitsu_capture.fjcp\"");
+  request->send(response);
+}
+
+#ifdef FUJITSU_SIM_BUS
+// Line faults and benchmark of the simulated indoor unit, any parameter left out is unchanged
+void processACSimRoute(AsyncWebServerRequest *request) {
+  if (request->hasParam("latencyUs")) simBus.setLatency(request->getParam("latencyUs")->value().toInt());
+  if (request->hasParam("byteLoss")) simBus.setByteLoss(constrain(request->getParam("byteLoss")->value().toInt(), 0, 1000));
+  if (request->hasParam("parityErrors")) simBus.setParityErrors(constrain(request->getParam("parityErrors")->value().toInt(), 0, 1000));
+  if (request->hasParam("wallController")) simBus.setWallController(request->getParam("wallController")->value() == "1");
+  if (request->hasParam("benchmarkMs")) simBus.setBenchmarkInterval(request->getParam("benchmarkMs")->value().toInt());
+  request->send(200, "application/json", "{\"success\":true}");
+}
+#endif
+
+// Results of the writes made under one correlation id, a command can write more than one field.
+// pending is set while some of its fields have not reported yet
+void processACResultRoute(AsyncWebServerRequest *request, String idStr) {
+  uint32_t commandId = idStr.toInt();
+  ACWriteRecord matches[AC_WRITE_RESULT_HISTORY];
+  int matchCount = 0;
+  bool pending = false;
+
+  portENTER_CRITICAL(&acWriteResultsMux);
+  if (commandId != 0) {
+    // Oldest first
+    for (int i = 0; i < acWriteResultCount; i++) {
+      ACWriteRecord &record = acWriteResults[(acWriteResultNext - acWriteResultCount + i + AC_WRITE_RESULT_HISTORY) % AC_WRITE_RESULT_HISTORY];
+      if (record.result.commandId == commandId) matches[matchCount++] = record;
+    }
+    pending = findOutstandingACCommand(commandId) != nullptr;
+  }
+  portEXIT_CRITICAL(&acWriteResultsMux);
+
+  if (matchCount == 0 && !pending) {
+    // Never issued, or its results have been pushed out of the history
+    request->send(404, "application/json", "{\"success\":false,\"error\":\"Unknown command id\",\"id\":" + String(commandId) + "}");
+    return;
+  }
+
+  JsonDocument doc;
+  doc["id"] = commandId;
+  JsonArray results = doc["results"].to<JsonArray>();
+  for (int i = 0; i < matchCount; i++) {
+    addACWriteResult(results.add<JsonObject>(), matches[i].unit, matches[i].result);
+  }
+  doc["pending"] = pending;
+
+  String payload;
+  serializeJson(doc, payload);
+  request->send(200, "application/json", payload);
+}
+
+// Times a route handler into its own profiler stage
+ArRequestHandlerFunction profiledRoute(const char *name, ArRequestHandlerFunction handler) {
+  int stage = profiler.addStage(name);
+  return [stage, handler](AsyncWebServerRequest *request) {
+    ProfileSpan span(profiler, stage);
+    handler(request);
+  };
+}
+
+ArBodyHandlerFunction profiledBody(const char *name, ArBodyHandlerFunction handler) {
+  int stage = profiler.addStage(name);
+  return [stage, handler](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total) {
+    ProfileSpan span(profiler, stage);
+    handler(request, data, len, index, total);
+  };
+}
+
+void processProfileRoute(AsyncWebServerRequest *request) {
+  JsonDocument doc;
+  doc["cpu_freq"] = ESP.getCpuFreqMHz();
+  JsonArray limits = doc["bucket_limits_us"].to<JsonArray>();
+  for (int i = 0; i < kProfileBuckets - 1; i++) limits.add(kProfileBucketLimitsMicros[i]);
+
+  JsonArray stages = doc["stages"].to<JsonArray>();
+  for (byte i = 0; i < profiler.getStageCount(); i++) {
+    ProfileStage stage = profiler.getStage(i);
+    JsonObject s = stages.add<JsonObject>();
+    s["name"] = stage.name;
+    s["count"] = stage.count;
+    s["migrated"] = stage.migrated;
+    s["avg_us"] = profiler.getAverageMicros(i);
+    s["p99_us"] = profiler.getP99Micros(i);
+    s["max_us"] = profiler.getMaxMicros(i);
+    JsonArray buckets = s["buckets"].to<JsonArray>();
+    for (int b = 0; b < kProfileBuckets; b++) buckets.add(stage.buckets[b]);
+  }
+
+  // Free stack at its lowest, in bytes
+  JsonObject stacks = doc["stack_free_min"].to<JsonObject>();
+  for (byte i = 0; i < profiler.getTaskCount(); i++) {
+    int stackFree = profiler.getStackHighWaterMark(i);
+    if (stackFree >= 0) stacks[profiler.getTaskName(i)] = stackFree;
+  }
+
+  String payload;
+  serializeJson(doc, payload);
+  request->send(200, "application/json", payload);
+}
+
+void processProfileReset(AsyncWebServerRequest *request) {
+  profiler.reset();
+  request->send(200, "application/json", "{\"success\":true}");
+}
+
+void processACErrorsRoute(AsyncWebServerRequest *request) {
+  FujitsuAC *ac = ACUnitFromRequest(request);
+  if (!ac) {
+    request->send(404, "application/json", "{\"success\":false,\"error\":\"Unknown AC unit\"}");
+    return;
+  }
+
+  JsonDocument doc;
+  doc["unit"] = ac - acUnits;
+  uint32_t count = ac->getErrorFrames();
+  doc["count"] = count;
+  JsonArray errors = doc["errors"].to<JsonArray>();
+  // Newest first, anything overwritten while we copy is left out
+  for (uint32_t seq = count; seq > ac->getOldestError(); seq--) {
+    ACErrorRecord record;
+    if (ac->readError(seq - 1, &record)) addACError(errors.add<JsonObject>(), record);
+  }
+
+  String payload;
+  serializeJson(doc, payload);
+  request->send(200, "application/json", payload);
 }
 
 void process404(AsyncWebServerRequest *request) {
@@ -883,6 +1945,7 @@ void startAPMode() {
 
   dnsServer.setErrorReplyCode(DNSReplyCode::NoError);
   dnsServer.start(DNS_PORT, "*", apIP);
+  loopScheduler.setEnabled(dnsLoopTask, true);
 
   server.on("/", HTTP_GET, [](AsyncWebServerRequest *request){
     request->send(200, "text/html", htmlWiFiConfigCaptivePortal);
@@ -940,9 +2003,13 @@ void mqttCallback(char* topic, byte* payload, unsigned int length) {
         payloadBuffer += (char)payload[i];
     }
     String topicStr(topic);
-    Serial.println("Processing event on topic '" + topicStr + "' with payload: " + payloadBuffer);
 
-    if (topicStr == String(mqttBaseTopic) + String("/status")) return; // Ignore our own updates to the world
+    // Ignore our own updates to the world, we hear everything we publish under <base>/#
+    if (topicStr == String(mqttBaseTopic) + String("/status")) return;
+    if (topicStr == String(mqttBaseTopic) + String("/ac/result")) return;
+    if (topicStr.startsWith(String(mqttBaseTopic) + String("/ac/")) && topicStr.indexOf("/state/") > 0) return;
+
+    Serial.println("Processing event on topic '" + topicStr + "' with payload: " + payloadBuffer);
 
     // For debug puposes share processing mqtt message with ws observers
     // JsonDocument docWS;
@@ -961,13 +2028,24 @@ void mqttCallback(char* topic, byte* payload, unsigned int length) {
       return;
     }
 
-    if (topicStr == String(mqttBaseTopic) + String("/ac/set")) {
+    for (uint8_t unit = 0; unit < acUnitCount; unit++) {
+        if (topicStr != String(mqttBaseTopic) + ACTopic(unit) + String("/set")) continue;
+
         String setting = doc["setting"];
         String value = doc["value"];
+        // Optional, echoed back on ~/ac/result. Ids with the top bit set are ours
+        uint32_t commandId = 0;
+        if (!doc["id"].isNull()) {
+          commandId = doc["id"].is<uint32_t>() ? doc["id"].as<uint32_t>() : 0;
+          if (commandId == 0 || commandId > AC_CLIENT_COMMAND_ID_MAX) {
+            Serial.println("AC command id must be 1.." + String(AC_CLIENT_COMMAND_ID_MAX) + ", command ignored");
+            continue;
+          }
+        }
 
         // Handle the case where Home Assistant sends a mode command
         // This ensures proper handling of the combined power/mode setting
-        processACControl(nullptr, setting, value);
+        processACControl(nullptr, setting, value, commandId, unit);
     }
 
     if (topicStr == String(mqttBaseTopic) + String("/pin/set")) {
@@ -1017,6 +2095,14 @@ void reconnectMQTT() {
                 publishHomeAssistantDiscovery();
                 haDiscoveryPublished = true;
             }
+
+            // Bring the retained AC state topics up to date
+            // Catch up from the latest snapshot, whatever changed while we were offline
+            for (uint8_t unit = 0; unit < acUnitCount; unit++) {
+              publishACStateTopics(unit, notifyACFields);
+              publishACErrorState(unit);
+            }
+            notifyMqttTopics();
         } else {
             Serial.print("failed, rc=");
             Serial.print(mqttClient.state());
@@ -1048,34 +2134,33 @@ void publishHomeAssistantDiscovery() {
     String deviceJson;
     serializeJson(deviceDoc, deviceJson);
 
-    // Climate entity discovery
-    {
+    // Climate entity discovery, one per AC unit
+    for (uint8_t unit = 0; unit < acUnitCount; unit++) {
+        String suffix = unit == 0 ? String() : String("_") + unit;
+        String acTopic = String("~") + ACTopic(unit);
+
         JsonDocument discoveryDoc;
-        discoveryDoc["name"] = "AC";
-        discoveryDoc["unique_id"] = deviceId + "_climate";
+        discoveryDoc["name"] = unit == 0 ? String("AC") : String("AC ") + (unit + 1);
+        discoveryDoc["unique_id"] = deviceId + "_climate" + suffix;
         discoveryDoc["device"] = deviceDoc;
         discoveryDoc["icon"] = "mdi:air-conditioner";
 
         // Define MQTT topics
         discoveryDoc["~"] = mqttBaseTopic;
-        discoveryDoc["current_temperature_topic"] = "~/status";
-        discoveryDoc["current_temperature_template"] = "{{ value_json.ac.currentTemp }}";
+        discoveryDoc["current_temperature_topic"] = acTopic + "/state/current_temp";
 
         // Updated mode command to handle combined power/mode control
-        discoveryDoc["mode_command_topic"] = "~/ac/set";
+        discoveryDoc["mode_command_topic"] = acTopic + "/set";
         discoveryDoc["mode_command_template"] = "{\"setting\":\"mode\",\"value\":\"{{ value }}\"}";
-        discoveryDoc["mode_state_topic"] = "~/status";
-        discoveryDoc["mode_state_template"] = "{% if value_json.ac.power == false %}off{% else %}{% if value_json.ac.mode == 'Fan' %}fan_only{% else %}{{ value_json.ac.mode | lower }}{% endif %}{% endif %}";
+        discoveryDoc["mode_state_topic"] = acTopic + "/state/mode";
 
-        discoveryDoc["temperature_command_topic"] = "~/ac/set";
+        discoveryDoc["temperature_command_topic"] = acTopic + "/set";
         discoveryDoc["temperature_command_template"] = "{\"setting\":\"temp\",\"value\":{{ value }}}";
-        discoveryDoc["temperature_state_topic"] = "~/status";
-        discoveryDoc["temperature_state_template"] = "{{ value_json.ac.temp }}";
+        discoveryDoc["temperature_state_topic"] = acTopic + "/state/temp";
 
-        discoveryDoc["fan_mode_command_topic"] = "~/ac/set";
+        discoveryDoc["fan_mode_command_topic"] = acTopic + "/set";
         discoveryDoc["fan_mode_command_template"] = "{\"setting\":\"fan\",\"value\":\"{{ value }}\"}";
-        discoveryDoc["fan_mode_state_topic"] = "~/status";
-        discoveryDoc["fan_mode_state_template"] = "{{ value_json.ac.fanMode | lower }}";
+        discoveryDoc["fan_mode_state_topic"] = acTopic + "/state/fan_mode";
 
         // Remove the separate power command topic as it's now integrated with mode
         // discoveryDoc["power_command_topic"] = "~/ac/set";
@@ -1105,7 +2190,7 @@ void publishHomeAssistantDiscovery() {
         String discoveryJson;
         serializeJson(discoveryDoc, discoveryJson);
 
-        String discoveryTopic = String(mqttDiscoveryPrefix) + "/climate/" + deviceId + "/config";
+        String discoveryTopic = String(mqttDiscoveryPrefix) + "/climate/" + deviceId + (unit == 0 ? String() : String("_ac") + unit) + "/config";
         mqttClient.publish(discoveryTopic.c_str(), discoveryJson.c_str(), true);
         Serial.println("Published climate discovery to: " + discoveryTopic);
     }
@@ -1215,18 +2300,19 @@ void publishHomeAssistantDiscovery() {
         Serial.println("Published buzzer volume discovery to: " + discoveryTopic);
     }
 
-    // Publish current temperature sensor
-    {
+    // Publish current temperature sensor for each AC unit
+    for (uint8_t unit = 0; unit < acUnitCount; unit++) {
+        String suffix = unit == 0 ? String() : String("_") + unit;
+
         JsonDocument discoveryDoc;
-        discoveryDoc["name"] = "Ambient Temperature";
-        discoveryDoc["unique_id"] = deviceId + "_ambient_temp";
+        discoveryDoc["name"] = unit == 0 ? String("Ambient Temperature") : String("Ambient Temperature ") + (unit + 1);
+        discoveryDoc["unique_id"] = deviceId + "_ambient_temp" + suffix;
         discoveryDoc["device"] = deviceDoc;
         discoveryDoc["icon"] = "mdi:thermometer";
 
         // Define MQTT topics
         discoveryDoc["~"] = mqttBaseTopic;
-        discoveryDoc["state_topic"] = "~/status";
-        discoveryDoc["value_template"] = "{{ value_json.ac.currentTemp }}";
+        discoveryDoc["state_topic"] = String("~") + ACTopic(unit) + "/state/current_temp";
         discoveryDoc["unit_of_measurement"] = "°C";
         discoveryDoc["device_class"] = "temperature";
         discoveryDoc["state_class"] = "measurement";
@@ -1234,14 +2320,166 @@ void publishHomeAssistantDiscovery() {
         String discoveryJson;
         serializeJson(discoveryDoc, discoveryJson);
 
-        String discoveryTopic = String(mqttDiscoveryPrefix) + "/sensor/" + deviceId + "_ambient_temp/config";
+        String discoveryTopic = String(mqttDiscoveryPrefix) + "/sensor/" + deviceId + "_ambient_temp" + suffix + "/config";
         mqttClient.publish(discoveryTopic.c_str(), discoveryJson.c_str(), true);
         Serial.println("Published ambient temperature sensor discovery to: " + discoveryTopic);
     }
 
+    // Publish the last error frame of each AC unit
+    for (uint8_t unit = 0; unit < acUnitCount; unit++) {
+        String suffix = unit == 0 ? String() : String("_") + unit;
+
+        JsonDocument discoveryDoc;
+        discoveryDoc["name"] = unit == 0 ? String("AC Error") : String("AC Error ") + (unit + 1);
+        discoveryDoc["unique_id"] = deviceId + "_ac_error" + suffix;
+        discoveryDoc["device"] = deviceDoc;
+        discoveryDoc["icon"] = "mdi:alert-circle-outline";
+        discoveryDoc["entity_category"] = "diagnostic";
+
+        // Define MQTT topics
+        discoveryDoc["~"] = mqttBaseTopic;
+        discoveryDoc["state_topic"] = String("~") + ACTopic(unit) + "/state/error";
+        discoveryDoc["value_template"] = "{{ value_json.code if value_json.code is not none else 'none' }}";
+        discoveryDoc["json_attributes_topic"] = String("~") + ACTopic(unit) + "/state/error";
+
+        String discoveryJson;
+        serializeJson(discoveryDoc, discoveryJson);
+
+        String discoveryTopic = String(mqttDiscoveryPrefix) + "/sensor/" + deviceId + "_ac_error" + suffix + "/config";
+        mqttClient.publish(discoveryTopic.c_str(), discoveryJson.c_str(), true);
+        Serial.println("Published AC error sensor discovery to: " + discoveryTopic);
+    }
+
     Serial.println("Home Assistant MQTT discovery information published successfully");
 }
 
+// Pins, LEDs and the AC buses come up before the network and keep running without it, so the
+// indoor units are answered through WiFi outages and even in AP mode
+void setupHardware() {
+  // Load pin configurations from preferences
+  preferences.begin("pin-config", true);
+  acUnitCount = constrain(preferences.getUChar(PREF_KEY_AC_UNITS, acUnitCount), 1, MAX_AC_UNITS);
+  for (int i = 0; i < acUnitCount; i++) {
+    acRxPins[i] = preferences.getUChar(ACPrefKey(PREF_KEY_AC_RX_PIN, i).c_str(), acRxPins[i]);
+    acTxPins[i] = preferences.getUChar(ACPrefKey(PREF_KEY_AC_TX_PIN, i).c_str(), acTxPins[i]);
+    acReplyDelayUs[i] = preferences.getUInt(ACPrefKey(PREF_KEY_AC_REPLY_DELAY, i).c_str(), acReplyDelayUs[i]);
+    acListenOnly[i] = preferences.getBool(ACPrefKey(PREF_KEY_AC_LISTEN_ONLY, i).c_str(), acListenOnly[i]);
+    acConfirmFrames[i] = preferences.getUChar(ACPrefKey(PREF_KEY_AC_CONFIRM_FRAMES, i).c_str(), acConfirmFrames[i]);
+    acRoles[i] = preferences.getUChar(ACPrefKey(PREF_KEY_AC_ROLE, i).c_str(), acRoles[i]);
+  }
+  bool acTrace = preferences.getBool(PREF_KEY_AC_TRACE, false);
+  acCoalesceMillis = preferences.getUShort(PREF_KEY_AC_COALESCE, acCoalesceMillis);
+
+  // Load output pins
+  String outputPinsStr = preferences.getString(PREF_KEY_OUTPUT_PINS, "");
+  if (outputPinsStr.length() > 0) {
+    outputPinCount = 0;
+    int startPos = 0;
+    int commaPos = outputPinsStr.indexOf(',');
+    while (commaPos >= 0 && outputPinCount < MAX_OUTPUT_PINS) {
+      outputPins[outputPinCount++] = outputPinsStr.substring(startPos, commaPos).toInt();
+      startPos = commaPos + 1;
+      commaPos = outputPinsStr.indexOf(',', startPos);
+    }
+    // Add the last pin after the last comma (or the only pin if no commas)
+    if (startPos < outputPinsStr.length() && outputPinCount < MAX_OUTPUT_PINS) {
+      outputPins[outputPinCount++] = outputPinsStr.substring(startPos).toInt();
+    }
+  }
+
+  // Load input pins
+  String inputPinsStr = preferences.getString(PREF_KEY_INPUT_PINS, "");
+  if (inputPinsStr.length() > 0) {
+    inputPinCount = 0;
+    int startPos = 0;
+    int commaPos = inputPinsStr.indexOf(',');
+    while (commaPos >= 0 && inputPinCount < MAX_INPUT_PINS) {
+      inputPins[inputPinCount++] = inputPinsStr.substring(startPos, commaPos).toInt();
+      startPos = commaPos + 1;
+      commaPos = inputPinsStr.indexOf(',', startPos);
+    }
+    // Add the last pin after the last comma (or the only pin if no commas)
+    if (startPos < inputPinsStr.length() && inputPinCount < MAX_INPUT_PINS) {
+      inputPins[inputPinCount++] = inputPinsStr.substring(startPos).toInt();
+    }
+  }
+  preferences.end();
+
+  // Load zone configurations
+  preferences.begin("zone-config", true);
+  String zonesStr = preferences.getString(PREF_KEY_ZONES, "");
+  if (zonesStr.length() > 0) {
+    JsonDocument zonesDoc;
+    DeserializationError error = deserializeJson(zonesDoc, zonesStr);
+    if (!error) {
+      JsonArray zonesArray = zonesDoc.as<JsonArray>();
+      zoneCount = min((size_t)MAX_ZONES, zonesArray.size());
+      for (int i = 0; i < zoneCount; i++) {
+        zones[i].id = zonesArray[i]["id"].as<String>();
+        zones[i].inputPin = zonesArray[i]["inputPin"];
+        zones[i].outputPin = zonesArray[i]["outputPin"];
+      }
+      Serial.printf("Loaded %d zones from preferences\n", zoneCount);
+    } else {
+      Serial.println("Error parsing zones JSON from preferences");
+    }
+  }
+  preferences.end();
+
+  Serial.println("Loaded pin configuration:");
+  for (int i = 0; i < acUnitCount; i++) {
+    Serial.printf("AC %d RX Pin: %d, AC TX Pin: %d, AC Reply Delay: %luus, Role: %s%s\n", i, acRxPins[i], acTxPins[i], (unsigned long)acReplyDelayUs[i], ACRoleToString(acRoles[i]).c_str(), acListenOnly[i] ? ", listen-only" : "");
+  }
+  Serial.print("Output Pins: ");
+  for (int i = 0; i < outputPinCount; i++) {
+    Serial.printf("%d ", outputPins[i]);
+  }
+  Serial.println();
+  Serial.print("Input Pins: ");
+  for (int i = 0; i < inputPinCount; i++) {
+    Serial.printf("%d ", inputPins[i]);
+  }
+  Serial.println();
+
+  for (int i = 0; i < acUnitCount; i++) {
+    acUnits[i].setListenOnly(acListenOnly[i]);
+    acUnits[i].setConfirmFrames(acConfirmFrames[i]);
+    acUnits[i].setRoleDetection(acRoles[i] == AC_ROLE_AUTO);
+  }
+#ifdef FUJITSU_SIM_BUS
+  // no AC on this board, a simulated indoor unit stands in for the bus, always as secondary
+  acUnitCount = 1;
+  acUnits[0].setRoleDetection(false);
+  acUnits[0].connect(&simBus, true);
+#else
+  for (int i = 0; i < acUnitCount; i++) {
+    acUnits[i].connect(AC_UNIT_UARTS[i], acRoles[i] != AC_ROLE_PRIMARY, acRxPins[i], acTxPins[i]);
+  }
+#endif
+  for (int i = 0; i < acUnitCount; i++) {
+    acUnits[i].setReplyDelay(acReplyDelayUs[i]);
+    acBusScheduler.addUnit(&acUnits[i]);
+    acTracePrinter.addUnit(&acUnits[i]);
+  }
+  acBusScheduler.start();
+  if (acTrace) acTracePrinter.start();
+#ifdef FUJITSU_SIM_BUS
+  simBus.start(&acUnits[0], true);
+#endif
+
+  FastLED.addLeds<WS2812, LEDS_PIN, GRB>(leds, LEDS_COUNT);
+  FastLED.setBrightness(colourLEDBrightness);
+
+  for (int i = 0; i < ARRAY_SIZE(outputPins); i++) {
+    initOutputPin(outputPins[i]);
+    outputStates[i] = false; // Ensure initial state is known
+  }
+  for (int i = 0; i < ARRAY_SIZE(inputPins); i++) {
+    initInputPin(inputPins[i]);
+    inputStates[i] = digitalRead(inputPins[i]) == HIGH;
+  }
+}
+
 void setup() {
 
   Serial.begin(115200);
@@ -1254,86 +2492,13 @@ void setup() {
 
   player.setVolume(INITIAL_BUZZER_VOLUME);
 
+  setupHardware();
+  setupLoopTasks();
+
   if (connectToWiFi()) {
     // --- STA Mode: WiFi Connected - Initialize full functionality ---
     Serial.println("STA Mode: Initializing full device functionality...");
 
-    // Load pin configurations from preferences
-    preferences.begin("pin-config", true);
-    acRxPin = preferences.getUChar(PREF_KEY_AC_RX_PIN, acRxPin);
-    acTxPin = preferences.getUChar(PREF_KEY_AC_TX_PIN, acTxPin);
-
-    // Load output pins
-    String outputPinsStr = preferences.getString(PREF_KEY_OUTPUT_PINS, "");
-    if (outputPinsStr.length() > 0) {
-      outputPinCount = 0;
-      int startPos = 0;
-      int commaPos = outputPinsStr.indexOf(',');
-      while (commaPos >= 0 && outputPinCount < MAX_OUTPUT_PINS) {
-        outputPins[outputPinCount++] = outputPinsStr.substring(startPos, commaPos).toInt();
-        startPos = commaPos + 1;
-        commaPos = outputPinsStr.indexOf(',', startPos);
-      }
-      // Add the last pin after the last comma (or the only pin if no commas)
-      if (startPos < outputPinsStr.length() && outputPinCount < MAX_OUTPUT_PINS) {
-        outputPins[outputPinCount++] = outputPinsStr.substring(startPos).toInt();
-      }
-    }
-
-    // Load input pins
-    String inputPinsStr = preferences.getString(PREF_KEY_INPUT_PINS, "");
-    if (inputPinsStr.length() > 0) {
-      inputPinCount = 0;
-      int startPos = 0;
-      int commaPos = inputPinsStr.indexOf(',');
-      while (commaPos >= 0 && inputPinCount < MAX_INPUT_PINS) {
-        inputPins[inputPinCount++] = inputPinsStr.substring(startPos, commaPos).toInt();
-        startPos = commaPos + 1;
-        commaPos = inputPinsStr.indexOf(',', startPos);
-      }
-      // Add the last pin after the last comma (or the only pin if no commas)
-      if (startPos < inputPinsStr.length() && inputPinCount < MAX_INPUT_PINS) {
-        inputPins[inputPinCount++] = inputPinsStr.substring(startPos).toInt();
-      }
-    }
-    preferences.end();
-
-    // Load zone configurations
-    preferences.begin("zone-config", true);
-    String zonesStr = preferences.getString(PREF_KEY_ZONES, "");
-    if (zonesStr.length() > 0) {
-      JsonDocument zonesDoc;
-      DeserializationError error = deserializeJson(zonesDoc, zonesStr);
-      if (!error) {
-        JsonArray zonesArray = zonesDoc.as<JsonArray>();
-        zoneCount = min((size_t)MAX_ZONES, zonesArray.size());
-        for (int i = 0; i < zoneCount; i++) {
-          zones[i].id = zonesArray[i]["id"].as<String>();
-          zones[i].inputPin = zonesArray[i]["inputPin"];
-          zones[i].outputPin = zonesArray[i]["outputPin"];
-        }
-        Serial.printf("Loaded %d zones from preferences\n", zoneCount);
-      } else {
-        Serial.println("Error parsing zones JSON from preferences");
-      }
-    }
-    preferences.end();
-
-    Serial.println("Loaded pin configuration:");
-    Serial.printf("AC RX Pin: %d, AC TX Pin: %d\n", acRxPin, acTxPin);
-    Serial.print("Output Pins: ");
-    for (int i = 0; i < outputPinCount; i++) {
-      Serial.printf("%d ", outputPins[i]);
-    }
-    Serial.println();
-    Serial.print("Input Pins: ");
-    for (int i = 0; i < inputPinCount; i++) {
-      Serial.printf("%d ", inputPins[i]);
-    }
-    Serial.println();
-
-    fujitsu.connect(&Serial2, true, acRxPin, acTxPin);
-
     // Load MQTT configuration
     preferences.begin("mqtt-config", true);
     preferences.getString(PREF_KEY_MQTT_BROKER, mqttBroker, sizeof(mqttBroker));
@@ -1360,18 +2525,6 @@ void setup() {
         mqttClient.setBufferSize(MQTT_MAX_PACKET_SIZE);
     }
 
-    FastLED.addLeds<WS2812, LEDS_PIN, GRB>(leds, LEDS_COUNT);
-    FastLED.setBrightness(colourLEDBrightness);
-
-    for (int i = 0; i < ARRAY_SIZE(outputPins); i++) {
-      initOutputPin(outputPins[i]);
-      outputStates[i] = false; // Ensure initial state is known
-    }
-    for (int i = 0; i < ARRAY_SIZE(inputPins); i++) {
-      initInputPin(inputPins[i]);
-      inputStates[i] = digitalRead(inputPins[i]) == HIGH;
-    }
-
     // Initial status led blink sequence
     for (int i = 0; i < 33; i++) {
       delay(75);
@@ -1394,47 +2547,69 @@ void setup() {
     }
 
     // Set up existing server routes for STA mode
-    server.on("/", HTTP_GET, [](AsyncWebServerRequest *request){ processRootRoute(request); });
-    server.on("/api/status", HTTP_GET, [](AsyncWebServerRequest *request){ processApiStatusRoute(request); });
-    server.on("/api/mqtt/save", HTTP_POST, [](AsyncWebServerRequest *request){ processSaveMqttConfigRoute(request); });
-    server.on("/api/mqtt/publish_discovery", HTTP_POST, [](AsyncWebServerRequest *request){ processPublishDiscoveryRoute(request); });
+    server.on("/", HTTP_GET, profiledRoute("http_root", [](AsyncWebServerRequest *request){ processRootRoute(request); }));
+    server.on("/api/status", HTTP_GET, profiledRoute("http_status", [](AsyncWebServerRequest *request){ processApiStatusRoute(request); }));
+    server.on("/api/mqtt/save", HTTP_POST, profiledRoute("http_mqtt_save", [](AsyncWebServerRequest *request){ processSaveMqttConfigRoute(request); }));
+    server.on("/api/mqtt/publish_discovery", HTTP_POST, profiledRoute("http_mqtt_discovery", [](AsyncWebServerRequest *request){ processPublishDiscoveryRoute(request); }));
     server.on("^\\/api\\/colourled\\/(state|brightness)\\/([0-9a-zA-Z]+)$", HTTP_POST,
-      [](AsyncWebServerRequest *request) { processColourLEDControl(request, request->pathArg(0), request->pathArg(1)); });
+      profiledRoute("http_colourled", [](AsyncWebServerRequest *request) { processColourLEDControl(request, request->pathArg(0), request->pathArg(1)); }));
     server.on("^\\/api\\/buzzer\\/(volume|test)\\/([0-9]+)?$", HTTP_POST,
-      [](AsyncWebServerRequest *request) { processBuzzerControl(request, request->pathArg(0), request->pathArg(1)); });
+      profiledRoute("http_buzzer", [](AsyncWebServerRequest *request) { processBuzzerControl(request, request->pathArg(0), request->pathArg(1)); }));
     server.on("^\\/api\\/out\\/([0-9]+)\\/(0|1|press)$", HTTP_POST,
-      [](AsyncWebServerRequest *request) { processOutputPinControl(request, request->pathArg(0), request->pathArg(1)); });
+      profiledRoute("http_out", [](AsyncWebServerRequest *request) { processOutputPinControl(request, request->pathArg(0), request->pathArg(1)); }));
     server.on("^\\/api\\/ac\\/(temp|mode|fan|power)\\/([0-9]+|dry|cool|heat|auto|quiet|low|medium|high|on|off|0|1)$", HTTP_POST,
-      [](AsyncWebServerRequest *request) { processACControl(request, request->pathArg(0), request->pathArg(1)); });
+      profiledRoute("http_ac", [](AsyncWebServerRequest *request) { processACControl(request, request->pathArg(0), request->pathArg(1)); }));
+    server.on("^\\/api\\/ac\\/([0-9])\\/(temp|mode|fan|power)\\/([0-9]+|dry|cool|heat|auto|quiet|low|medium|high|on|off|0|1)$", HTTP_POST,
+      profiledRoute("http_ac_unit", [](AsyncWebServerRequest *request) {
+        uint8_t unit = request->pathArg(0).toInt();
+        if (unit >= acUnitCount) {
+          request->send(404, "application/json", "{\"success\":false,\"error\":\"Unknown AC unit\"}");
+          return;
+        }
+        processACControl(request, request->pathArg(1), request->pathArg(2), 0, unit);
+      }));
+    server.on("^\\/api\\/ac\\/capture\\/(start|stop|clear)$", HTTP_POST,
+      profiledRoute("http_ac_capture_control", [](AsyncWebServerRequest *request) { processACCaptureControl(request, request->pathArg(0)); }));
+    server.on("^\\/api\\/ac\\/result\\/([0-9]+)$", HTTP_GET,
+      profiledRoute("http_ac_result", [](AsyncWebServerRequest *request) { processACResultRoute(request, request->pathArg(0)); }));
+    server.on("^\\/api\\/ac\\/trace\\/(start|stop)$", HTTP_POST,
+      profiledRoute("http_ac_trace", [](AsyncWebServerRequest *request) { processACTraceControl(request, request->pathArg(0)); }));
+    server.on("/api/ac/errors", HTTP_GET, profiledRoute("http_ac_errors", [](AsyncWebServerRequest *request){ processACErrorsRoute(request); }));
+    server.on("/api/ac/capture", HTTP_GET, profiledRoute("http_ac_capture", [](AsyncWebServerRequest *request){ processACCaptureExport(request); }));
+#ifdef FUJITSU_SIM_BUS
+    server.on("/api/ac/sim", HTTP_POST, profiledRoute("http_ac_sim", [](AsyncWebServerRequest *request){ processACSimRoute(request); }));
+#endif
     server.on("/api/pins/save", HTTP_POST,
       [](AsyncWebServerRequest *request) {
         // For JSON requests, this handler should do nothing as the body handler will process the data
       },
       NULL,
-      [](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total) {
+      profiledBody("http_pins_save", [](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total) {
         // This handler is called when there is body data
         if (len > 0) {
           processSavePinConfigRoute(request, data, len, index, total);
         } else {
           request->send(400, "application/json", "{\"success\":false,\"error\":\"No data provided\"}");
         }
-      });
+      }));
     server.on("/api/zones/save", HTTP_POST,
       [](AsyncWebServerRequest *request) {
         // For JSON requests, this handler should do nothing as the body handler will process the data
       },
       NULL,
-      [](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total) {
+      profiledBody("http_zones_save", [](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total) {
         // This handler is called when there is body data
         if (len > 0) {
           processSaveZoneConfigRoute(request, data, len, index, total);
         } else {
           request->send(400, "application/json", "{\"success\":false,\"error\":\"No data provided\"}");
         }
-      });
+      }));
     server.on("^\\/api\\/zone\\/([^/]+)\\/(toggle|on|off|0|1)$", HTTP_POST,
-      [](AsyncWebServerRequest *request) { processZoneControl(request, request->pathArg(0), request->pathArg(1)); });
-    server.onNotFound([](AsyncWebServerRequest *request){ process404(request); });
+      profiledRoute("http_zone", [](AsyncWebServerRequest *request) { processZoneControl(request, request->pathArg(0), request->pathArg(1)); }));
+    server.on("/api/profile", HTTP_GET, [](AsyncWebServerRequest *request){ processProfileRoute(request); });
+    server.on("/api/profile/reset", HTTP_POST, [](AsyncWebServerRequest *request){ processProfileReset(request); });
+    server.onNotFound(profiledRoute("http_404", [](AsyncWebServerRequest *request){ process404(request); }));
 
     ws.onEvent(onWsEvent);
     server.addHandler(&ws);
@@ -1454,50 +2629,49 @@ void setup() {
 }
 
 void processFujitsuComms() {
-  bool frameReceived = fujitsu.waitForFrame();
+  // the buses are serviced by the driver's own task, here we only pick up published state
+  for (uint8_t unit = 0; unit < acUnitCount; unit++) {
+    FujitsuAC &ac = acUnits[unit];
 
-  if(frameReceived) {
-    fujitsuLastConnected = millis();
+    uint32_t connectionResets = ac.getConnectionResets();
+    if (connectionResets != lastACConnectionResets[unit]) {
+      Serial.printf("AC %d connection timed out, connection reset (%lu so far)\n", unit, (unsigned long)connectionResets);
+      lastACConnectionResets[unit] = connectionResets;
+      acStateInitialized[unit] = false; // Reset state initialization flag
+    }
 
-    // Check if AC settings have changed
-    ControlFrame *currentState = fujitsu.getCurrentState();
+    bool detectingRole = ac.isDetectingRole();
+    if (lastACDetectingRole[unit] && !detectingRole) {
+      Serial.printf("AC %d role detected: %s\n", unit, ac.isPrimary() ? "primary" : "secondary");
+    }
+    lastACDetectingRole[unit] = detectingRole;
 
-    if (!acStateInitialized) {
-      acStateInitialized = true;
-    } else {
-      // Compare current state with previous state
-      bool settingsChanged = false;
-
-      if (previousACState.onOff != currentState->onOff ||
-          previousACState.temperature != currentState->temperature ||
-          previousACState.acMode != currentState->acMode ||
-          previousACState.fanMode != currentState->fanMode) { // ||
-          // previousACState.economyMode != currentState->economyMode ||
-          // previousACState.swingMode != currentState->swingMode ||
-          // previousACState.swingStep != currentState->swingStep) {
-
-        settingsChanged = true;
-      }
+    WriteResult writeResult;
+    while (ac.takeWriteResult(&writeResult)) {
+      notifyACWriteResult(unit, writeResult);
+    }
 
-      // If settings changed, notify observers
-      if (settingsChanged) {
-        Serial.println("AC settings changed, notifying observers");
-        notifyObservers();
-      }
+    uint32_t errorFrames = ac.getErrorFrames();
+    if (errorFrames != lastACErrorFrames[unit]) {
+      notifyACErrors(unit, lastACErrorFrames[unit], errorFrames);
+      lastACErrorFrames[unit] = errorFrames;
     }
 
-    // Update previous state for next comparison
-    memcpy(&previousACState, currentState, sizeof(ControlFrame));
+    uint32_t stateSequence = ac.getStateSequence();
+    if (stateSequence == lastACStateSequence[unit]) continue;
+    lastACStateSequence[unit] = stateSequence;
 
-    delay(60);
-    fujitsu.sendPendingFrame();
-  }
+    // The driver tracks which fields changed since we last asked
+    byte changedFields = ac.takeChangedFields() & notifyACFields;
 
-  if (millis() - fujitsuLastConnected > fujitsuConnectionTimeout) {
-    Serial.println("Fujitsu AC connection timed out, resetting connection...");
-    fujitsu.resetConnection();
-    fujitsuLastConnected = millis();
-    acStateInitialized = false; // Reset state initialization flag
+    if (!acStateInitialized[unit]) {
+      // First state after (re)connecting, bring everyone up to date quietly
+      acStateInitialized[unit] = true;
+      postStateEvent(EVENT_AC_CHANGED, unit, notifyACFields, false);
+    } else if (changedFields) {
+      Serial.printf("AC %d settings changed, notifying observers\n", unit);
+      postStateEvent(EVENT_AC_CHANGED, unit, changedFields);
+    }
   }
 }
 
@@ -1507,63 +2681,134 @@ void processLEDColourCycle() {
     FastLED.show();
   } else {
     FastLED.setBrightness(colourLEDBrightness);
-    if (millis() - colourCycleLastProcessedMillis >= colourCycleProcessFrequency) {
-      colourCycleLastProcessedMillis += colourCycleProcessFrequency;
-      leds[0] = CHSV(colourCycleOffset, 255, 255);
-      FastLED.show();
-      colourCycleOffset = (colourCycleOffset + 7) & 255;
-    }
+    leds[0] = CHSV(colourCycleOffset, 255, 255);
+    FastLED.show();
+    colourCycleOffset = (colourCycleOffset + 7) & 255;
   }
 }
 
 void processResetButtonPress() {
-  if (millis() - resetButtonLastPressMillis >= resetButtonSamplingFrequency) {
-    resetButtonLastPressMillis += resetButtonSamplingFrequency;
-    if (digitalRead(resetButtonPin) == LOW) { // Assuming LOW means pressed for BOOT button
-      Serial.println("Reset button pressed, restarting ESP...");
-      ESP.restart();
-    }
+  if (digitalRead(resetButtonPin) == LOW) { // Assuming LOW means pressed for BOOT button
+    Serial.println("Reset button pressed, restarting ESP...");
+    ESP.restart();
   }
 }
 
 void processPinStateChanges() {
-  if (millis() - pinStateCheckLastMillis >= pinStateCheckInterval) {
-    pinStateCheckLastMillis = millis();
-    bool changed = false;
-    for (int i = 0; i < inputPinCount; i++) {
-      bool currentState = digitalRead(inputPins[i]) == HIGH;
-      if (currentState != inputStates[i]) {
-        inputStates[i] = currentState;
-        changed = true;
-      }
+  bool changed = false;
+  for (int i = 0; i < inputPinCount; i++) {
+    bool currentState = digitalRead(inputPins[i]) == HIGH;
+    if (currentState != inputStates[i]) {
+      inputStates[i] = currentState;
+      changed = true;
     }
+  }
+
+  if (changed) {
+    // Inputs follow the zone dampers, publishing is the network task's job
+    postStateEvent(EVENT_ZONE_CHANGED);
+  }
+}
 
-    if (changed) {
-      notifyObservers();
+// A level set while a press is held lands when the press is released, the release restores
+// whatever outputStates says by then
+void setOutputPin(uint8_t pin, bool level) {
+  int idx = findOutputIndexByPin(pin);
+  if (idx == -1 || outputStates[idx] == level) return;
+  outputStates[idx] = level;
+  if (outputPulses[idx].state != PULSE_HELD) digitalWrite(pin, level ? HIGH : LOW);
+  postStateEvent(EVENT_PIN_CHANGED);
+}
+
+void processIOCommands() {
+  IOCommand command;
+  while (xQueueReceive(ioCommandQueue, &command, 0) == pdTRUE) {
+    switch (command.type) {
+      case IO_PULSE: pulseOutputPin(command.pin, command.value); break;
+      case IO_SET: setOutputPin(command.pin, command.value); break;
+      case IO_TONE: playAudibleTone(command.value); break;
     }
   }
 }
 
-void loop() {
+void ioTaskLoop(void *arg) {
+  for (;;) {
+    ioScheduler.run();
+  }
+}
+
+void processDNS() {
   if (WiFi.getMode() == WIFI_AP || WiFi.getMode() == WIFI_AP_STA) { // If in any AP mode
     dnsServer.processNextRequest(); // Handle DNS for captive portal
   }
+}
 
-  // These should only run if WiFi is connected and system is in full operational STA mode
-  if (WiFi.status() == WL_CONNECTED) {
-    if (strlen(mqttBroker) > 0) {
-        reconnectMQTT();
-        if (mqttClient.connected()) {
-            mqttClient.loop();
-        }
+// These only run while WiFi is connected and the system is in full operational STA mode
+void processMQTT() {
+  if (WiFi.status() == WL_CONNECTED && strlen(mqttBroker) > 0) {
+    {
+      ProfileSpan span(profiler, mqttReconnectStage);
+      reconnectMQTT();
+    }
+    if (mqttClient.connected()) {
+      ProfileSpan span(profiler, mqttLoopStage);
+      mqttClient.loop();
     }
+  }
+}
+
+void processOTA() {
+  if (WiFi.status() == WL_CONNECTED) {
     OTA.loop();
-    processFujitsuComms();
-    processLEDColourCycle();
-    processPinStateChanges();
+  }
+}
+
+void processWSCleanup() {
+  if (WiFi.status() == WL_CONNECTED) {
     ws.cleanupClients(2); // See how this affects performance
   }
-  processResetButtonPress(); // Reset button should always be active
+}
 
-  delay(10); // Small delay to yield
+void setupLoopTasks() {
+  loopScheduler.setProfiler(&profiler);
+  ioScheduler.setProfiler(&profiler);
+  mqttReconnectStage = profiler.addStage("mqtt_reconnect");
+  mqttLoopStage = profiler.addStage("mqtt_loop");
+  wsEventStage = profiler.addStage("ws_event");
+
+  profiler.addTask("loopTask");
+  profiler.addTask("io");
+  profiler.addTask("async_tcp");
+  profiler.addTask("fujitsu_bus");
+  profiler.addTask("fujitsu_trace");
+#ifdef FUJITSU_SIM_BUS
+  profiler.addTask("fujitsu_sim");
+#endif
+
+  // DNS is only needed for the captive portal, startAPMode() turns it on
+  dnsLoopTask = loopScheduler.add("dns", processDNS, dnsProcessInterval);
+  loopScheduler.setEnabled(dnsLoopTask, false);
+
+  // Local state keeps tracking whatever the network is doing, publishers skip while offline
+  loopScheduler.add("ac_comms", processFujitsuComms, acCommsProcessInterval);
+  stateEventQueue = xQueueCreate(stateEventQueueSize, sizeof(StateEvent));
+  stateEventsJob = loopScheduler.add("state_events", processStateEvents, 0);
+  controlQueue = xQueueCreate(controlQueueSize, sizeof(ControlCommand));
+  controlCommandsJob = loopScheduler.add("commands", processControlCommands, 0);
+  loopScheduler.add("mqtt", processMQTT, mqttProcessInterval);
+  loopScheduler.add("ota", processOTA, otaProcessInterval);
+  loopScheduler.add("ws_cleanup", processWSCleanup, wsCleanupInterval);
+  loopScheduler.add("ac_bus_stats", publishACBusStats, acBusStatsInterval);
+
+  ioCommandQueue = xQueueCreate(ioCommandQueueSize, sizeof(IOCommand));
+  ioCommandJob = ioScheduler.add("io_commands", processIOCommands, 0);
+  outputPulseJob = ioScheduler.add("output_pulses", processOutputPulses, 0);
+  ioScheduler.add("pin_state", processPinStateChanges, pinStateCheckInterval);
+  ioScheduler.add("led_cycle", processLEDColourCycle, colourCycleProcessFrequency);
+  ioScheduler.add("reset_button", processResetButtonPress, resetButtonSamplingFrequency); // Reset button should always be active
+  xTaskCreatePinnedToCore(ioTaskLoop, "io", ioTaskStackSize, nullptr, ioTaskPriority, &ioTask, ioTaskCore);
+}
+
+void loop() {
+  loopScheduler.run();
 }
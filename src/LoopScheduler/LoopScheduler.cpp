@@ -0,0 +1,130 @@
+#include "LoopScheduler.h"
+
+void LoopScheduler::setProfiler(LatencyProfiler *profiler) {
+    this->profiler = profiler;
+}
+
+int LoopScheduler::add(const char *name, LoopTaskFunction function, unsigned long periodMillis) {
+    if(taskCount >= kMaxLoopTasks) {
+        return -1;
+    }
+
+    LoopTask &task = tasks[taskCount];
+    task.name = name;
+    task.function = function;
+    task.periodMillis = periodMillis;
+    task.dueMillis = millis();
+    task.enabled = true;
+    task.armed = false;
+    task.runs = 0;
+    task.maxLateMillis = 0;
+    task.maxRunMicros = 0;
+    task.profileStage = profiler != nullptr ? profiler->addStage(name) : -1;
+    return taskCount++;
+}
+
+void LoopScheduler::setEnabled(int id, bool enabled) {
+    if(id < 0 || id >= taskCount) {
+        return;
+    }
+
+    if(enabled && !tasks[id].enabled) {
+        tasks[id].dueMillis = millis();
+    }
+    tasks[id].enabled = enabled;
+}
+
+void LoopScheduler::signal(int id) {
+    if(id >= 0 && id < taskCount) {
+        signalled.fetch_or(1UL << id);
+        wake();
+    }
+}
+
+void LoopScheduler::runIn(int id, unsigned long delayMillis) {
+    if(id >= 0 && id < taskCount && tasks[id].periodMillis == 0) {
+        tasks[id].dueMillis = millis() + delayMillis;
+        tasks[id].armed = true;
+    }
+}
+
+void LoopScheduler::wake() {
+    if(loopTask != nullptr) {
+        xTaskNotifyGive(loopTask);
+    }
+}
+
+void LoopScheduler::run() {
+    if(loopTask == nullptr) {
+        loopTask = xTaskGetCurrentTaskHandle();
+    }
+
+    uint32_t pending = signalled.exchange(0);
+
+    for(int i=0;i<taskCount;i++) {
+        LoopTask &task = tasks[i];
+        unsigned long now = millis();
+        bool wanted = pending & (1UL << i);
+        if(wanted) {
+            // lateness of a signalled job counts from when we noticed the signal
+            task.dueMillis = now;
+        }
+
+        long late = (long)(now - task.dueMillis);
+        bool timed = task.periodMillis > 0 || task.armed;
+        if(!task.enabled || (!wanted && (!timed || late < 0))) {
+            continue;
+        }
+        task.armed = false;
+
+        if((unsigned long)late > task.maxLateMillis) {
+            task.maxLateMillis = late;
+        }
+
+        unsigned long started = micros();
+        if(task.profileStage >= 0) {
+            ProfileSpan span(*profiler, task.profileStage);
+            task.function();
+        } else {
+            task.function();
+        }
+        unsigned long ran = micros() - started;
+        if(ran > task.maxRunMicros) {
+            task.maxRunMicros = ran;
+        }
+        task.runs++;
+
+        // stay on the period grid, unless we fell a whole period behind
+        if(task.periodMillis > 0) {
+            task.dueMillis += task.periodMillis;
+            if((long)(millis() - task.dueMillis) >= 0) {
+                task.dueMillis = millis() + task.periodMillis;
+            }
+        }
+    }
+
+    unsigned long sleepMillis = kMaxLoopSleepMillis;
+    unsigned long now = millis();
+    for(int i=0;i<taskCount;i++) {
+        if(!tasks[i].enabled || (tasks[i].periodMillis == 0 && !tasks[i].armed)) {
+            continue;
+        }
+        long until = (long)(tasks[i].dueMillis - now);
+        if(until <= 0) {
+            return;
+        }
+        if((unsigned long)until < sleepMillis) {
+            sleepMillis = until;
+        }
+    }
+
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(sleepMillis));
+}
+
+byte LoopScheduler::getTaskCount() {
+    return taskCount;
+}
+
+const LoopTask &LoopScheduler::getTask(byte id) {
+    return tasks[id];
+}
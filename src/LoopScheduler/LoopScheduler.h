@@ -0,0 +1,70 @@
+#ifndef LOOP_SCHEDULER_H
+#define LOOP_SCHEDULER_H
+
+#include <Arduino.h>
+#include <atomic>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include "../Profiler/LatencyProfiler.h"
+
+const byte kMaxLoopTasks = 16; // fits the signalled bit mask
+
+// the loop never sleeps longer than this, a wake from another task cuts it short anyway
+const unsigned long kMaxLoopSleepMillis = 1000;
+
+typedef void (*LoopTaskFunction)();
+
+// what the scheduler knows about one periodic job, also what it reports back
+struct LoopTask {
+    const char      *name;
+    LoopTaskFunction function;
+    unsigned long   periodMillis;
+    unsigned long   dueMillis;
+    bool            enabled;
+    bool            armed;           // a signalled only job with a deadline set by runIn()
+    unsigned long   runs;
+    unsigned long   maxLateMillis;   // how long after its deadline it got to run, at worst
+    unsigned long   maxRunMicros;
+    int             profileStage;
+};
+
+// Cooperative deadline scheduler for one FreeRTOS task, the Arduino loop task or any other.
+// Each job registers a period, every pass runs whatever is due and then the task sleeps until
+// the nearest deadline. With a dozen jobs at most a scan for the earliest deadline is cheaper
+// than keeping a timer wheel.
+//
+// Jobs are run in registration order when several are due, a job that overruns only delays
+// the others, so the worst case reaction of a job is its period plus the longest run of
+// everything registered. Both are measured per job.
+class LoopScheduler
+{
+  private:
+    LoopTask        tasks[kMaxLoopTasks];
+    byte            taskCount = 0;
+    TaskHandle_t    loopTask = nullptr;
+    std::atomic<uint32_t> signalled{0}; // jobs other tasks want run on the next pass
+    LatencyProfiler *profiler = nullptr;
+
+  public:
+    // jobs added after this also get a latency histogram, named after the job
+    void setProfiler(LatencyProfiler *profiler);
+    // returns the job id, -1 when full. the first run is due right away, a period of 0 makes
+    // a job that only runs when signalled
+    int add(const char *name, LoopTaskFunction function, unsigned long periodMillis);
+    void setEnabled(int id, bool enabled);
+    // runs the job on the next pass and wakes the scheduler, safe from any task
+    void signal(int id);
+    // runs a signalled only job once after delayMillis, from the scheduler's own task only
+    void runIn(int id, unsigned long delayMillis);
+    // cuts the current sleep short, for other tasks that have something for the loop
+    void wake();
+
+    // runs everything due and sleeps until the next deadline, call it over and over from the
+    // task that owns the scheduler
+    void run();
+
+    byte getTaskCount();
+    const LoopTask &getTask(byte id);
+};
+
+#endif
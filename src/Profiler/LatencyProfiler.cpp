@@ -0,0 +1,131 @@
+#include "LatencyProfiler.h"
+
+int LatencyProfiler::addStage(const char *name) {
+    if(stageCount >= kMaxProfileStages) {
+        return -1;
+    }
+
+    memset(&stages[stageCount], 0, sizeof(ProfileStage));
+    stages[stageCount].name = name;
+    stages[stageCount].generation = generation.load();
+    return stageCount++;
+}
+
+void LatencyProfiler::addTask(const char *name) {
+    if(taskCount < kMaxProfileTasks) {
+        taskNames[taskCount++] = name;
+    }
+}
+
+void LatencyProfiler::record(int stage, uint32_t cycles) {
+    if(stage < 0 || stage >= stageCount) {
+        return;
+    }
+
+    ProfileStage &s = currentStage(stage);
+    uint32_t micros = cycles / ESP.getCpuFreqMHz();
+    byte bucket = 0;
+    while(bucket < kProfileBuckets - 1 && micros > kProfileBucketLimitsMicros[bucket]) {
+        bucket++;
+    }
+
+    s.buckets[bucket]++;
+    s.count++;
+    s.totalCycles += cycles;
+    if(cycles > s.maxCycles) {
+        s.maxCycles = cycles;
+    }
+}
+
+void LatencyProfiler::recordMigrated(int stage) {
+    if(stage >= 0 && stage < stageCount) {
+        currentStage(stage).migrated++;
+    }
+}
+
+void LatencyProfiler::reset() {
+    generation++;
+}
+
+ProfileStage &LatencyProfiler::currentStage(int stage) {
+    // only from the task recording the stage, it is the only one writing it
+    ProfileStage &s = stages[stage];
+    uint32_t current = generation.load();
+    if(s.generation != current) {
+        const char *name = s.name;
+        memset(&s, 0, sizeof(ProfileStage));
+        s.name = name;
+        s.generation = current;
+    }
+    return s;
+}
+
+byte LatencyProfiler::getStageCount() {
+    return stageCount;
+}
+
+ProfileStage LatencyProfiler::getStage(byte id) {
+    ProfileStage s = stages[id];
+    if(s.generation != generation.load()) {
+        // reset since it last recorded, its task has not cleared it yet
+        const char *name = s.name;
+        memset(&s, 0, sizeof(ProfileStage));
+        s.name = name;
+    }
+    return s;
+}
+
+uint32_t LatencyProfiler::getMaxMicros(byte id) {
+    return getStage(id).maxCycles / ESP.getCpuFreqMHz();
+}
+
+uint32_t LatencyProfiler::getAverageMicros(byte id) {
+    ProfileStage s = getStage(id);
+    return s.count ? s.totalCycles / s.count / ESP.getCpuFreqMHz() : 0;
+}
+
+uint32_t LatencyProfiler::getP99Micros(byte id) {
+    ProfileStage s = getStage(id);
+    uint32_t maxMicros = getMaxMicros(id);
+    // the first bucket that takes the cumulative count to 99%
+    uint32_t target = s.count - s.count / 100;
+    uint32_t seen = 0;
+    for(int i=0;i<kProfileBuckets - 1;i++) {
+        seen += s.buckets[i];
+        if(seen >= target) {
+            return kProfileBucketLimitsMicros[i] < maxMicros ? kProfileBucketLimitsMicros[i] : maxMicros;
+        }
+    }
+    return maxMicros;
+}
+
+byte LatencyProfiler::getTaskCount() {
+    return taskCount;
+}
+
+const char *LatencyProfiler::getTaskName(byte id) {
+    return taskNames[id];
+}
+
+int LatencyProfiler::getStackHighWaterMark(byte id) {
+    TaskHandle_t task = xTaskGetHandle(taskNames[id]);
+    if(task == nullptr) {
+        return -1;
+    }
+    return uxTaskGetStackHighWaterMark(task);
+}
+
+ProfileSpan::ProfileSpan(LatencyProfiler &profiler, int stage) : profiler(profiler), stage(stage) {
+    startCore = xPortGetCoreID();
+    startCycles = ESP.getCycleCount();
+}
+
+ProfileSpan::~ProfileSpan() {
+    uint32_t cycles = ESP.getCycleCount() - startCycles;
+    // the two cores count cycles independently, a span that moved across them is not timed
+    if(xPortGetCoreID() != startCore) {
+        profiler.recordMigrated(stage);
+        return;
+    }
+    profiler.record(stage, cycles);
+}
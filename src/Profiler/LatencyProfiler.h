@@ -0,0 +1,83 @@
+#ifndef LATENCY_PROFILER_H
+#define LATENCY_PROFILER_H
+
+#include <Arduino.h>
+#include <atomic>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+const byte kMaxProfileStages = 40;
+const byte kMaxProfileTasks = 8;
+
+// upper bound of each histogram bucket in microseconds, the last bucket takes everything above
+const byte kProfileBuckets = 12;
+const uint32_t kProfileBucketLimitsMicros[kProfileBuckets - 1] = {
+    100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000
+};
+
+struct ProfileStage {
+    const char *name;
+    uint32_t    count;
+    uint32_t    migrated;   // spans that ended on another core, the cycle counters differ
+    uint32_t    maxCycles;
+    uint64_t    totalCycles;
+    uint32_t    buckets[kProfileBuckets];
+    uint32_t    generation; // the reset its counters belong to
+};
+
+// Fixed bucket latency histograms for named stages, timed with the cpu cycle counter. Each
+// stage is only ever recorded from one task, readers take the counters as they are, a torn
+// read only skews one report. A reset only moves the generation on, each stage is cleared by
+// its own task at its next record, so a reset never tears counts a task is updating.
+//
+// Also keeps a list of task names whose stack high water mark is reported, looked up by name
+// so tasks owned by libraries (async_tcp) can be watched too.
+class LatencyProfiler
+{
+  private:
+    ProfileStage    stages[kMaxProfileStages];
+    byte            stageCount = 0;
+    const char     *taskNames[kMaxProfileTasks];
+    byte            taskCount = 0;
+    std::atomic<uint32_t> generation{0};
+
+    ProfileStage &currentStage(int stage);
+
+  public:
+    // returns the stage id, -1 when full
+    int addStage(const char *name);
+    void addTask(const char *name);
+
+    void record(int stage, uint32_t cycles);
+    void recordMigrated(int stage);
+    void reset();
+
+    byte getStageCount();
+    // a copy, all zero when the stage has not recorded since the last reset
+    ProfileStage getStage(byte id);
+    uint32_t getMaxMicros(byte id);
+    uint32_t getAverageMicros(byte id);
+    // upper bound of the bucket holding the 99th percentile, capped at the max seen
+    uint32_t getP99Micros(byte id);
+
+    byte getTaskCount();
+    const char *getTaskName(byte id);
+    // free stack in bytes at its lowest, -1 when no task by that name is running
+    int getStackHighWaterMark(byte id);
+};
+
+// times its own scope into a stage, nothing is recorded for a stage id of -1
+class ProfileSpan
+{
+  private:
+    LatencyProfiler &profiler;
+    int             stage;
+    uint32_t        startCycles;
+    int             startCore;
+
+  public:
+    ProfileSpan(LatencyProfiler &profiler, int stage);
+    ~ProfileSpan();
+};
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef HOST_ARDUINO_H
+#define HOST_ARDUINO_H
+
+// Just enough of the Arduino core for the bus code to build on the host, for the native tests
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include "HostHal.h"
+
+typedef uint8_t byte;
+
+inline unsigned long micros() {
+    return hostNowMicros();
+}
+
+inline unsigned long millis() {
+    return hostNowMicros() / 1000;
+}
+
+// repeatable, every run of a test sees the same sequence
+inline uint32_t esp_random() {
+    static uint32_t state = 0x9E3779B9;
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+class HostSerial
+{
+  public:
+    int printf(const char *format, ...) {
+        va_list args;
+        va_start(args, format);
+        int len = vprintf(format, args);
+        va_end(args);
+        return len;
+    }
+
+    int println(const char *line) {
+        return ::printf("%s\n", line);
+    }
+};
+
+inline HostSerial &hostSerial() {
+    static HostSerial serial;
+    return serial;
+}
+
+#define Serial hostSerial()
+
+#endif
@@ -0,0 +1,95 @@
+#ifndef HOST_HAL_H
+#define HOST_HAL_H
+
+#include <stdint.h>
+#include <vector>
+
+// Virtual time for the native tests. Nothing runs on its own on the host: the clock only moves
+// when a test advances it or code blocks in vTaskDelay or a queue wait, and esp_timers fire
+// as the clock passes their deadline. Tasks are never started, a test runs a task's loop body
+// itself, so one thread plays every task in a fixed order and every run is repeatable.
+
+struct esp_timer {
+    void        (*callback)(void *arg);
+    void        *arg;
+    unsigned long deadlineMicros;
+    bool         armed;
+};
+
+inline unsigned long &hostNowMicros() {
+    // away from zero, the driver treats a zero timestamp as "never"
+    static unsigned long now = 1000000;
+    return now;
+}
+
+inline std::vector<esp_timer *> &hostTimers() {
+    static std::vector<esp_timer *> timers;
+    return timers;
+}
+
+// called while code blocks, so whatever it waits for can happen in the meantime
+typedef void (*HostBlockedHook)(void *arg);
+
+struct HostBlockedHookSlot {
+    HostBlockedHook hook;
+    void           *arg;
+};
+
+inline HostBlockedHookSlot &hostBlockedHookSlot() {
+    static HostBlockedHookSlot slot = { nullptr, nullptr };
+    return slot;
+}
+
+inline void hostSetBlockedHook(HostBlockedHook hook, void *arg) {
+    hostBlockedHookSlot().hook = hook;
+    hostBlockedHookSlot().arg = arg;
+}
+
+// earliest armed timer, or until when nothing is due before until
+inline unsigned long hostNextTimerMicros(unsigned long until) {
+    unsigned long next = until;
+    for(esp_timer *timer : hostTimers()) {
+        if(timer->armed && timer->deadlineMicros < next) {
+            next = timer->deadlineMicros;
+        }
+    }
+    return next;
+}
+
+// moves the clock forward, firing every timer on its own deadline on the way
+inline void hostAdvanceTo(unsigned long micros) {
+    for(;;) {
+        unsigned long next = hostNextTimerMicros(micros);
+        if(next > hostNowMicros()) {
+            hostNowMicros() = next;
+        }
+
+        bool fired = false;
+        for(esp_timer *timer : hostTimers()) {
+            if(timer->armed && timer->deadlineMicros <= hostNowMicros()) {
+                timer->armed = false;
+                timer->callback(timer->arg);
+                fired = true;
+            }
+        }
+
+        if(!fired && hostNowMicros() >= micros) {
+            return;
+        }
+    }
+}
+
+inline void hostAdvance(unsigned long micros) {
+    hostAdvanceTo(hostNowMicros() + micros);
+}
+
+// what a blocked task does: let a millisecond go by, then give the others a turn
+inline void hostBlockOneTick() {
+    hostAdvance(1000);
+    HostBlockedHookSlot &slot = hostBlockedHookSlot();
+    if(slot.hook != nullptr) {
+        slot.hook(slot.arg);
+    }
+}
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef HOST_ESP_TIMER_H
+#define HOST_ESP_TIMER_H
+
+#include <stdint.h>
+#include "HostHal.h"
+
+typedef int esp_err_t;
+#define ESP_OK   0
+#define ESP_FAIL -1
+
+typedef esp_timer *esp_timer_handle_t;
+typedef void (*esp_timer_cb_t)(void *arg);
+
+typedef struct {
+    esp_timer_cb_t callback;
+    void          *arg;
+    int            dispatch_method;
+    const char    *name;
+    bool           skip_unhandled_events;
+} esp_timer_create_args_t;
+
+// timers live as long as the test, like the driver's they are never deleted
+inline esp_err_t esp_timer_create(const esp_timer_create_args_t *args, esp_timer_handle_t *handle) {
+    esp_timer *timer = new esp_timer();
+    timer->callback = args->callback;
+    timer->arg = args->arg;
+    timer->deadlineMicros = 0;
+    timer->armed = false;
+    hostTimers().push_back(timer);
+    *handle = timer;
+    return ESP_OK;
+}
+
+inline esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeoutMicros) {
+    timer->deadlineMicros = hostNowMicros() + timeoutMicros;
+    timer->armed = true;
+    return ESP_OK;
+}
+
+inline esp_err_t esp_timer_stop(esp_timer_handle_t timer) {
+    timer->armed = false;
+    return ESP_OK;
+}
+
+inline int64_t esp_timer_get_time() {
+    return hostNowMicros();
+}
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef HOST_FREERTOS_H
+#define HOST_FREERTOS_H
+
+#include <stdint.h>
+#include <assert.h>
+#include "HostHal.h"
+
+typedef int      BaseType_t;
+typedef unsigned UBaseType_t;
+typedef uint32_t TickType_t;
+
+// one tick is a millisecond, as configured for the Arduino core
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+#define portMAX_DELAY     ((TickType_t)0xFFFFFFFF)
+
+#define configASSERT(x) assert(x)
+
+#define pdFALSE 0
+#define pdTRUE  1
+#define pdFAIL  0
+#define pdPASS  1
+
+#endif
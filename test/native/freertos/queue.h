@@ -0,0 +1,90 @@
+#ifndef HOST_FREERTOS_QUEUE_H
+#define HOST_FREERTOS_QUEUE_H
+
+#include <string.h>
+#include <deque>
+#include <vector>
+#include "FreeRTOS.h"
+
+struct QueueDefinition {
+    size_t                         itemSize;
+    size_t                         length;
+    std::deque<std::vector<uint8_t>> items;
+    QueueDefinition               *set = nullptr; // the set this queue is a member of
+    std::deque<QueueDefinition *>  ready;         // only for a set, one entry per queued item
+};
+
+typedef QueueDefinition *QueueHandle_t;
+typedef QueueDefinition *QueueSetHandle_t;
+typedef QueueDefinition *QueueSetMemberHandle_t;
+
+inline QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t itemSize) {
+    QueueDefinition *queue = new QueueDefinition();
+    queue->itemSize = itemSize;
+    queue->length = length;
+    return queue;
+}
+
+inline BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t) {
+    // a full queue is never drained while the sender waits, nothing else runs meanwhile
+    if(queue->items.size() >= queue->length) {
+        return pdFALSE;
+    }
+    const uint8_t *bytes = static_cast<const uint8_t *>(item);
+    queue->items.push_back(std::vector<uint8_t>(bytes, bytes + queue->itemSize));
+    if(queue->set != nullptr) {
+        // as in FreeRTOS, a set too short for what its members hold is a bug, not a full queue
+        configASSERT(queue->set->ready.size() < queue->set->length);
+        queue->set->ready.push_back(queue);
+    }
+    return pdTRUE;
+}
+
+inline BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t wait) {
+    for(TickType_t waited = 0; queue->items.empty(); waited++) {
+        if(waited >= wait) {
+            return pdFALSE;
+        }
+        hostBlockOneTick();
+    }
+    memcpy(item, queue->items.front().data(), queue->itemSize);
+    queue->items.pop_front();
+    return pdTRUE;
+}
+
+// like FreeRTOS, the set keeps whatever it was told about the items thrown away
+inline BaseType_t xQueueReset(QueueHandle_t queue) {
+    queue->items.clear();
+    return pdPASS;
+}
+
+inline UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue) {
+    return queue->items.size();
+}
+
+// a set hands out its members in the order their items were queued, one per item
+inline QueueSetHandle_t xQueueCreateSet(UBaseType_t length) {
+    return xQueueCreate(length, 0);
+}
+
+inline BaseType_t xQueueAddToSet(QueueSetMemberHandle_t member, QueueSetHandle_t set) {
+    if(member->set != nullptr || !member->items.empty()) {
+        return pdFAIL;
+    }
+    member->set = set;
+    return pdPASS;
+}
+
+inline QueueSetMemberHandle_t xQueueSelectFromSet(QueueSetHandle_t set, TickType_t wait) {
+    for(TickType_t waited = 0; set->ready.empty(); waited++) {
+        if(waited >= wait) {
+            return nullptr;
+        }
+        hostBlockOneTick();
+    }
+    QueueDefinition *member = set->ready.front();
+    set->ready.pop_front();
+    return member;
+}
+
+#endif
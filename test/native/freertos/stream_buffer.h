@@ -0,0 +1,39 @@
+#ifndef HOST_FREERTOS_STREAM_BUFFER_H
+#define HOST_FREERTOS_STREAM_BUFFER_H
+
+#include <deque>
+#include "FreeRTOS.h"
+
+struct StreamBufferDefinition {
+    size_t              size;
+    std::deque<uint8_t> bytes;
+};
+
+typedef StreamBufferDefinition *StreamBufferHandle_t;
+
+inline StreamBufferHandle_t xStreamBufferCreate(size_t size, size_t) {
+    StreamBufferDefinition *stream = new StreamBufferDefinition();
+    stream->size = size;
+    return stream;
+}
+
+inline size_t xStreamBufferSend(StreamBufferHandle_t stream, const void *data, size_t len, TickType_t) {
+    const uint8_t *bytes = static_cast<const uint8_t *>(data);
+    size_t sent = 0;
+    while(sent < len && stream->bytes.size() < stream->size) {
+        stream->bytes.push_back(bytes[sent++]);
+    }
+    return sent;
+}
+
+inline size_t xStreamBufferReceive(StreamBufferHandle_t stream, void *data, size_t len, TickType_t) {
+    uint8_t *bytes = static_cast<uint8_t *>(data);
+    size_t received = 0;
+    while(received < len && !stream->bytes.empty()) {
+        bytes[received++] = stream->bytes.front();
+        stream->bytes.pop_front();
+    }
+    return received;
+}
+
+#endif
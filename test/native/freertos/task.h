@@ -0,0 +1,30 @@
+#ifndef HOST_FREERTOS_TASK_H
+#define HOST_FREERTOS_TASK_H
+
+#include "FreeRTOS.h"
+#include "../Arduino.h"
+
+typedef void *TaskHandle_t;
+typedef void (*TaskFunction_t)(void *arg);
+
+// tasks are never started on the host, see HostHal.h. the handle only tells the caller that
+// its task exists
+inline BaseType_t xTaskCreatePinnedToCore(TaskFunction_t, const char *, uint32_t, void *, UBaseType_t, TaskHandle_t *handle, BaseType_t) {
+    static int hostTask;
+    if(handle != nullptr) {
+        *handle = &hostTask;
+    }
+    return pdPASS;
+}
+
+inline void vTaskDelay(TickType_t ticks) {
+    for(TickType_t i=0;i<ticks;i++) {
+        hostBlockOneTick();
+    }
+}
+
+inline TickType_t xTaskGetTickCount() {
+    return millis();
+}
+
+#endif
@@ -0,0 +1,465 @@
+#include <unity.h>
+#include <stdlib.h>
+#include <deque>
+#include <vector>
+#include "FujitsuAC.h"
+#include "FujitsuBusScheduler.h"
+
+// Replays FJCP captures from GET /api/ac/capture through the driver on the host. The captured
+// unit and wall controller frames go in through a bus port, at their captured times on the
+// virtual clock, and reach waitForFrame through the same event queue, bus scheduler and
+// assembler as on the board. Whatever the driver sends is compared with what the captured
+// controller sent in reply to the same frame.
+//
+// A capture of a field incident can be replayed with
+//   FJCP_CAPTURE=fujitsu_capture.fjcp pio test -e native -f test_native_capture_replay -v
+
+// a bus port fed from the capture. frames go in whole, as a fifo full event delivers them,
+// and every frame the driver writes comes back as its echo once it has crossed the wire
+class ReplayPort : public FujitsuBusPort
+{
+  public:
+    struct SentFrame {
+        unsigned long micros;
+        long          answering; // index of the frame fed last when it was written
+        byte          frame[kFrameLength];
+    };
+
+    QueueHandle_t          events = nullptr;
+    std::deque<byte>       rx;
+    std::vector<SentFrame> sent;
+    long                   fedIndex = -1;
+
+    bool          echoDue = false;
+    unsigned long echoMicros = 0;
+    byte          echo[kFrameLength];
+
+    QueueHandle_t begin() override {
+        if(events == nullptr) {
+            events = xQueueCreate(kUartEventQueueSize, sizeof(uart_event_t));
+        }
+        return events;
+    }
+
+    int read(byte *buf, size_t len) override {
+        size_t n = 0;
+        while(n < len && !rx.empty()) {
+            buf[n++] = rx.front();
+            rx.pop_front();
+        }
+        return n;
+    }
+
+    int write(const byte *buf, size_t len) override {
+        SentFrame entry;
+        entry.micros = micros();
+        entry.answering = fedIndex;
+        memcpy(entry.frame, buf, kFrameLength);
+        sent.push_back(entry);
+
+        memcpy(echo, buf, kFrameLength);
+        echoMicros = micros() + kFrameLength * kByteTimeMicros;
+        echoDue = true;
+        return len;
+    }
+
+    void flushInput() override {
+        rx.clear();
+    }
+
+    void deliver(const byte frame[kFrameLength]) {
+        for(int i=0;i<kFrameLength;i++) {
+            rx.push_back(frame[i]);
+        }
+        uart_event_t event = {};
+        event.type = UART_DATA;
+        event.size = kFrameLength;
+        xQueueSend(events, &event, 0);
+    }
+};
+
+struct ReplayReport {
+    unsigned long framesFed = 0;       // unit and wall controller frames played to the driver
+    unsigned long repliesCaptured = 0; // frames the captured controller sent
+    unsigned long repliesSent = 0;     // frames the driver sent during the replay
+    unsigned long repliesMatched = 0;  // identical to the captured reply to the same frame
+    unsigned long repliesDiffering = 0;
+    unsigned long repliesMissing = 0;  // the capture has a reply, the driver sent none
+    unsigned long repliesExtra = 0;    // the driver replied where the capture has no reply
+    unsigned long replyOffsetMaxMicros = 0; // largest difference in when a reply went out
+};
+
+// one frame of the capture to feed, with the captured controller's reply to it if there was one
+struct ReplayFrame {
+    unsigned long offsetMicros;
+    byte          frame[kFrameLength];
+    bool          replied;
+    unsigned long replyOffsetMicros;
+    byte          reply[kFrameLength];
+};
+
+typedef void (*ReplayFrameHook)(FujitsuAC *ac, size_t index);
+
+static bool parseCapture(const std::vector<byte> &data, std::vector<CaptureEntry> *entries) {
+    if(data.size() < kCaptureHeaderSize || memcmp(data.data(), kCaptureMagic, 4) != 0) {
+        return false;
+    }
+
+    uint16_t version;
+    uint16_t entrySize;
+    memcpy(&version, data.data() + 4, 2);
+    memcpy(&entrySize, data.data() + 6, 2);
+    if(version != kCaptureFormatVersion || entrySize != sizeof(CaptureEntry)
+       || (data.size() - kCaptureHeaderSize) % entrySize != 0) {
+        return false;
+    }
+
+    entries->clear();
+    for(size_t pos=kCaptureHeaderSize;pos<data.size();pos+=entrySize) {
+        CaptureEntry entry;
+        memcpy(&entry, data.data() + pos, entrySize);
+        entries->push_back(entry);
+    }
+    return true;
+}
+
+// the address the captured controller sent from, 0 for a listen-only capture
+static byte capturedControllerAddress(const std::vector<CaptureEntry> &entries) {
+    for(const CaptureEntry &entry : entries) {
+        if(entry.direction == kCaptureTx) {
+            return FujitsuFrame::fromWire(entry.frame).get<kFieldSource>();
+        }
+    }
+    return 0;
+}
+
+static std::vector<ReplayFrame> planReplay(const std::vector<CaptureEntry> &entries, byte controller) {
+    std::vector<ReplayFrame> frames;
+    unsigned long offset = 0;
+
+    for(size_t i=0;i<entries.size();i++) {
+        // timestamps are the board's 32 bit micros, they may wrap during a capture
+        if(i > 0) {
+            offset += (uint32_t)(entries[i].micros - entries[i - 1].micros);
+        }
+
+        if(entries[i].direction == kCaptureTx) {
+            if(!frames.empty() && !frames.back().replied) {
+                frames.back().replied = true;
+                frames.back().replyOffsetMicros = offset;
+                memcpy(frames.back().reply, entries[i].frame, kFrameLength);
+            }
+            continue;
+        }
+
+        // the captured controller's echo, the port echoes the driver's own frames instead
+        if(controller != 0 && FujitsuFrame::fromWire(entries[i].frame).get<kFieldSource>() == controller) {
+            continue;
+        }
+
+        ReplayFrame frame = {};
+        frame.offsetMicros = offset;
+        memcpy(frame.frame, entries[i].frame, kFrameLength);
+        frames.push_back(frame);
+    }
+    return frames;
+}
+
+// lets the bus task run until the clock reaches untilMicros, stopping wherever a reply timer
+// or an echo is due so each is handled on time
+static void runBusUntil(FujitsuBusScheduler *scheduler, ReplayPort *port, unsigned long untilMicros) {
+    do {
+        unsigned long step = hostNowMicros() + kBusTaskHousekeepingTicks * 1000;
+        if(step > untilMicros) {
+            step = untilMicros;
+        }
+        if(port->echoDue && port->echoMicros < step) {
+            step = port->echoMicros;
+        }
+        hostAdvanceTo(hostNextTimerMicros(step));
+
+        if(port->echoDue && hostNowMicros() >= port->echoMicros) {
+            port->echoDue = false;
+            port->deliver(port->echo);
+        }
+        do {
+            scheduler->runOnce(0);
+        } while(uxQueueMessagesWaiting(port->events) > 0);
+    } while(hostNowMicros() < untilMicros);
+}
+
+// feeds a capture to a fresh driver. role is the captured controller's unless secondary is
+// given, 0 primary and 1 secondary. a capture without frames from a controller is replayed
+// listen-only. hook, if set, runs before each frame is fed
+static bool replayCapture(const std::vector<byte> &data, int secondary, ReplayFrameHook hook,
+                          FujitsuAC **acOut, ReplayReport *report) {
+    std::vector<CaptureEntry> entries;
+    if(!parseCapture(data, &entries)) {
+        return false;
+    }
+
+    byte controller = capturedControllerAddress(entries);
+    if(secondary == -1) {
+        secondary = controller == static_cast<byte>(ACAddress::SECONDARY);
+    } else {
+        controller = secondary ? static_cast<byte>(ACAddress::SECONDARY) : static_cast<byte>(ACAddress::PRIMARY);
+    }
+    std::vector<ReplayFrame> frames = planReplay(entries, controller);
+
+    // never freed, a reply timer of an earlier replay may still point at its driver
+    FujitsuAC *ac = new FujitsuAC();
+    ReplayPort *port = new ReplayPort();
+    FujitsuBusScheduler *scheduler = new FujitsuBusScheduler();
+
+    ac->setListenOnly(controller == 0);
+    ac->connect(port, secondary);
+    scheduler->addUnit(ac);
+    scheduler->start();
+    ac->capture.start();
+
+    unsigned long start = hostNowMicros() + 100000;
+    for(size_t i=0;i<frames.size();i++) {
+        runBusUntil(scheduler, port, start + frames[i].offsetMicros);
+        if(hook != nullptr) {
+            hook(ac, i);
+        }
+        port->fedIndex = i;
+        port->deliver(frames[i].frame);
+        runBusUntil(scheduler, port, hostNowMicros());
+    }
+    // the reply to the last frame still has to go out
+    runBusUntil(scheduler, port, hostNowMicros() + 1000000);
+
+    *report = ReplayReport();
+    report->framesFed = frames.size();
+    report->repliesSent = port->sent.size();
+
+    size_t next = 0;
+    for(size_t i=0;i<frames.size();i++) {
+        const ReplayPort::SentFrame *sent = nullptr;
+        while(next < port->sent.size() && port->sent[next].answering < (long)i) {
+            next++;
+        }
+        if(next < port->sent.size() && port->sent[next].answering == (long)i) {
+            sent = &port->sent[next++];
+        }
+
+        if(frames[i].replied) {
+            report->repliesCaptured++;
+        }
+
+        if(sent == nullptr) {
+            report->repliesMissing += frames[i].replied;
+        } else if(!frames[i].replied) {
+            report->repliesExtra++;
+        } else if(memcmp(sent->frame, frames[i].reply, kFrameLength) == 0) {
+            report->repliesMatched++;
+        } else {
+            report->repliesDiffering++;
+        }
+
+        if(sent != nullptr && frames[i].replied) {
+            long replayed = sent->micros - (start + frames[i].offsetMicros);
+            long captured = frames[i].replyOffsetMicros - frames[i].offsetMicros;
+            unsigned long offset = labs(replayed - captured);
+            if(offset > report->replyOffsetMaxMicros) {
+                report->replyOffsetMaxMicros = offset;
+            }
+        }
+    }
+
+    if(acOut != nullptr) {
+        *acOut = ac;
+    }
+    return true;
+}
+
+// the driver's own capture, in the format GET /api/ac/capture exports
+static std::vector<byte> exportCapture(FujitsuCapture *capture) {
+    std::vector<byte> data(kCaptureHeaderSize);
+    uint32_t first = capture->getOldest();
+    capture->writeHeader(data.data(), first);
+
+    for(uint32_t seq=first;seq<capture->getWritten();seq++) {
+        CaptureEntry entry;
+        if(capture->read(seq, &entry)) {
+            const byte *bytes = reinterpret_cast<const byte *>(&entry);
+            data.insert(data.end(), bytes, bytes + sizeof(entry));
+        }
+    }
+    return data;
+}
+
+// builds a capture by hand, frames are given non inverted and stored as on the wire
+class CaptureBuilder
+{
+  public:
+    std::vector<byte> data;
+    uint32_t          sequence = 0;
+
+    CaptureBuilder() : data(kCaptureHeaderSize) {
+        FujitsuCapture capture;
+        capture.writeHeader(data.data(), 0);
+    }
+
+    void add(byte direction, uint32_t micros, const FujitsuFrame &frame) {
+        CaptureEntry entry = {};
+        entry.micros = micros;
+        entry.sequence = sequence++;
+        entry.direction = direction;
+        frame.toWire(entry.frame);
+        const byte *bytes = reinterpret_cast<const byte *>(&entry);
+        data.insert(data.end(), bytes, bytes + sizeof(entry));
+    }
+};
+
+static FujitsuFrame unitStatus(byte dest, byte temp, bool controllerPresent) {
+    FujitsuFrame ff;
+    ff.set<kFieldSource>(static_cast<byte>(ACAddress::UNIT));
+    ff.set<kFieldDest>(dest);
+    ff.set<kFieldMessageType>(static_cast<byte>(ACMessageType::STATUS));
+    ff.set<kFieldEnabled>(1);
+    ff.set<kFieldMode>(static_cast<byte>(ACMode::COOL));
+    ff.set<kFieldFan>(static_cast<byte>(ACFanMode::FAN_LOW));
+    ff.set<kFieldTemperature>(temp);
+    ff.set<kFieldControllerPresent>(controllerPresent);
+    ff.set<kFieldControllerTemp>(21);
+    return ff;
+}
+
+// the unit polling a primary controller, which logs in after a few polls. from frame 10 on
+// it reports the temperature the hook below sets
+static const int kScriptedPolls = 20;
+static const uint32_t kScriptedPollMicros = 500000;
+
+static std::vector<byte> scriptedPrimarySession() {
+    CaptureBuilder builder;
+    for(int i=0;i<kScriptedPolls;i++) {
+        builder.add(kCaptureRx, 0xFFF00000 + i * kScriptedPollMicros, // wraps half way
+                    unitStatus(static_cast<byte>(ACAddress::PRIMARY), i >= 10 ? 25 : 22, i >= 3));
+    }
+    return builder.data;
+}
+
+static void setTempAtFrameSix(FujitsuAC *ac, size_t index) {
+    if(index == 6) {
+        ac->setTemp(25);
+    }
+}
+
+static void printReport(const ReplayReport &report) {
+    printf("frames fed %lu, replies captured %lu, sent %lu, matched %lu, differing %lu, missing %lu, extra %lu, "
+           "reply timing off by up to %lu us\n",
+           report.framesFed, report.repliesCaptured, report.repliesSent, report.repliesMatched,
+           report.repliesDiffering, report.repliesMissing, report.repliesExtra, report.replyOffsetMaxMicros);
+}
+
+void setUp() {}
+void tearDown() {}
+
+void test_rejects_what_is_not_a_capture() {
+    ReplayReport report;
+    std::vector<byte> data(kCaptureHeaderSize + sizeof(CaptureEntry));
+    TEST_ASSERT_FALSE(replayCapture(data, -1, nullptr, nullptr, &report));
+
+    data = CaptureBuilder().data;
+    data.push_back(0); // not a whole entry
+    TEST_ASSERT_FALSE(replayCapture(data, -1, nullptr, nullptr, &report));
+}
+
+void test_listen_only_capture_is_decoded() {
+    // the unit and a wall controller, nothing from us
+    CaptureBuilder builder;
+    for(int i=0;i<8;i++) {
+        uint32_t t = i * kScriptedPollMicros;
+        builder.add(kCaptureRx, t, unitStatus(static_cast<byte>(ACAddress::PRIMARY), 24, true));
+
+        FujitsuFrame wall = unitStatus(static_cast<byte>(ACAddress::UNIT), 24, true);
+        wall.set<kFieldSource>(static_cast<byte>(ACAddress::PRIMARY));
+        builder.add(kCaptureRx, t + 240000, wall);
+    }
+
+    FujitsuAC *ac;
+    ReplayReport report;
+    TEST_ASSERT_TRUE(replayCapture(builder.data, -1, nullptr, &ac, &report));
+
+    TEST_ASSERT_TRUE(ac->isListenOnly());
+    TEST_ASSERT_EQUAL_UINT32(16, report.framesFed);
+    TEST_ASSERT_EQUAL_UINT32(16, ac->getFramesReceived());
+    TEST_ASSERT_EQUAL_UINT32(0, report.repliesSent);
+    TEST_ASSERT_EQUAL_UINT32(24, ac->getTemp());
+    TEST_ASSERT_EQUAL_UINT32(static_cast<byte>(ACMode::COOL), ac->getMode());
+    TEST_ASSERT_TRUE(ac->getOnOff());
+}
+
+void test_replay_reproduces_recorded_replies() {
+    // record a session of the driver, then play its own capture back to a fresh one
+    FujitsuAC *recorded;
+    ReplayReport report;
+    TEST_ASSERT_TRUE(replayCapture(scriptedPrimarySession(), 0, setTempAtFrameSix, &recorded, &report));
+    TEST_ASSERT_EQUAL_UINT32(kScriptedPolls, report.framesFed);
+    TEST_ASSERT_EQUAL_UINT32(kScriptedPolls, report.repliesSent);
+    TEST_ASSERT_EQUAL_UINT32(1, recorded->getWritesApplied());
+
+    FujitsuAC *replayed;
+    TEST_ASSERT_TRUE(replayCapture(exportCapture(&recorded->capture), -1, setTempAtFrameSix, &replayed, &report));
+    printReport(report);
+
+    TEST_ASSERT_TRUE(replayed->isPrimary());
+    TEST_ASSERT_EQUAL_UINT32(kScriptedPolls, report.framesFed);
+    TEST_ASSERT_EQUAL_UINT32(kScriptedPolls, report.repliesCaptured);
+    TEST_ASSERT_EQUAL_UINT32(kScriptedPolls, report.repliesMatched);
+    TEST_ASSERT_EQUAL_UINT32(0, report.repliesDiffering);
+    TEST_ASSERT_EQUAL_UINT32(0, report.repliesMissing);
+    TEST_ASSERT_EQUAL_UINT32(0, report.repliesExtra);
+    TEST_ASSERT_EQUAL_UINT32(0, replayed->getEchoMismatches());
+    TEST_ASSERT_EQUAL_UINT32(25, replayed->getTemp());
+}
+
+void test_replay_shows_a_changed_reply() {
+    // the same capture without the command, the replies carrying the write now differ
+    FujitsuAC *recorded;
+    ReplayReport report;
+    TEST_ASSERT_TRUE(replayCapture(scriptedPrimarySession(), 0, setTempAtFrameSix, &recorded, &report));
+    TEST_ASSERT_TRUE(replayCapture(exportCapture(&recorded->capture), -1, nullptr, nullptr, &report));
+
+    TEST_ASSERT_EQUAL_UINT32(kScriptedPolls, report.repliesCaptured);
+    TEST_ASSERT_GREATER_THAN(0, report.repliesDiffering);
+    TEST_ASSERT_EQUAL_UINT32(kScriptedPolls, report.repliesMatched + report.repliesDiffering);
+}
+
+void test_replay_capture_file() {
+    const char *path = getenv("FJCP_CAPTURE");
+    if(path == nullptr) {
+        TEST_IGNORE_MESSAGE("set FJCP_CAPTURE to a .fjcp file to replay it");
+    }
+
+    FILE *file = fopen(path, "rb");
+    TEST_ASSERT_NOT_NULL(file);
+    std::vector<byte> data;
+    byte buf[4096];
+    size_t len;
+    while((len = fread(buf, 1, sizeof(buf), file)) > 0) {
+        data.insert(data.end(), buf, buf + len);
+    }
+    fclose(file);
+
+    FujitsuAC *ac;
+    ReplayReport report;
+    TEST_ASSERT_TRUE_MESSAGE(replayCapture(data, -1, nullptr, &ac, &report), "not an FJCP capture");
+    printReport(report);
+    printf("driver: frames received %lu, sent %lu, echo mismatches %lu, incomplete frames %lu, resync bytes %lu, "
+           "connection resets %u, error frames %u\n",
+           ac->getFramesReceived(), ac->getFramesSent(), ac->getEchoMismatches(), ac->getIncompleteFrames(),
+           ac->getResyncBytes(), (unsigned)ac->getConnectionResets(), (unsigned)ac->getErrorFrames());
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_rejects_what_is_not_a_capture);
+    RUN_TEST(test_listen_only_capture_is_decoded);
+    RUN_TEST(test_replay_reproduces_recorded_replies);
+    RUN_TEST(test_replay_shows_a_changed_reply);
+    RUN_TEST(test_replay_capture_file);
+    return UNITY_END();
+}
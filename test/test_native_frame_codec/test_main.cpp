@@ -0,0 +1,268 @@
+#include <unity.h>
+#include "FujitsuFrame.h"
+
+// Checks the field table and FujitsuFrame's accessors against the frame layout as the driver
+// decoded and encoded it by hand before the table existed. The byte, mask and shift of every
+// state field below are the old constants, copied as they were, not derived from kFrameFields.
+
+struct BaselineField {
+    FrameFieldId id;
+    byte index;
+    byte mask;
+    byte offset;
+};
+
+static const BaselineField kBaselineStateFields[] = {
+    { kFieldMode,              3, 0b00001110, 1 },
+    { kFieldFan,               3, 0b01110000, 4 },
+    { kFieldEnabled,           3, 0b00000001, 0 },
+    { kFieldError,             3, 0b10000000, 7 },
+    { kFieldEconomy,           4, 0b10000000, 7 },
+    { kFieldTemperature,       4, 0b01111111, 0 },
+    { kFieldUpdateMagic,       5, 0b11110000, 4 },
+    { kFieldSwing,             5, 0b00000100, 2 },
+    { kFieldSwingStep,         5, 0b00000010, 1 },
+    { kFieldControllerPresent, 6, 0b00000001, 0 },
+    { kFieldControllerTemp,    6, 0b01111110, 1 },
+};
+
+static const BaselineField *baselineStateField(FrameFieldId f) {
+    for(size_t i=0;i<sizeof(kBaselineStateFields) / sizeof(kBaselineStateFields[0]);i++) {
+        if(kBaselineStateFields[i].id == f) {
+            return &kBaselineStateFields[i];
+        }
+    }
+    return nullptr;
+}
+
+// the old decodeFrame, one field at a time, on a non inverted frame
+static byte baselineDecode(FrameFieldId f, const byte buf[kFrameLength]) {
+    switch(f) {
+        case kFieldSource:      return buf[0];
+        case kFieldDest:        return buf[1] & 0b01111111;
+        case kFieldUnknownBit:  return (buf[1] & 0b10000000) > 0;
+        case kFieldLoginBit:    return (buf[1] & 0b00100000) != 0;
+        case kFieldMessageType: return (buf[2] & 0b00110000) >> 4;
+        case kFieldWriteBit:    return (buf[2] & 0b00001000) != 0;
+        default: {
+            const BaselineField *field = baselineStateField(f);
+            return (buf[field->index] & field->mask) >> field->offset;
+        }
+    }
+}
+
+// the old encodeFrame, one field at a time
+static void baselineEncode(FrameFieldId f, byte buf[kFrameLength], byte value) {
+    switch(f) {
+        case kFieldSource:
+            buf[0] = value;
+            break;
+        case kFieldDest:
+            buf[1] &= 0b10000000;
+            buf[1] |= value & 0b01111111;
+            break;
+        case kFieldUnknownBit:
+            buf[1] &= 0b01111111;
+            if(value) {
+                buf[1] |= 0b10000000;
+            }
+            break;
+        case kFieldLoginBit:
+            if(value) {
+                buf[1] |= 0b00100000;
+            } else {
+                buf[1] &= 0b11011111;
+            }
+            break;
+        case kFieldMessageType:
+            buf[2] &= 0b11001111;
+            buf[2] |= value << 4;
+            break;
+        case kFieldWriteBit:
+            if(value) {
+                buf[2] |= 0b00001000;
+            } else {
+                buf[2] &= 0b11110111;
+            }
+            break;
+        default: {
+            const BaselineField *field = baselineStateField(f);
+            buf[field->index] = (buf[field->index] & ~field->mask) | (value << field->offset);
+            break;
+        }
+    }
+}
+
+// FujitsuFrame only takes the field as a template argument, dispatch to it at run time
+template<byte F>
+struct FieldAccess {
+    static byte get(const FujitsuFrame &frame, FrameFieldId f) {
+        return f == F ? frame.get<static_cast<FrameFieldId>(F)>() : FieldAccess<F + 1>::get(frame, f);
+    }
+
+    static void set(FujitsuFrame &frame, FrameFieldId f, byte value) {
+        if(f == F) {
+            frame.set<static_cast<FrameFieldId>(F)>(value);
+        } else {
+            FieldAccess<F + 1>::set(frame, f, value);
+        }
+    }
+};
+
+template<>
+struct FieldAccess<kFieldCount> {
+    static byte get(const FujitsuFrame &, FrameFieldId) { return 0; }
+    static void set(FujitsuFrame &, FrameFieldId, byte) {}
+};
+
+static byte getField(const FujitsuFrame &frame, FrameFieldId f) {
+    return FieldAccess<0>::get(frame, f);
+}
+
+static void setField(FujitsuFrame &frame, FrameFieldId f, byte value) {
+    FieldAccess<0>::set(frame, f, value);
+}
+
+static FujitsuFrame frameFromBytes(const byte buf[kFrameLength]) {
+    FujitsuFrame frame;
+    memcpy(&frame.raw, buf, kFrameLength);
+    return frame;
+}
+
+// every field is checked on top of these, so a field that touches bits outside its own
+// mask shows up whatever its neighbours hold
+static const int kBackgroundFrames = 66;
+static byte backgrounds[kBackgroundFrames][kFrameLength];
+
+static void fillBackgrounds() {
+    memset(backgrounds[0], 0x00, kFrameLength);
+    memset(backgrounds[1], 0xFF, kFrameLength);
+
+    uint32_t seed = 0x2545F491;
+    for(int i=2;i<kBackgroundFrames;i++) {
+        for(int j=0;j<kFrameLength;j++) {
+            seed ^= seed << 13;
+            seed ^= seed >> 17;
+            seed ^= seed << 5;
+            backgrounds[i][j] = seed;
+        }
+    }
+}
+
+void setUp() {}
+void tearDown() {}
+
+void test_every_field_value_round_trips() {
+    for(byte f=0;f<kFieldCount;f++) {
+        FrameFieldId id = static_cast<FrameFieldId>(f);
+        unsigned maxValue = fieldMaxValue(kFrameFields[f].mask);
+        TEST_ASSERT_TRUE_MESSAGE(kFrameFields[f].mask != 0, "field without a mask");
+
+        for(int b=0;b<kBackgroundFrames;b++) {
+            for(unsigned value=0;value<=maxValue;value++) {
+                FujitsuFrame frame = frameFromBytes(backgrounds[b]);
+                setField(frame, id, value);
+                TEST_ASSERT_EQUAL_UINT8_MESSAGE(value, getField(frame, id), "field does not read back what was written");
+            }
+        }
+    }
+}
+
+void test_get_matches_baseline_decode() {
+    for(byte f=0;f<kFieldCount;f++) {
+        FrameFieldId id = static_cast<FrameFieldId>(f);
+        byte index = kFrameFields[f].index;
+
+        for(int b=0;b<kBackgroundFrames;b++) {
+            // every possible content of the field's byte
+            for(unsigned v=0;v<256;v++) {
+                byte buf[kFrameLength];
+                memcpy(buf, backgrounds[b], kFrameLength);
+                buf[index] = v;
+
+                TEST_ASSERT_EQUAL_UINT8_MESSAGE(baselineDecode(id, buf), getField(frameFromBytes(buf), id), "decode differs from the old layout");
+            }
+        }
+    }
+}
+
+void test_set_matches_baseline_encode() {
+    for(byte f=0;f<kFieldCount;f++) {
+        FrameFieldId id = static_cast<FrameFieldId>(f);
+        unsigned maxValue = fieldMaxValue(kFrameFields[f].mask);
+
+        for(int b=0;b<kBackgroundFrames;b++) {
+            for(unsigned value=0;value<=maxValue;value++) {
+                byte expected[kFrameLength];
+                memcpy(expected, backgrounds[b], kFrameLength);
+                baselineEncode(id, expected, value);
+
+                FujitsuFrame frame = frameFromBytes(backgrounds[b]);
+                setField(frame, id, value);
+                byte actual[kFrameLength];
+                frame.toBytes(actual);
+
+                // whole frame, a field must not touch its neighbours
+                TEST_ASSERT_EQUAL_HEX8_ARRAY(expected, actual, kFrameLength);
+            }
+        }
+    }
+}
+
+void test_fields_of_a_byte_compose() {
+    // every combination of the state fields sharing a byte, written one after the other,
+    // has to come out as the byte they were taken from
+    for(byte index=3;index<=6;index++) {
+        byte covered = 0;
+        for(byte f=kFirstStateField;f<kFieldCount;f++) {
+            if(kFrameFields[f].index == index) {
+                covered |= kFrameFields[f].mask;
+            }
+        }
+
+        for(unsigned v=0;v<256;v++) {
+            byte source[kFrameLength] = {};
+            source[index] = v;
+
+            FujitsuFrame frame;
+            for(byte f=kFirstStateField;f<kFieldCount;f++) {
+                if(kFrameFields[f].index == index) {
+                    setField(frame, static_cast<FrameFieldId>(f), baselineDecode(static_cast<FrameFieldId>(f), source));
+                }
+            }
+
+            byte actual[kFrameLength];
+            frame.toBytes(actual);
+            TEST_ASSERT_EQUAL_HEX8(v & covered, actual[index]);
+        }
+    }
+}
+
+void test_wire_inversion_matches_baseline() {
+    for(int b=0;b<kBackgroundFrames;b++) {
+        // the old driver inverted every byte in place on the way in and out
+        byte inverted[kFrameLength];
+        for(int i=0;i<kFrameLength;i++) {
+            inverted[i] = backgrounds[b][i] ^ 0xFF;
+        }
+
+        byte actual[kFrameLength];
+        FujitsuFrame::fromWire(backgrounds[b]).toBytes(actual);
+        TEST_ASSERT_EQUAL_HEX8_ARRAY(inverted, actual, kFrameLength);
+
+        frameFromBytes(backgrounds[b]).toWire(actual);
+        TEST_ASSERT_EQUAL_HEX8_ARRAY(inverted, actual, kFrameLength);
+    }
+}
+
+int main() {
+    fillBackgrounds();
+
+    UNITY_BEGIN();
+    RUN_TEST(test_every_field_value_round_trips);
+    RUN_TEST(test_get_matches_baseline_decode);
+    RUN_TEST(test_set_matches_baseline_encode);
+    RUN_TEST(test_fields_of_a_byte_compose);
+    RUN_TEST(test_wire_inversion_matches_baseline);
+    return UNITY_END();
+}
@@ -0,0 +1,271 @@
+#include <unity.h>
+#include "FujitsuAC.h"
+#include "FujitsuBusScheduler.h"
+#include "FujitsuSimBus.h"
+
+// The protocol engine against the simulated indoor unit, on the host. The sim runs its poll
+// cycle on the virtual clock, and whenever it waits on the line the bus task gets its turn,
+// so login time, command latency and frame rates come out in line time without a board.
+
+struct SimRun {
+    FujitsuAC           *ac;
+    FujitsuSimBus       *sim;
+    FujitsuBusScheduler *scheduler;
+};
+
+// every temperature the driver published, in order, while watchedAc is set
+static FujitsuAC *watchedAc = nullptr;
+static byte publishedTemps[256];
+static int publishedTempCount = 0;
+
+// the bus task gets no turn for busStallTicks of every busStallPeriod ticks, as when something
+// above it hogs the core
+static unsigned long busStallPeriod = 0;
+static unsigned long busStallTicks = 0;
+static unsigned long busTicks = 0;
+
+static void runBusTask(void *arg) {
+    FujitsuBusScheduler *scheduler = static_cast<FujitsuBusScheduler *>(arg);
+    busTicks++;
+    if(busStallPeriod > 0 && busTicks % busStallPeriod < busStallTicks) {
+        return;
+    }
+    scheduler->runOnce(0);
+
+    if(watchedAc) {
+        byte temp = watchedAc->getTemp();
+        if(publishedTempCount < 256 && (publishedTempCount == 0 || publishedTemps[publishedTempCount - 1] != temp)) {
+            publishedTemps[publishedTempCount++] = temp;
+        }
+    }
+}
+
+// never freed, a reply timer of an earlier run may still point at its driver
+static SimRun startSim(bool secondary, bool wallController) {
+    SimRun run;
+    run.ac = new FujitsuAC();
+    run.sim = new FujitsuSimBus();
+    run.scheduler = new FujitsuBusScheduler();
+
+    run.sim->setWallController(wallController);
+    run.ac->connect(run.sim, secondary);
+    run.sim->start(run.ac, secondary);
+    run.scheduler->addUnit(run.ac);
+    run.scheduler->start();
+
+    hostSetBlockedHook(&runBusTask, run.scheduler);
+    return run;
+}
+
+static void runFor(SimRun &run, unsigned long millisToRun) {
+    unsigned long end = millis() + millisToRun;
+    while(millis() < end) {
+        run.sim->pollCycle();
+    }
+}
+
+static void printMetrics(const char *name, SimRun &run) {
+    FujitsuSimBus *sim = run.sim;
+    printf("%s: login %lu ms, %.2f frames/s, replies missed %lu, commands %lu (timed out %lu), "
+           "applied avg %lu max %lu ms, confirmed avg %lu max %lu ms, bytes dropped %lu, parity errors %lu\n",
+           name, sim->getLoginMicros() / 1000, sim->getFramesPerSecond(), sim->getRepliesMissed(),
+           sim->getCommands(), sim->getCommandTimeouts(),
+           sim->getAppliedLatencyAverage() / 1000, sim->getAppliedLatencyMax() / 1000,
+           sim->getConfirmedLatencyAverage() / 1000, sim->getConfirmedLatencyMax() / 1000,
+           sim->getBytesDropped(), sim->getParityErrorsRaised());
+}
+
+void setUp() {}
+void tearDown() {
+    hostSetBlockedHook(nullptr, nullptr);
+    watchedAc = nullptr;
+    busStallPeriod = 0;
+}
+
+void test_primary_logs_in_and_applies_commands() {
+    SimRun run = startSim(false, false);
+    run.sim->setBenchmarkInterval(3000);
+    runFor(run, 60000);
+    printMetrics("primary", run);
+
+    TEST_ASSERT_TRUE(run.sim->isLoggedIn());
+    TEST_ASSERT_EQUAL_UINT32(1, run.sim->getLogins());
+    // the login handshake takes a few polls
+    TEST_ASSERT_LESS_THAN(5000, run.sim->getLoginMicros() / 1000);
+    TEST_ASSERT_GREATER_THAN(10, run.sim->getCommands());
+    TEST_ASSERT_EQUAL_UINT32(0, run.sim->getCommandTimeouts());
+    TEST_ASSERT_EQUAL_UINT32(0, run.sim->getRepliesMissed());
+    TEST_ASSERT_EQUAL_UINT32(0, run.ac->getEchoMismatches());
+    TEST_ASSERT_EQUAL_UINT32(0, run.ac->getWriteFailures());
+}
+
+void test_secondary_next_to_a_wall_controller() {
+    SimRun run = startSim(true, true);
+    run.sim->setBenchmarkInterval(3000);
+    runFor(run, 60000);
+    printMetrics("secondary", run);
+
+    TEST_ASSERT_FALSE(run.ac->isPrimary());
+    TEST_ASSERT_TRUE(run.sim->isLoggedIn());
+    TEST_ASSERT_GREATER_THAN(10, run.sim->getCommands());
+    TEST_ASSERT_EQUAL_UINT32(0, run.sim->getCommandTimeouts());
+    TEST_ASSERT_EQUAL_UINT32(0, run.ac->getWriteFailures());
+    TEST_ASSERT_EQUAL_UINT32(0, run.sim->getRepliesMissed());
+    // the wall controller's replies are on the line too and must not be taken for ours
+    TEST_ASSERT_EQUAL_UINT32(0, run.ac->getEchoMismatches());
+}
+
+// the line goes dead for a while, the bus task keeps running
+static void silenceFor(SimRun &run, unsigned long millisToRun) {
+    unsigned long end = millis() + millisToRun;
+    while(millis() < end) {
+        hostAdvance(10000);
+        run.scheduler->runOnce(0);
+    }
+}
+
+void test_secondary_outage_counts_no_login() {
+    SimRun run = startSim(true, true);
+    runFor(run, 10000);
+    TEST_ASSERT_TRUE(run.sim->isLoggedIn());
+
+    silenceFor(run, 3000);
+    TEST_ASSERT_EQUAL_UINT32(1, run.ac->getConnectionResets());
+    TEST_ASSERT_TRUE(run.ac->isRecovering());
+
+    runFor(run, 10000);
+    TEST_ASSERT_FALSE(run.ac->isRecovering());
+    TEST_ASSERT_GREATER_OR_EQUAL(3000, run.ac->getLastRecoveryMillis());
+    // a secondary's status frames never say whether it is logged in
+    TEST_ASSERT_EQUAL_UINT32(0, run.ac->getFastResumes());
+    TEST_ASSERT_EQUAL_UINT32(0, run.ac->getFullLogins());
+}
+
+// queues events as the uart driver would while the bus task is busy elsewhere, until the
+// event queue is full
+static void fillEventQueue(SimRun &run, uart_event_type_t first) {
+    QueueHandle_t events = run.sim->begin();
+    uart_event_t event = {};
+    event.type = first;
+    while(xQueueSend(events, &event, 0) == pdTRUE) {
+        event.type = UART_DATA;
+        event.size = 0;
+    }
+}
+
+void test_rx_overflow_keeps_the_queue_set_consistent() {
+    SimRun run = startSim(false, false);
+    runFor(run, 10000);
+    TEST_ASSERT_TRUE(run.sim->isLoggedIn());
+
+    // an overflow at the head of a full queue, and the queue full again right after it was
+    // handled. the set is only as long as its members, it must never be told about more
+    hostSetBlockedHook(nullptr, nullptr);
+    fillEventQueue(run, UART_BUFFER_FULL);
+    run.scheduler->runOnce(0);
+    fillEventQueue(run, UART_DATA);
+    for(int i=0;i<2 * kUartEventQueueSize;i++) {
+        run.scheduler->runOnce(0);
+    }
+    TEST_ASSERT_EQUAL_UINT32(1, run.ac->getRxOverflows());
+
+    hostSetBlockedHook(&runBusTask, run.scheduler);
+    runFor(run, 10000);
+    TEST_ASSERT_TRUE(run.sim->isLoggedIn());
+    TEST_ASSERT_EQUAL_UINT32(0, run.ac->getConnectionResets());
+}
+
+void test_late_replies_are_dropped() {
+    SimRun run = startSim(false, false);
+    runFor(run, 10000);
+    TEST_ASSERT_TRUE(run.sim->isLoggedIn());
+    TEST_ASSERT_EQUAL_UINT32(0, run.ac->getLateRepliesDropped());
+
+    busStallPeriod = 97;
+    busStallTicks = 60;
+    runFor(run, 30000);
+
+    // a reply that missed its slot by more than a byte never goes out
+    TEST_ASSERT_GREATER_THAN(0, run.ac->getLateRepliesDropped());
+    TEST_ASSERT_LESS_OR_EQUAL(kReplyLateLimitMicros, run.ac->getReplyJitterMax());
+
+    busStallPeriod = 0;
+    runFor(run, 10000);
+    TEST_ASSERT_TRUE(run.sim->isLoggedIn());
+}
+
+void test_every_write_gets_a_result() {
+    SimRun run = startSim(false, false);
+    runFor(run, 10000);
+    TEST_ASSERT_TRUE(run.sim->isLoggedIn());
+
+    // the first is replaced before the bus task picks it up
+    run.ac->setTemp(20, 101);
+    run.ac->setTemp(24, 102);
+    runFor(run, 5000);
+
+    WriteResult results[4];
+    int count = 0;
+    while(count < 4 && run.ac->takeWriteResult(&results[count])) {
+        count++;
+    }
+    TEST_ASSERT_EQUAL_INT(2, count);
+    TEST_ASSERT_EQUAL_UINT32(101, results[0].commandId);
+    TEST_ASSERT_EQUAL_UINT32(kWriteSuperseded, results[0].status);
+    TEST_ASSERT_EQUAL_UINT32(102, results[1].commandId);
+    TEST_ASSERT_EQUAL_UINT32(kWriteApplied, results[1].status);
+    TEST_ASSERT_EQUAL_UINT32(24, run.ac->getTemp());
+}
+
+void test_written_value_does_not_flip_back() {
+    SimRun run = startSim(false, false);
+    run.ac->setConfirmFrames(3);
+    runFor(run, 10000);
+    TEST_ASSERT_TRUE(run.sim->isLoggedIn());
+    TEST_ASSERT_EQUAL_UINT32(22, run.ac->getTemp());
+
+    publishedTempCount = 0;
+    watchedAc = run.ac;
+    run.ac->setTemp(26, 201);
+    runFor(run, 5000);
+
+    // straight from the old value to the new one, the glitch filter must not bring the old
+    // one back once the write is no longer in flight
+    TEST_ASSERT_EQUAL_INT(2, publishedTempCount);
+    TEST_ASSERT_EQUAL_UINT8(22, publishedTemps[0]);
+    TEST_ASSERT_EQUAL_UINT8(26, publishedTemps[1]);
+}
+
+void test_bad_line_is_survived() {
+    SimRun run = startSim(false, false);
+    run.sim->setLatency(5000);
+    run.sim->setByteLoss(10);
+    run.sim->setParityErrors(10);
+    run.sim->setBenchmarkInterval(3000);
+    runFor(run, 300000);
+    printMetrics("bad line", run);
+
+    TEST_ASSERT_GREATER_THAN(0, run.sim->getBytesDropped());
+    TEST_ASSERT_GREATER_THAN(0, run.sim->getParityErrorsRaised());
+    // every fault the line raised reached the driver as one
+    TEST_ASSERT_EQUAL_UINT32(run.sim->getParityErrorsRaised(), run.ac->getParityErrors());
+
+    // commands still get through, the ones caught by a fault are retried
+    TEST_ASSERT_GREATER_THAN(50, run.sim->getCommands());
+    TEST_ASSERT_LESS_OR_EQUAL(run.sim->getCommands() / 10, run.sim->getCommandTimeouts());
+    runFor(run, 10000);
+    TEST_ASSERT_TRUE(run.sim->isLoggedIn());
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_primary_logs_in_and_applies_commands);
+    RUN_TEST(test_secondary_next_to_a_wall_controller);
+    RUN_TEST(test_secondary_outage_counts_no_login);
+    RUN_TEST(test_rx_overflow_keeps_the_queue_set_consistent);
+    RUN_TEST(test_late_replies_are_dropped);
+    RUN_TEST(test_every_write_gets_a_result);
+    RUN_TEST(test_written_value_does_not_flip_back);
+    RUN_TEST(test_bad_line_is_survived);
+    return UNITY_END();
+}